@@ -0,0 +1,107 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static size_t align(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/* Data follows block header */
+static char * block_data(arena_block_t *block)
+{
+    return (char *)block + align(sizeof(arena_block_t));
+}
+
+void * arena_alloc(arena_t *arena, size_t size)
+{
+    arena_block_t *block = arena->blocks;
+    size_t block_size;
+
+    size = align(size);
+
+    if (block == NULL || block->used + size > block->size) {
+        /* After reset total is the size all blocks had, one block fits it */
+        block_size = arena->total > ARENA_BLOCK_SIZE ? arena->total : ARENA_BLOCK_SIZE;
+        if (block_size < size)
+            block_size = size;
+        if (block && block_size < 2 * block->size)
+            block_size = 2 * block->size;
+
+        block = (arena_block_t *)malloc(align(sizeof(arena_block_t)) + block_size);
+        if (block == NULL)
+            return NULL;
+
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->blocks;
+        if (arena->blocks)
+            arena->total += block_size;
+        else
+            arena->total = block_size;
+        arena->blocks = block;
+    }
+
+    arena->last = block->used;
+    block->used += size;
+
+    return block_data(block) + arena->last;
+}
+
+void * arena_calloc(arena_t *arena, size_t size)
+{
+    void *ptr = arena_alloc(arena, size);
+
+    if (ptr)
+        memset(ptr, 0, size);
+
+    return ptr;
+}
+
+/* Grow the last allocation in place if current block has room */
+bool arena_extend(arena_t *arena, void *ptr, size_t size)
+{
+    arena_block_t *block = arena->blocks;
+
+    if (block == NULL || (char *)ptr != block_data(block) + arena->last)
+        return false;
+
+    size = align(size);
+    if (arena->last + size > block->size)
+        return false;
+
+    block->used = arena->last + size;
+
+    return true;
+}
+
+/* Forget all allocations. If they didn't fit one block, blocks are freed
+ * and the next allocation takes one block of their total size, so a
+ * repeated workload settles without allocations */
+void arena_reset(arena_t *arena)
+{
+    arena_block_t *block = arena->blocks;
+
+    if (block && block->next == NULL) {
+        block->used = 0;
+        arena->last = 0;
+        return;
+    }
+
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->last = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->blocks);
+    arena->blocks = NULL;
+    arena->total = 0;
+}
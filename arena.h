@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+
+#define ARENA_BLOCK_SIZE    4096
+#define ARENA_ALIGN         16
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t  size;
+    size_t  used;
+} arena_block_t;
+
+/* Bump allocator for data of one exchange over connection. Nothing is
+ * freed separately, reset drops everything at once. Zeroed arena is empty */
+typedef struct arena {
+    arena_block_t   *blocks;    /* Current block first */
+    size_t          total;      /* Size of all blocks */
+    size_t          last;       /* Offset of the last allocation in current block */
+} arena_t;
+
+void * arena_alloc(arena_t *arena, size_t size);
+void * arena_calloc(arena_t *arena, size_t size);
+bool arena_extend(arena_t *arena, void *ptr, size_t size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif // ARENA_H
@@ -0,0 +1,701 @@
+#include "batch.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "pool.h"
+#include "deque.h"
+#include "event_loop.h"
+#include "resolver.h"
+#include "trace.h"
+#include "log.h"
+
+/* Urls read ahead while their hosts are busy, per request slot */
+#define PENDING_PER_JOB     4
+/* Times an unanswered pipelined request is sent again */
+#define MAX_ATTEMPTS        3
+/* Worker without connections waits this long for a busy host before it
+ * checks again, wakeups come through eventfd anyway */
+#define WAKE_TIMEOUT_MS     1000
+
+/* Connection shared by requests pipelined over it */
+typedef struct batch_conn {
+    connection_t    *conn;
+    size_t          bytes_before;   /* Connection counter when requests started */
+    int             refs;
+} batch_conn_t;
+
+typedef struct transfer {
+    url_t           *url;
+    batch_conn_t    *conn;
+    int             attempts;
+    trace_t         trace;      /* Wait for asynchronous lookup of host */
+    struct batch    *batch;
+    struct transfer *next;
+} transfer_t;
+
+/* Urls of input, read by workers of all threads under lock */
+typedef struct batch_source {
+    FILE                *input;
+    char                **urls;
+    int                 count;
+    const url_list_t    *list;
+    size_t              next_url;
+    char                *line;
+    size_t              line_size;
+    bool                eof;
+    pthread_mutex_t     lock;
+} batch_source_t;
+
+struct batch;
+
+/* Event loops in several threads, each one runs its own batch. Limit of
+ * connections per host is shared by their pools */
+typedef struct batch_workers {
+    struct batch        *batches;
+    int                 count;
+    pool_limits_t       *limits;
+} batch_workers_t;
+
+typedef struct batch {
+    batch_options_t     options;
+    event_loop_t        *loop;
+    connection_pool_t   *pool;
+    batch_source_t      *source;
+
+    /* Worker of several threads. Urls read from source wait in deque, where
+     * idle workers steal them from. Connections stay in thread of loop */
+    batch_workers_t     *workers;
+    work_deque_t        deque;
+    int                 wake_fd;    /* Connection to busy host has been freed */
+    int                 index;
+    pthread_t           thread;
+
+    /* Urls waiting for a free slot or connection to their host */
+    transfer_t          *pending;
+    transfer_t          *pending_tail;
+    int                 pending_count;
+    int                 in_flight;
+
+    /* Summary */
+    int                 total;
+    int                 failed;
+    size_t              bytes;
+} batch_t;
+
+static void schedule(batch_t *b);
+
+static const char * next_line(batch_source_t *src)
+{
+    ssize_t len;
+    char *url;
+
+    if (src->input == NULL)
+        return src->next_url < (size_t)src->count ? src->urls[src->next_url++] : NULL;
+
+    while ((len = getline(&src->line, &src->line_size, src->input)) >= 0) {
+        url = src->line;
+        while (len > 0 && isspace((unsigned char)url[len - 1]))
+            url[--len] = '\0';
+        while (isspace((unsigned char)*url))
+            url++;
+
+        /* Skip empty lines and comments */
+        if (*url == '\0' || *url == '#')
+            continue;
+
+        return url;
+    }
+
+    return NULL;
+}
+
+/* Next url of input. Returns NULL with error if it's invalid, NULL without
+ * error when input is over */
+static url_t * next_url(batch_source_t *src, int *error)
+{
+    const url_entry_t *entry;
+    const char *line;
+    url_t *url;
+
+    *error = 0;
+
+    if (src->list) {
+        if (src->next_url == src->list->count)
+            return NULL;
+
+        entry = &src->list->entries[src->next_url];
+        url = url_list_get(src->list, src->next_url++, error);
+        if (url == NULL) {
+            LOG_E("%.*s", (int)entry->length, src->list->data + entry->line);
+            print_url_error(*error);
+        }
+        return url;
+    }
+
+    line = next_line(src);
+    if (line == NULL)
+        return NULL;
+
+    url = parse_url(line, error);
+    if (url == NULL) {
+        LOG_E("%s", line);
+        print_url_error(*error);
+    }
+
+    return url;
+}
+
+/* Next transfer of source, NULL once it's over. Invalid urls are counted
+ * as failed and skipped */
+static transfer_t * read_transfer(batch_t *b)
+{
+    batch_source_t *src = b->source;
+    transfer_t *t;
+    url_t *url = NULL;
+    int error = 0;
+
+    pthread_mutex_lock(&src->lock);
+    while (!src->eof && url == NULL) {
+        url = next_url(src, &error);
+        if (url == NULL && error == 0) {
+            src->eof = true;
+            break;
+        }
+
+        b->total++;
+        if (url == NULL)
+            b->failed++;
+    }
+    pthread_mutex_unlock(&src->lock);
+
+    if (url == NULL)
+        return NULL;
+
+    t = (transfer_t *)calloc(1, sizeof(transfer_t));
+    if (t == NULL) {
+        free_url(url);
+        b->failed++;
+        return NULL;
+    }
+    t->batch = b;
+    t->url = url;
+
+    return t;
+}
+
+/* Oldest waiting url of another worker, its order of input is kept */
+static transfer_t * steal_transfer(batch_t *b)
+{
+    batch_workers_t *w = b->workers;
+    transfer_t *t;
+
+    for (int i = 1; i < w->count; ++i) {
+        t = (transfer_t *)deque_steal(&w->batches[(b->index + i) % w->count].deque);
+        if (t != NULL)
+            return t;
+    }
+
+    return NULL;
+}
+
+/* Url for free slot. Worker of several threads reads source by chunks into
+ * its deque, which other workers steal from once source is over */
+static transfer_t * take_transfer(batch_t *b)
+{
+    transfer_t *t;
+
+    if (b->workers == NULL)
+        return read_transfer(b);
+
+    t = (transfer_t *)deque_pop(&b->deque);
+    if (t == NULL) {
+        for (int i = 0; i < b->options.jobs; ++i) {
+            t = read_transfer(b);
+            if (t == NULL || deque_push(&b->deque, t) != 0)
+                break;
+            t = NULL;
+        }
+        if (t == NULL)
+            t = (transfer_t *)deque_pop(&b->deque);
+    }
+    if (t == NULL)
+        t = steal_transfer(b);
+
+    if (t != NULL)
+        t->batch = b;
+
+    return t;
+}
+
+static void free_transfer(transfer_t *t)
+{
+    free_url(t->url);
+    free(t);
+}
+
+static void push_pending(batch_t *b, transfer_t *t)
+{
+    t->next = NULL;
+    if (b->pending_tail)
+        b->pending_tail->next = t;
+    else
+        b->pending = t;
+    b->pending_tail = t;
+    b->pending_count++;
+}
+
+static void remove_pending(batch_t *b, transfer_t *prev, transfer_t *t)
+{
+    if (prev)
+        prev->next = t->next;
+    else
+        b->pending = t->next;
+    if (b->pending_tail == t)
+        b->pending_tail = prev;
+    b->pending_count--;
+}
+
+static void release_conn(batch_t *b, batch_conn_t *c)
+{
+    if (--c->refs > 0)
+        return;
+
+    b->bytes += c->conn->bytes_received - c->bytes_before;
+    pool_release(b->pool, c->conn);
+    free(c);
+}
+
+static void transfer_done(void *context, int status)
+{
+    transfer_t *t = (transfer_t *)context;
+    batch_t *b = t->batch;
+    batch_conn_t *c = t->conn;
+
+    b->in_flight--;
+    t->conn = NULL;
+
+    /* Every round answers something before graceful close, so only
+     * broken connections count as attempts */
+    if (status == HTTP_REQUEUE_CLOSED || (status == HTTP_REQUEUE && ++t->attempts < MAX_ATTEMPTS)) {
+        push_pending(b, t);
+    }
+    else {
+        if (status == HTTP_REQUEUE) {
+            LOG_E("Giving up %s%s after %d attempts", t->url->host, t->url->target, t->attempts);
+        }
+        if (status != 0)
+            b->failed++;
+        free_transfer(t);
+    }
+
+    release_conn(b, c);
+
+    /* Slot and maybe connection to the same host are free now */
+    schedule(b);
+}
+
+/* Transfers waiting for their host can be started now */
+static void host_resolved(void *context, int error)
+{
+    schedule((batch_t *)context);
+}
+
+static bool same_origin(const url_t *a, const url_t *b)
+{
+    return strcmp(a->host, b->host) == 0 && strcmp(a->port, b->port) == 0;
+}
+
+/* Start request for pending transfer t, and pipeline following pending
+ * transfers to the same host over its connection. Started transfers are
+ * removed from pending list. Returns false if host has no free connection */
+static bool start_transfers(batch_t *b, transfer_t *prev, transfer_t *t)
+{
+    int error = 0, count = 0, limit;
+    batch_conn_t *c;
+    dns_addrs_t *addrs;
+    url_t **urls = NULL;
+    void **contexts = NULL;
+    transfer_t *p, *p_prev, *next;
+
+    /* Host is resolved in resolver thread while other transfers go on */
+    addrs = resolver_lookup_async(resolver_default(), t->url->host, t->url->port,
+                                  b->loop, host_resolved, b, &error);
+    if (addrs == NULL) {
+        if (error == RESOLVER_PENDING) {
+            TRACE_MARK_ONCE(&t->trace, TRACE_DNS_START);
+            return false;
+        }
+
+        LOG_E("%s", t->url->host);
+        print_resolver_error(error);
+        goto err;
+    }
+    dns_addrs_release(addrs);
+    if (t->trace.at[TRACE_DNS_START])
+        TRACE_MARK_ONCE(&t->trace, TRACE_DNS_DONE);
+
+    c = (batch_conn_t *)calloc(1, sizeof(batch_conn_t));
+    if (c == NULL)
+        goto err;
+
+    c->conn = pool_acquire(b->pool, t->url->host, t->url->port, &error);
+    if (c->conn == NULL) {
+        free(c);
+        if (error == POOL_HOST_LIMIT)
+            return false;
+
+        print_pool_error(error);
+        goto err;
+    }
+    c->bytes_before = c->conn->bytes_received;
+
+    /* New connection has been resolved while transfer waited */
+    if (!c->conn->reused && t->trace.at[TRACE_DNS_START]) {
+        c->conn->trace.at[TRACE_DNS_START] = t->trace.at[TRACE_DNS_START];
+        c->conn->trace.at[TRACE_DNS_DONE] = t->trace.at[TRACE_DNS_DONE];
+    }
+
+    limit = b->options.pipeline > 1 ? b->options.pipeline : 1;
+    if (limit > b->options.jobs - b->in_flight)
+        limit = b->options.jobs - b->in_flight;
+
+    urls = (url_t **)calloc(limit, sizeof(url_t *));
+    contexts = (void **)calloc(limit, sizeof(void *));
+    if (urls == NULL || contexts == NULL)
+        goto err_conn;
+
+    remove_pending(b, prev, t);
+    urls[count] = t->url;
+    contexts[count++] = t;
+
+    for (p_prev = prev, p = prev ? prev->next : b->pending; p && count < limit; p = next) {
+        next = p->next;
+        if (!same_origin(p->url, t->url)) {
+            p_prev = p;
+            continue;
+        }
+        remove_pending(b, p_prev, p);
+        urls[count] = p->url;
+        contexts[count++] = p;
+    }
+
+    for (int i = 0; i < count; ++i)
+        ((transfer_t *)contexts[i])->conn = c;
+    c->refs = count;
+    b->in_flight += count;
+
+    if (count == 1)
+        error = http_make_request_async(b->loop, c->conn, t->url, transfer_done, t);
+    else
+        error = http_pipeline_async(b->loop, c->conn, urls, contexts, count, transfer_done);
+
+    if (error) {
+        b->in_flight -= count;
+        b->failed += count;
+        for (int i = 0; i < count; ++i)
+            free_transfer((transfer_t *)contexts[i]);
+        c->refs = 1;
+        release_conn(b, c);
+    }
+
+    free(urls);
+    free(contexts);
+
+    return true;
+
+err_conn:
+    free(urls);
+    free(contexts);
+    pool_release(b->pool, c->conn);
+    free(c);
+err:
+    remove_pending(b, prev, t);
+    b->failed++;
+    free_transfer(t);
+
+    return true;
+}
+
+static void schedule(batch_t *b)
+{
+    transfer_t *t, *prev = NULL;
+    int limit = b->options.jobs * PENDING_PER_JOB;
+
+    /* Urls of worker wait in its deque where they can be stolen. It takes
+     * one per free slot, besides those waiting for busy hosts */
+    if (b->workers && b->pending_count + b->options.jobs - b->in_flight < limit)
+        limit = b->pending_count + b->options.jobs - b->in_flight;
+
+    while (b->pending_count < limit && (t = take_transfer(b)) != NULL)
+        push_pending(b, t);
+
+    /* Urls go in order of input unless their host is busy */
+    t = b->pending;
+    while (t != NULL && b->in_flight < b->options.jobs) {
+        if (start_transfers(b, prev, t)) {
+            t = prev ? prev->next : b->pending;
+            continue;
+        }
+        prev = t;
+        t = t->next;
+    }
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_summary(batch_t *b, double seconds)
+{
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    LOG_I("\nDownloaded %d of %d urls, %d failed", b->total - b->failed, b->total, b->failed);
+    LOG_I("%zu bytes in %.3f s, %.2f MB/s, %.1f requests/s", b->bytes, seconds,
+          b->bytes / seconds / (1024*1024), b->total / seconds);
+}
+
+/* Release batch state of one loop, its counters stay */
+static void free_batch(batch_t *b)
+{
+    while (b->pending) {
+        transfer_t *next = b->pending->next;
+        free_transfer(b->pending);
+        b->pending = next;
+    }
+    pool_free(b->pool);
+    if (b->loop)
+        resolver_detach(resolver_default(), b->loop);
+    event_loop_free(b->loop);
+    b->pool = NULL;
+    b->loop = NULL;
+}
+
+static int run_batch(batch_t *b)
+{
+    int error = 0;
+    struct timespec start;
+
+    if (b->options.jobs < 1)
+        b->options.jobs = BATCH_DEFAULT_JOBS;
+
+    b->pool = pool_create(b->options.max_per_host, b->options.idle_timeout);
+    b->loop = event_loop_create(&error);
+    if (b->pool == NULL || b->loop == NULL || pool_watch_idle(b->pool, b->loop) != 0) {
+        error = -1;
+        goto exit;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    schedule(b);
+    event_loop_run(b->loop);
+
+    print_summary(b, elapsed_since(&start));
+    error = b->failed;
+
+exit:
+    free_batch(b);
+
+    return error ? -1 : 0;
+}
+
+/* Connection to host which was at its limit is free, workers waiting for
+ * it are woken in their threads */
+static void wake_workers(void *context)
+{
+    batch_workers_t *w = (batch_workers_t *)context;
+    uint64_t one = 1;
+
+    for (int i = 0; i < w->count; ++i) {
+        if (write(w->batches[i].wake_fd, &one, sizeof one) < 0)
+            LOG_D("Failed to wake worker %d", i);
+    }
+}
+
+static void worker_woken(void *context)
+{
+    batch_t *b = (batch_t *)context;
+    uint64_t count;
+
+    if (read(b->wake_fd, &count, sizeof count) < 0)
+        LOG_D("Nothing to read from eventfd");
+
+    schedule(b);
+}
+
+/* Run loop of worker until no url is left for it. Loop ends when its
+ * connections are over, worker without them waits for busy hosts */
+static void * run_worker(void *context)
+{
+    batch_t *b = (batch_t *)context;
+    struct pollfd pfd = { b->wake_fd, POLLIN, 0 };
+
+    for (;;) {
+        schedule(b);
+        if (b->loop->active > 0) {
+            event_loop_run(b->loop);
+            continue;
+        }
+
+        if (b->pending_count == 0)
+            break;
+
+        if (poll(&pfd, 1, WAKE_TIMEOUT_MS) > 0)
+            worker_woken(b);
+    }
+
+    return NULL;
+}
+
+static int init_worker(batch_workers_t *w, batch_t *b, const batch_t *shared, int index)
+{
+    int error = 0;
+
+    *b = *shared;
+    b->workers = w;
+    b->index = index;
+    b->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    b->pool = pool_create(b->options.max_per_host, b->options.idle_timeout);
+    b->loop = event_loop_create(&error);
+    if (b->wake_fd < 0 || b->pool == NULL || b->loop == NULL ||
+        deque_init(&b->deque, b->options.jobs) != 0 || pool_watch_idle(b->pool, b->loop) != 0)
+        return -1;
+
+    pool_share_limits(b->pool, w->limits);
+
+    return event_loop_watch(b->loop, b->wake_fd, worker_woken, b);
+}
+
+/* Every thread runs its own loop and pool, jobs are split between them and
+ * limit of connections per host is common */
+static int run_workers(batch_t *shared, int threads)
+{
+    batch_workers_t w;
+    struct timespec start;
+    int started = 0, status = 0;
+
+    memset(&w, 0, sizeof w);
+    shared->options.jobs = (shared->options.jobs + threads - 1) / threads;
+
+    w.batches = (batch_t *)calloc(threads, sizeof(batch_t));
+    w.limits = pool_limits_create(shared->options.max_per_host, wake_workers, &w);
+    if (w.batches == NULL || w.limits == NULL) {
+        status = -1;
+        goto exit;
+    }
+    w.count = threads;
+    for (int i = 0; i < threads; ++i)
+        w.batches[i].wake_fd = -1;
+
+    for (int i = 0; i < threads; ++i) {
+        if (init_worker(&w, &w.batches[i], shared, i) != 0) {
+            LOG_E("Failed to create worker %d", i);
+            status = -1;
+            goto exit;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (started = 0; started < threads; ++started) {
+        if (pthread_create(&w.batches[started].thread, NULL, run_worker, &w.batches[started]) != 0) {
+            LOG_E("Failed to start worker thread");
+            break;
+        }
+    }
+    for (int i = 0; i < started; ++i)
+        pthread_join(w.batches[i].thread, NULL);
+
+    /* Counters of all workers, urls are read by one and may be finished
+     * by another */
+    for (int i = 0; i < threads; ++i) {
+        shared->total += w.batches[i].total;
+        shared->failed += w.batches[i].failed;
+        shared->bytes += w.batches[i].bytes;
+    }
+    print_summary(shared, elapsed_since(&start));
+
+    if (started < threads || shared->failed)
+        status = -1;
+
+exit:
+    for (int i = 0; i < w.count; ++i) {
+        batch_t *b = &w.batches[i];
+        transfer_t *t;
+
+        free_batch(b);
+        while (b->deque.items && (t = (transfer_t *)deque_pop(&b->deque)) != NULL)
+            free_transfer(t);
+        deque_release(&b->deque);
+        if (b->wake_fd >= 0)
+            close(b->wake_fd);
+    }
+    free(w.batches);
+    pool_limits_free(w.limits);
+
+    return status;
+}
+
+static int start_batch(batch_t *b, batch_source_t *src)
+{
+    int status;
+
+    pthread_mutex_init(&src->lock, NULL);
+    b->source = src;
+
+    if (b->options.jobs < 1)
+        b->options.jobs = BATCH_DEFAULT_JOBS;
+
+    if (b->options.threads > 1)
+        status = run_workers(b, b->options.threads);
+    else
+        status = run_batch(b);
+
+    free(src->line);
+    pthread_mutex_destroy(&src->lock);
+
+    return status;
+}
+
+int batch_download(FILE *input, char *urls[], int count, const batch_options_t *options)
+{
+    batch_source_t src;
+    batch_t b;
+
+    memset(&b, 0, sizeof b);
+    memset(&src, 0, sizeof src);
+    b.options = *options;
+    src.input = input;
+    src.urls = urls;
+    src.count = count;
+
+    return start_batch(&b, &src);
+}
+
+int batch_download_list(const url_list_t *list, const batch_options_t *options)
+{
+    batch_source_t src;
+    batch_t b;
+
+    memset(&b, 0, sizeof b);
+    memset(&src, 0, sizeof src);
+    b.options = *options;
+    src.list = list;
+
+    return start_batch(&b, &src);
+}
@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdio>
+
+#include "url.h"
+
+#define BATCH_DEFAULT_JOBS  16
+
+typedef struct batch_options {
+    int     jobs;           /* Requests in flight at the same time */
+    int     max_per_host;   /* Connections to one host */
+    int     idle_timeout;   /* Seconds to keep unused connection */
+    int     pipeline;       /* Requests sent over connection without waiting */
+    int     threads;        /* Event loops in their own threads, each one has share of
+                             * jobs and its connections, limit per host is common */
+} batch_options_t;
+
+/* Download urls read line by line from input, or taken from urls array if
+ * input is NULL. Urls are read only when there is a free slot to start them */
+int batch_download(FILE *input, char *urls[], int count, const batch_options_t *options);
+/* Download urls of a list parsed in advance */
+int batch_download_list(const url_list_t *list, const batch_options_t *options);
+
+#endif // BATCH_H
@@ -0,0 +1,38 @@
+#include "bench.h"
+
+#include <cstdlib>
+
+/* glibc exports its allocator under these names, calls are counted and
+ * passed through */
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+}
+
+uint64_t bench_allocations()
+{
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
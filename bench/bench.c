@@ -0,0 +1,92 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "resolver.h"
+#include "event_loop.h"
+
+#define DEFAULT_LARGE_MB    64
+#define DEFAULT_SMALL_COUNT 2000
+
+static int saved_stdout = -1;
+
+double bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_quiet()
+{
+    int null_fd;
+
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+}
+
+void bench_loud()
+{
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+}
+
+void print_usage()
+{
+    printf("Usage: http_bench [-m | -e] [-u] [-s large_mb] [-n small_count]\n");
+    printf("  -m    Microbenchmarks only\n");
+    printf("  -e    End-to-end loopback benchmarks only\n");
+    printf("  -u    Batch downloads receive through io_uring\n");
+}
+
+int main(int argc, char *argv[])
+{
+    size_t large_mb = DEFAULT_LARGE_MB;
+    int small_count = DEFAULT_SMALL_COUNT;
+    bool micro = true, e2e = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "meus:n:")) != -1) {
+        switch (opt) {
+        case 'm':
+            e2e = false;
+            break;
+        case 'e':
+            micro = false;
+            break;
+        case 'u':
+            event_loop_use_backend(LOOP_BACKEND_URING);
+            break;
+        case 's':
+            large_mb = atoi(optarg);
+            break;
+        case 'n':
+            small_count = atoi(optarg);
+            break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (micro)
+        run_micro();
+    if (e2e)
+        run_e2e(large_mb << 20, small_count);
+
+    resolver_free_default();
+
+    return 0;
+}
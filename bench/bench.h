@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Allocations made by process, malloc family is wrapped in alloc.c */
+uint64_t bench_allocations();
+
+double bench_now();
+
+/* Output of downloads goes to /dev/null while scenario runs */
+void bench_quiet();
+void bench_loud();
+
+/* Loopback server, see server.c. Paths:
+ *   /cl/SIZE               body with Content-Length
+ *   /chunked/SIZE/CHUNK    chunked body
+ *   /slow/SIZE/DELAY_US    1KB pieces with delay between them */
+int server_start();
+void server_stop();
+
+void run_micro();
+void run_e2e(size_t large_size, int small_count);
+
+#endif // BENCH_H
@@ -0,0 +1,199 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "url.h"
+#include "connect.h"
+#include "http.h"
+#include "batch.h"
+#include "coclient.h"
+
+#define SMALL_SIZE      1024
+#define SLOW_COUNT      8
+#define SLOW_SIZE       (64*1024)
+#define SLOW_DELAY_US   200
+
+static int port;
+
+static void report(const char *name, int requests, size_t bytes, double seconds,
+                   uint64_t allocations, int status)
+{
+    printf("  %-32s %6d req %10.1f MB/s %10.1f req/s %8.1f allocs/req%s\n", name, requests,
+           bytes / seconds / 1e6, requests / seconds, (double)allocations / requests,
+           status ? "  FAILED" : "");
+}
+
+/* One request over a fresh connection, like a plain command line download */
+static void single(const char *name, const char *path, size_t bytes)
+{
+    char address[256];
+    uint64_t allocations;
+    double start, seconds;
+    int error = 0, status = 1;
+    url_t *url;
+    connection_t *conn;
+
+    snprintf(address, sizeof address, "http://127.0.0.1:%d%s", port, path);
+
+    bench_quiet();
+    allocations = bench_allocations();
+    start = bench_now();
+
+    url = parse_url(address, &error);
+    if (!error) {
+        conn = init_connection(url->host, url->port, &error);
+        if (!error) {
+            status = http_make_request(conn, url);
+            free_connection(conn);
+        }
+        unlink(url->file);
+        free_url(url);
+    }
+
+    seconds = bench_now() - start;
+    allocations = bench_allocations() - allocations;
+    bench_loud();
+
+    report(name, 1, bytes, seconds, allocations, status);
+}
+
+/* Count objects at /PREFIX/NAME, downloaded by batch scheduler */
+static void many(const char *name, const char *prefix, int count, size_t size, int pipeline)
+{
+    batch_options_t options = { BATCH_DEFAULT_JOBS, 8, 30, pipeline };
+    char **urls, file[32];
+    uint64_t allocations;
+    double start, seconds;
+    int status;
+
+    urls = (char **)malloc(count * sizeof(char *));
+    for (int i = 0; i < count; ++i) {
+        urls[i] = (char *)malloc(256);
+        snprintf(urls[i], 256, "http://127.0.0.1:%d%s/o%d", port, prefix, i);
+    }
+
+    bench_quiet();
+    allocations = bench_allocations();
+    start = bench_now();
+
+    status = batch_download(NULL, urls, count, &options);
+
+    seconds = bench_now() - start;
+    allocations = bench_allocations() - allocations;
+    bench_loud();
+
+    report(name, count, size * count, seconds, allocations, status);
+
+    for (int i = 0; i < count; ++i) {
+        snprintf(file, sizeof file, "o%d", i);
+        unlink(file);
+        free(urls[i]);
+    }
+    free(urls);
+}
+
+typedef struct co_work {
+    char    **urls;
+    int     count;
+    int     next;
+    size_t  bytes;
+    int     failed;
+} co_work_t;
+
+/* Takes the next url once its previous response has been read */
+static co_task<void> co_worker(co_client &client, co_work_t *work)
+{
+    while (work->next < work->count) {
+        co_response response = co_await client.get(work->urls[work->next++]);
+
+        for (co_span span; (span = co_await response.read()).size; )
+            work->bytes += span.size;
+        if (response.error() || response.status() != 200)
+            work->failed++;
+    }
+}
+
+/* The same objects read by coroutines into memory, as many at a time as
+ * batch has requests in flight */
+static void coroutines(const char *name, const char *prefix, int count)
+{
+    co_work_t work = { NULL, count, 0, 0, 0 };
+    uint64_t allocations;
+    double start, seconds;
+    int status;
+
+    work.urls = (char **)malloc(count * sizeof(char *));
+    for (int i = 0; i < count; ++i) {
+        work.urls[i] = (char *)malloc(256);
+        snprintf(work.urls[i], 256, "http://127.0.0.1:%d%s/o%d", port, prefix, i);
+    }
+
+    allocations = bench_allocations();
+    start = bench_now();
+
+    {
+        co_client client(8);
+        for (int i = 0; i < BATCH_DEFAULT_JOBS; ++i)
+            client.spawn(co_worker(client, &work));
+        status = client.run() != 0 || work.failed;
+    }
+
+    seconds = bench_now() - start;
+    allocations = bench_allocations() - allocations;
+
+    report(name, count, work.bytes, seconds, allocations, status);
+
+    for (int i = 0; i < count; ++i)
+        free(work.urls[i]);
+    free(work.urls);
+}
+
+void run_e2e(size_t large_size, int small_count)
+{
+    char dir[] = "/tmp/http-bench-XXXXXX", path[128], prefix[64], name[64];
+    char cwd[4096];
+
+    port = server_start();
+    if (port < 0)
+        return;
+
+    if (!getcwd(cwd, sizeof cwd) || !mkdtemp(dir) || chdir(dir) != 0) {
+        perror("Failed to create download directory");
+        server_stop();
+        return;
+    }
+
+    printf("End-to-end over loopback, port %d\n", port);
+
+    snprintf(path, sizeof path, "/cl/%zu/large", large_size);
+    snprintf(name, sizeof name, "content-length %zuMB", large_size >> 20);
+    single(name, path, large_size);
+
+    snprintf(path, sizeof path, "/chunked/%zu/16384/large", large_size);
+    snprintf(name, sizeof name, "chunked %zuMB, 16KB chunks", large_size >> 20);
+    single(name, path, large_size);
+
+    snprintf(path, sizeof path, "/chunked/%zu/512/large", large_size);
+    snprintf(name, sizeof name, "chunked %zuMB, 512B chunks", large_size >> 20);
+    single(name, path, large_size);
+
+    snprintf(prefix, sizeof prefix, "/cl/%d", SMALL_SIZE);
+    many("small objects", prefix, small_count, SMALL_SIZE, 1);
+    many("small objects, pipeline 8", prefix, small_count, SMALL_SIZE, 8);
+    coroutines("small objects, coroutines", prefix, small_count);
+
+    snprintf(prefix, sizeof prefix, "/chunked/%d/256", SMALL_SIZE);
+    many("small chunked objects", prefix, small_count, SMALL_SIZE, 1);
+
+    snprintf(prefix, sizeof prefix, "/slow/%d/%d", SLOW_SIZE, SLOW_DELAY_US);
+    many("slow drip", prefix, SLOW_COUNT, SLOW_SIZE, 1);
+
+    if (chdir(cwd) != 0)
+        perror("chdir");
+    rmdir(dir);
+    server_stop();
+}
@@ -0,0 +1,274 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "url.h"
+#include "buffer.h"
+#include "parser.h"
+#include "chunked.h"
+#include "scan.h"
+#include "digest.h"
+
+#define MIN_SECONDS     0.3
+#define CHUNKED_SIZE    (4*1024*1024)
+#define SCAN_SIZE       (1024*1024)
+#define DIGEST_DATA_SIZE (1024*1024)
+
+static const char *bench_url = "http://downloads.example.com:8080/pub/releases/v1.2/archive.tar.gz?mirror=eu#top";
+
+static const char *bench_header =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 12 Oct 2026 10:00:00 GMT\r\n"
+    "Server: Apache/2.4.57 (Unix)\r\n"
+    "Last-Modified: Fri, 09 Oct 2026 08:30:00 GMT\r\n"
+    "ETag: \"5f3a-2c1b9e4d7a800\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 1048576\r\n"
+    "Cache-Control: max-age=3600, public\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Keep-Alive: timeout=5, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+
+/* Runs op with doubling iteration count until it takes MIN_SECONDS */
+typedef void (*bench_op)(void *context, long iterations);
+
+static void measure(const char *name, bench_op op, void *context, size_t bytes_per_op)
+{
+    uint64_t allocations;
+    double start, seconds;
+    long iterations = 1;
+
+    while (1) {
+        allocations = bench_allocations();
+        start = bench_now();
+        op(context, iterations);
+        seconds = bench_now() - start;
+        allocations = bench_allocations() - allocations;
+        if (seconds >= MIN_SECONDS)
+            break;
+        iterations *= seconds < MIN_SECONDS / 16 ? 8 : 2;
+    }
+
+    printf("  %-32s %12.1f ns/op %8.2f allocs/op", name,
+           seconds * 1e9 / iterations, (double)allocations / iterations);
+    if (bytes_per_op)
+        printf(" %10.1f MB/s", (double)bytes_per_op * iterations / seconds / 1e6);
+    printf("\n");
+}
+
+static void op_parse_url(void *context, long iterations)
+{
+    int error;
+
+    for (long i = 0; i < iterations; ++i) {
+        url_t *url = parse_url(bench_url, &error);
+        free_url(url);
+    }
+}
+
+static void op_parse_url_view(void *context, long iterations)
+{
+    size_t len = strlen(bench_url);
+    url_view_t view;
+
+    for (long i = 0; i < iterations; ++i)
+        url_parse_view(bench_url, len, &view);
+}
+
+static void on_header(void *context, const char *name, size_t name_len,
+                      const char *value, size_t value_len)
+{
+    (*(size_t *)context)++;
+}
+
+static void op_parse_header(void *context, long iterations)
+{
+    size_t len = strlen(bench_header), headers = 0;
+    http_parser_t parser;
+
+    for (long i = 0; i < iterations; ++i) {
+        http_parser_init(&parser, on_header, &headers);
+        http_parser_execute(&parser, bench_header, len);
+    }
+}
+
+/* Header arrives in small reads, parser resumes after each one */
+static void op_parse_header_split(void *context, long iterations)
+{
+    size_t len = strlen(bench_header), step = *(size_t *)context, headers = 0;
+    http_parser_t parser;
+
+    for (long i = 0; i < iterations; ++i) {
+        http_parser_init(&parser, on_header, &headers);
+        for (size_t received = step; received < len + step; received += step)
+            http_parser_execute(&parser, bench_header, received < len ? received : len);
+    }
+}
+
+static void append_request(buffer_t *buffer)
+{
+    buffer_appendf(buffer, "GET %s HTTP/1.1\r\n", "/pub/releases/v1.2/archive.tar.gz");
+    buffer_appendf(buffer, "Host: %s:%s\r\n", "downloads.example.com", "8080");
+    buffer_appendf(buffer, "Range: bytes=%zu-%zu\r\n", (size_t)1048576, (size_t)2097151);
+    buffer_appendf(buffer, "Connection: keep-alive\r\n\r\n");
+}
+
+static void op_buffer_appendf(void *context, long iterations)
+{
+    for (long i = 0; i < iterations; ++i) {
+        buffer_t *buffer = buffer_alloc(64);
+        append_request(buffer);
+        buffer_free(buffer);
+    }
+}
+
+/* Like requests over one connection, arena is reset between them */
+static void op_buffer_appendf_arena(void *context, long iterations)
+{
+    arena_t arena;
+    buffer_t buffer;
+
+    memset(&arena, 0, sizeof arena);
+    for (long i = 0; i < iterations; ++i) {
+        arena_reset(&arena);
+        buffer_init(&buffer, 64, &arena);
+        append_request(&buffer);
+    }
+    arena_free(&arena);
+}
+
+typedef struct chunked_input {
+    char    *data;
+    size_t  len;
+    size_t  piece;      /* Bytes given to decoder at once */
+} chunked_input_t;
+
+static int count_data(void *context, const char *data, size_t bytes)
+{
+    *(size_t *)context += bytes;
+    return 0;
+}
+
+static void op_chunked(void *context, long iterations)
+{
+    chunked_input_t *input = (chunked_input_t *)context;
+    chunked_decoder_t decoder;
+    size_t decoded = 0, consumed, offset, n;
+
+    for (long i = 0; i < iterations; ++i) {
+        chunked_init(&decoder, count_data, &decoded);
+        for (offset = 0; offset < input->len; offset += n) {
+            n = input->len - offset < input->piece ? input->len - offset : input->piece;
+            chunked_decode(&decoder, input->data + offset, n, &consumed);
+        }
+    }
+}
+
+/* Chunked encoding of CHUNKED_SIZE bytes in chunks of given size */
+static void make_chunked(chunked_input_t *input, size_t chunk)
+{
+    size_t size = CHUNKED_SIZE, n;
+
+    input->data = (char *)malloc(size + (size / chunk + 2) * 24);
+    input->len = 0;
+    while (size > 0) {
+        n = size < chunk ? size : chunk;
+        input->len += sprintf(input->data + input->len, "%zx\r\n", n);
+        memset(input->data + input->len, 'x', n);
+        input->len += n;
+        input->len += sprintf(input->data + input->len, "\r\n");
+        size -= n;
+    }
+    input->len += sprintf(input->data + input->len, "0\r\n\r\n");
+}
+
+static void op_scan(void *context, long iterations)
+{
+    const char *data = (const char *)context;
+    volatile const char *found;
+
+    for (long i = 0; i < iterations; ++i)
+        found = scan_char(data, data + SCAN_SIZE, '\n');
+    (void)found;
+}
+
+typedef struct digest_input {
+    enum digest_algorithm algorithm;
+    char    *data;
+} digest_input_t;
+
+static void op_digest(void *context, long iterations)
+{
+    digest_input_t *input = (digest_input_t *)context;
+    digest_value_t value;
+    digest_t digest;
+
+    for (long i = 0; i < iterations; ++i) {
+        digest_init(&digest, input->algorithm);
+        digest_update(&digest, input->data, DIGEST_DATA_SIZE);
+        digest_final(&digest, &value);
+    }
+}
+
+void run_micro()
+{
+    static const enum scan_impl impls[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+    static const enum digest_impl digest_impls[] = { DIGEST_IMPL_SCALAR, DIGEST_IMPL_HW };
+    static const enum digest_algorithm algorithms[] = { DIGEST_CRC32C, DIGEST_MD5, DIGEST_SHA256 };
+    digest_input_t digest_input;
+    static const size_t chunks[] = { 64, 4096, 65536 };
+    chunked_input_t input;
+    size_t split = 64;
+    char name[64], *data;
+
+    printf("Microbenchmarks\n");
+
+    measure("parse_url", op_parse_url, NULL, 0);
+    measure("url_parse_view", op_parse_url_view, NULL, 0);
+    measure("http_parser whole header", op_parse_header, NULL, strlen(bench_header));
+    snprintf(name, sizeof name, "http_parser %zuB reads", split);
+    measure(name, op_parse_header_split, &split, strlen(bench_header));
+    measure("buffer_appendf request", op_buffer_appendf, NULL, 0);
+    measure("buffer_appendf request, arena", op_buffer_appendf_arena, NULL, 0);
+
+    for (size_t i = 0; i < sizeof chunks / sizeof chunks[0]; ++i) {
+        make_chunked(&input, chunks[i]);
+        input.piece = input.len;
+        snprintf(name, sizeof name, "chunked_decode %zuB chunks", chunks[i]);
+        measure(name, op_chunked, &input, CHUNKED_SIZE);
+        input.piece = 2048;
+        snprintf(name, sizeof name, "chunked_decode %zuB chunks 2KB", chunks[i]);
+        measure(name, op_chunked, &input, CHUNKED_SIZE);
+        free(input.data);
+    }
+
+    data = (char *)malloc(SCAN_SIZE);
+    memset(data, 'x', SCAN_SIZE);
+    for (size_t i = 0; i < sizeof impls / sizeof impls[0]; ++i) {
+        if (!scan_set_impl(impls[i]))
+            continue;
+        snprintf(name, sizeof name, "scan_char %s", scan_impl_name());
+        measure(name, op_scan, data, SCAN_SIZE);
+    }
+    free(data);
+
+    /* MD5 has no hardware version, it's measured once */
+    digest_input.data = (char *)malloc(DIGEST_DATA_SIZE);
+    memset(digest_input.data, 'x', DIGEST_DATA_SIZE);
+    for (size_t i = 0; i < sizeof digest_impls / sizeof digest_impls[0]; ++i) {
+        if (!digest_set_impl(digest_impls[i]))
+            continue;
+        for (size_t j = 0; j < sizeof algorithms / sizeof algorithms[0]; ++j) {
+            if (algorithms[j] == DIGEST_MD5 && digest_impls[i] != DIGEST_IMPL_SCALAR)
+                continue;
+            digest_input.algorithm = algorithms[j];
+            snprintf(name, sizeof name, "digest %s %s", digest_name(algorithms[j]), digest_impl_name());
+            measure(name, op_digest, &digest_input, DIGEST_DATA_SIZE);
+        }
+    }
+    free(digest_input.data);
+}
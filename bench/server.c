@@ -0,0 +1,215 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define REQUEST_SIZE    8192
+#define PATTERN_SIZE    (64*1024)
+#define DRIP_SIZE       1024
+
+static int listen_fd = -1;
+static pthread_t accept_thread;
+static char pattern[PATTERN_SIZE];
+
+static bool send_full(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool send_body(int fd, size_t size)
+{
+    size_t n;
+
+    while (size > 0) {
+        n = size < PATTERN_SIZE ? size : PATTERN_SIZE;
+        if (!send_full(fd, pattern, n))
+            return false;
+        size -= n;
+    }
+
+    return true;
+}
+
+/* Every chunk goes out in one send, staged with its size line */
+static bool send_chunked(int fd, size_t size, size_t chunk)
+{
+    static __thread char staging[PATTERN_SIZE + 32];
+    size_t n;
+    int len;
+
+    if (chunk == 0 || chunk > PATTERN_SIZE)
+        chunk = PATTERN_SIZE;
+
+    while (size > 0) {
+        n = size < chunk ? size : chunk;
+        len = snprintf(staging, 32, "%zx\r\n", n);
+        memcpy(staging + len, pattern, n);
+        memcpy(staging + len + n, "\r\n", 2);
+        if (!send_full(fd, staging, len + n + 2))
+            return false;
+        size -= n;
+    }
+
+    return send_full(fd, "0\r\n\r\n", 5);
+}
+
+static bool send_slow(int fd, size_t size, long delay_us)
+{
+    size_t n;
+
+    while (size > 0) {
+        n = size < DRIP_SIZE ? size : DRIP_SIZE;
+        if (!send_full(fd, pattern, n))
+            return false;
+        size -= n;
+        usleep(delay_us);
+    }
+
+    return true;
+}
+
+static bool respond(int fd, const char *path)
+{
+    char header[256];
+    size_t size = 0, chunk = 0;
+    long delay = 0;
+    int len;
+
+    if (sscanf(path, "/cl/%zu", &size) == 1) {
+        len = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", size);
+        return send_full(fd, header, len) && send_body(fd, size);
+    }
+
+    if (sscanf(path, "/chunked/%zu/%zu", &size, &chunk) == 2) {
+        len = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+        return send_full(fd, header, len) && send_chunked(fd, size, chunk);
+    }
+
+    if (sscanf(path, "/slow/%zu/%ld", &size, &delay) == 2) {
+        len = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", size);
+        return send_full(fd, header, len) && send_slow(fd, size, delay);
+    }
+
+    len = snprintf(header, sizeof header, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+
+    return send_full(fd, header, len);
+}
+
+/* Keep-alive connection, pipelined requests are answered in order */
+static void * serve(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char request[REQUEST_SIZE + 1], path[1024], *end;
+    size_t used = 0, header_size;
+    ssize_t n;
+    bool close_after;
+    int one = 1;
+
+    /* Header and body go in separate sends */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    while (1) {
+        request[used] = '\0';
+        end = strstr(request, "\r\n\r\n");
+        if (!end) {
+            if (used == REQUEST_SIZE)
+                break;
+            n = recv(fd, request + used, REQUEST_SIZE - used, 0);
+            if (n <= 0)
+                break;
+            used += n;
+            continue;
+        }
+
+        header_size = end + 4 - request;
+        *end = '\0';
+        close_after = strcasestr(request, "connection: close") != NULL;
+
+        if (sscanf(request, "GET %1023s", path) != 1 || !respond(fd, path) || close_after)
+            break;
+
+        memmove(request, request + header_size, used - header_size);
+        used -= header_size;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+static void * accept_loop(void *arg)
+{
+    pthread_t thread;
+    int fd;
+
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        if (pthread_create(&thread, NULL, serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/* Listen on ephemeral port of 127.0.0.1, returns port or -1 */
+int server_start()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof addr;
+    int one = 1;
+
+    for (int i = 0; i < PATTERN_SIZE; ++i)
+        pattern[i] = 'a' + i % 26;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return -1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+        listen(listen_fd, 1024) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) != 0 ||
+        pthread_create(&accept_thread, NULL, accept_loop, NULL) != 0) {
+        perror("Failed to start loopback server");
+        close(listen_fd);
+        return -1;
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+void server_stop()
+{
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    pthread_join(accept_thread, NULL);
+}
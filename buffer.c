@@ -1,25 +1,51 @@
+
 #include "buffer.h"
 
 #include <cstdlib>
 #include <cstdarg>
 #include <cstdio>
 
+int buffer_init(buffer_t *buffer, size_t capacity, arena_t *arena)
+{
+    /* Add 1 for NULL terminating symbol */
+    if (capacity == 0)
+        capacity = 1;
+
+    buffer->arena = arena;
+    buffer->actual_size = 0;
+    buffer->capacity = capacity;
+    buffer->content = arena ? (char *)arena_alloc(arena, capacity) : (char *)malloc(capacity);
+    if (buffer->content == NULL)
+        return -1;
+
+    buffer->content[0] = '\0';
+
+    return 0;
+}
+
+/* Content of arena buffer stays until arena is reset */
+void buffer_release(buffer_t *buffer)
+{
+    if (!buffer->arena)
+        free(buffer->content);
+    buffer->content = NULL;
+    buffer->actual_size = buffer->capacity = 0;
+}
+
 buffer_t * buffer_alloc(size_t capacity)
 {
     buffer_t *buf = (buffer_t *)calloc(1, sizeof(buffer_t));
-    char *content = (char *)calloc(1, capacity*sizeof(char));
 
-    if(buf == NULL || content == NULL)
+    if(buf == NULL)
         goto err;
 
-    buf->capacity = capacity;
-    buf->content = content;
+    if (buffer_init(buf, capacity, NULL) != 0)
+        goto err;
 
     return buf;
 
 err:
     if (buf) free(buf);
-    if (content) free(content);
 
     return NULL;
 }
@@ -29,59 +55,96 @@ void buffer_free(buffer_t *buffer)
     if(!buffer)
         return;
 
-    if(buffer->content)
-        free(buffer->content);
+    buffer_release(buffer);
 
     free(buffer);
 }
 
-int buffer_append(buffer_t *buffer, char *append, int length)
+/* Make room for length more bytes, capacity at least doubles */
+int buffer_reserve(buffer_t *buffer, size_t length)
 {
-    /* Add 1 for NULL terminating symbol */
-    if((buffer->actual_size+length+1) > buffer->capacity)
-        goto err;
+    size_t needed = buffer->actual_size + length + 1, capacity;
+    char *content;
+
+    if (needed <= buffer->capacity)
+        return 0;
+
+    capacity = buffer->capacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+
+    if (buffer->arena) {
+        if (arena_extend(buffer->arena, buffer->content, capacity)) {
+            buffer->capacity = capacity;
+            return 0;
+        }
+        content = (char *)arena_alloc(buffer->arena, capacity);
+        if (content)
+            memcpy(content, buffer->content, buffer->actual_size + 1);
+    }
+    else {
+        content = (char *)realloc(buffer->content, capacity);
+    }
+
+    if (content == NULL)
+        return -1;
+
+    buffer->content = content;
+    buffer->capacity = capacity;
 
-    strncpy(buffer->content + buffer->actual_size, append, length);
+    return 0;
+}
 
+int buffer_append(buffer_t *buffer, const char *append, size_t length)
+{
+    if (buffer_reserve(buffer, length) != 0)
+        return -1;
+
+    memcpy(buffer->content + buffer->actual_size, append, length);
     buffer->actual_size += length;
+    buffer->content[buffer->actual_size] = '\0';
 
     return 0;
-err:
-    return -1;
 }
 
+/* Format right into free space, it's grown and formatted again if the
+ * result didn't fit */
 int buffer_appendf(buffer_t *buffer, const char *format, ...)
 {
-    char *tmp = NULL;
-    int bytes_written, status;
-
     va_list argp;
+    int length;
+
     va_start(argp, format);
+    length = vsnprintf(buffer->content + buffer->actual_size,
+                       buffer->capacity - buffer->actual_size, format, argp);
+    va_end(argp);
 
-    bytes_written = vasprintf(&tmp, format, argp);
-    if(bytes_written < 0) { goto err; }
+    if (length < 0)
+        return -1;
 
-    va_end(argp);
+    if (buffer->actual_size + length + 1 > buffer->capacity) {
+        if (buffer_reserve(buffer, length) != 0) {
+            buffer->content[buffer->actual_size] = '\0';
+            return -1;
+        }
 
-    status = buffer_append(buffer, tmp, bytes_written);
-    if(status != 0) { goto err; };
+        va_start(argp, format);
+        vsnprintf(buffer->content + buffer->actual_size,
+                  buffer->capacity - buffer->actual_size, format, argp);
+        va_end(argp);
+    }
 
-    free(tmp);
+    buffer->actual_size += length;
 
     return 0;
-err:
-    if (tmp != NULL)
-        free(tmp);
-
-    return -1;
 }
 
 char * buffer_to_string(buffer_t *buffer)
 {
-    char *string = (char *)calloc(1, buffer->actual_size+1);
+    char *string = (char *)malloc(buffer->actual_size+1);
     if (string == NULL) { goto err; }
 
-    strncpy(string, buffer->content, buffer->actual_size);
+    memcpy(string, buffer->content, buffer->actual_size + 1);
 
     return string;
 
@@ -3,17 +3,25 @@
 
 #include <cstring>
 
+#include "arena.h"
+
+/* Growable string, content is always terminated. Storage is taken from
+ * arena if buffer has one, it's released together with arena then */
 typedef struct buffer {
     char* content;
     size_t actual_size;
     size_t capacity;
+    arena_t *arena;
 } buffer_t;
 
+int buffer_init(buffer_t *buffer, size_t capacity, arena_t *arena);
+void buffer_release(buffer_t *buffer);
 buffer_t * buffer_alloc(size_t capacity);
 void buffer_free(buffer_t *buffer);
-int buffer_append(buffer_t *buffer, char *append, int length);
-int buffer_appendf(buffer_t *buffer, const char *format, ...);
+int buffer_reserve(buffer_t *buffer, size_t length);
+int buffer_append(buffer_t *buffer, const char *append, size_t length);
+int buffer_appendf(buffer_t *buffer, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 char * buffer_to_string(buffer_t *buffer);
 
 #endif // BUFFER_H
-
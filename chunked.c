@@ -0,0 +1,148 @@
+#include "chunked.h"
+
+#include <cstring>
+#include <cstdint>
+
+#include "scan.h"
+
+void chunked_init(chunked_decoder_t *decoder, chunk_data_cb on_data, void *context)
+{
+    memset(decoder, 0, sizeof(chunked_decoder_t));
+    decoder->on_data = on_data;
+    decoder->context = context;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+
+    return -1;
+}
+
+/* Size line is over */
+static bool start_chunk(chunked_decoder_t *decoder)
+{
+    if (decoder->size_digits == 0)
+        return false;
+
+    if (decoder->chunk_size == 0) {
+        decoder->state = CHUNK_STATE_TRAILER;
+        decoder->trailer_line = 0;
+    }
+    else {
+        decoder->state = CHUNK_STATE_DATA;
+        decoder->chunk_left = decoder->chunk_size;
+    }
+
+    return true;
+}
+
+/* Decode data[0, len). consumed is set to number of bytes used, it's less
+ * than len only when body is over or decoding stopped */
+int chunked_decode(chunked_decoder_t *decoder, const char *data, size_t len, size_t *consumed)
+{
+    const char *p = data, *end = data + len;
+    size_t n;
+    int digit, status = CHUNKED_MORE;
+
+    while (p < end && status == CHUNKED_MORE) {
+        switch (decoder->state) {
+        case CHUNK_STATE_SIZE:
+            if ((digit = hex_value(*p)) >= 0) {
+                if (decoder->chunk_size > (SIZE_MAX >> 4)) {
+                    status = CHUNKED_ERROR;
+                    break;
+                }
+                decoder->chunk_size = (decoder->chunk_size << 4) | digit;
+                decoder->size_digits++;
+            }
+            else if (*p == ';' || *p == ' ' || *p == '\t') {
+                decoder->state = CHUNK_STATE_EXTENSION;
+            }
+            else if (*p == '\n') {
+                if (!start_chunk(decoder))
+                    status = CHUNKED_ERROR;
+            }
+            else if (*p != '\r') {
+                status = CHUNKED_ERROR;
+            }
+            p++;
+            break;
+
+        case CHUNK_STATE_EXTENSION:
+            /* Extensions are ignored */
+            p = scan_char(p, end, '\n');
+            if (p < end) {
+                p++;
+                if (!start_chunk(decoder))
+                    status = CHUNKED_ERROR;
+            }
+            break;
+
+        case CHUNK_STATE_DATA:
+            n = end - p;
+            if (n > decoder->chunk_left)
+                n = decoder->chunk_left;
+
+            if (decoder->on_data(decoder->context, p, n) != 0)
+                status = CHUNKED_STOPPED;
+            p += n;
+            chunked_skip(decoder, n);
+            break;
+
+        case CHUNK_STATE_DATA_END:
+            if (*p == '\n') {
+                decoder->state = CHUNK_STATE_SIZE;
+                decoder->chunk_size = 0;
+                decoder->size_digits = 0;
+            }
+            else if (*p != '\r') {
+                status = CHUNKED_ERROR;
+            }
+            p++;
+            break;
+
+        case CHUNK_STATE_TRAILER:
+            if (*p == '\n') {
+                if (decoder->trailer_line == 0) {
+                    decoder->state = CHUNK_STATE_DONE;
+                    status = CHUNKED_DONE;
+                }
+                decoder->trailer_line = 0;
+                p++;
+            }
+            else if (*p == '\r') {
+                p++;
+            }
+            else {
+                /* Trailer fields are ignored, jump to end of line */
+                const char *eol = scan_char(p, end, '\n');
+                decoder->trailer_line += eol - p;
+                p = eol;
+            }
+            break;
+
+        case CHUNK_STATE_DONE:
+            status = CHUNKED_DONE;
+            break;
+        }
+    }
+
+    if (consumed)
+        *consumed = p - data;
+
+    if (status == CHUNKED_MORE && decoder->state == CHUNK_STATE_DONE)
+        status = CHUNKED_DONE;
+
+    return status;
+}
+
+/* Chunk data has been consumed without decoder, e.g. spliced to file */
+void chunked_skip(chunked_decoder_t *decoder, size_t bytes)
+{
+    decoder->chunk_left -= bytes;
+    if (decoder->chunk_left == 0)
+        decoder->state = CHUNK_STATE_DATA_END;
+}
@@ -0,0 +1,42 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <cstddef>
+
+/* Called for every span of chunk data. Return non-zero to stop decoding */
+typedef int (*chunk_data_cb)(void *context, const char *data, size_t bytes);
+
+enum chunk_state {
+    CHUNK_STATE_SIZE = 0,
+    CHUNK_STATE_EXTENSION,
+    CHUNK_STATE_DATA,
+    CHUNK_STATE_DATA_END,
+    CHUNK_STATE_TRAILER,
+    CHUNK_STATE_DONE
+};
+
+/* Results of chunked_decode */
+#define CHUNKED_ERROR       -1
+#define CHUNKED_MORE        0   /* All data consumed, body isn't over */
+#define CHUNKED_DONE        1   /* Last chunk and trailer have been decoded */
+#define CHUNKED_STOPPED     2   /* Data callback asked to stop */
+
+/* Resumable decoder of chunked transfer encoding. Size lines, extensions
+ * and trailers may be split at any byte between calls. Chunk data is
+ * passed to callback as spans of input, it's never copied */
+typedef struct chunked_decoder {
+    enum chunk_state state;
+    size_t  chunk_size;     /* Size being parsed */
+    size_t  chunk_left;     /* Data bytes left in current chunk */
+    int     size_digits;
+    size_t  trailer_line;
+
+    void            *context;
+    chunk_data_cb   on_data;
+} chunked_decoder_t;
+
+void chunked_init(chunked_decoder_t *decoder, chunk_data_cb on_data, void *context);
+int chunked_decode(chunked_decoder_t *decoder, const char *data, size_t len, size_t *consumed);
+void chunked_skip(chunked_decoder_t *decoder, size_t bytes);
+
+#endif // CHUNKED_H
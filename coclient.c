@@ -0,0 +1,633 @@
+#include "coclient.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "http.h"
+#include "pool.h"
+#include "event_loop.h"
+#include "resolver.h"
+#include "buffer.h"
+#include "log.h"
+
+/* Frames are rounded up to classes of 64 bytes, larger ones use malloc */
+#define FRAME_CLASS_SHIFT   6
+#define FRAME_CLASSES       32
+/* Free frames kept per class and thread */
+#define FRAME_CACHE_MAX     256
+
+typedef struct frame_free {
+    struct frame_free *next;
+} frame_free_t;
+
+/* Released when thread is over */
+typedef struct frame_cache {
+    frame_free_t    *free[FRAME_CLASSES];
+    int             count[FRAME_CLASSES];
+
+    ~frame_cache()
+    {
+        for (int i = 0; i < FRAME_CLASSES; ++i) {
+            while (free[i]) {
+                frame_free_t *next = free[i]->next;
+                ::free(free[i]);
+                free[i] = next;
+            }
+        }
+    }
+} frame_cache_t;
+
+static thread_local frame_cache_t frame_cache;
+
+static size_t frame_class(size_t size)
+{
+    return (size + (1 << FRAME_CLASS_SHIFT) - 1) >> FRAME_CLASS_SHIFT;
+}
+
+void * co_frame_alloc(size_t size) noexcept
+{
+    size_t c = frame_class(size);
+    frame_free_t *frame;
+
+    if (c == 0 || c > FRAME_CLASSES)
+        return malloc(size);
+
+    frame = frame_cache.free[c - 1];
+    if (frame == NULL)
+        return malloc(c << FRAME_CLASS_SHIFT);
+
+    frame_cache.free[c - 1] = frame->next;
+    frame_cache.count[c - 1]--;
+
+    return frame;
+}
+
+void co_frame_free(void *frame, size_t size) noexcept
+{
+    size_t c = frame_class(size);
+    frame_free_t *f = (frame_free_t *)frame;
+
+    if (c == 0 || c > FRAME_CLASSES || frame_cache.count[c - 1] >= FRAME_CACHE_MAX) {
+        free(frame);
+        return;
+    }
+
+    f->next = frame_cache.free[c - 1];
+    frame_cache.free[c - 1] = f;
+    frame_cache.count[c - 1]++;
+}
+
+/* Event loop with connections of client and coroutines ready to run */
+struct co_scheduler {
+    event_loop_t        *loop;
+    connection_pool_t   *pool;
+    co_group            root;
+
+    /* Exchanges waiting for host lookup or connection to their host */
+    co_exchange         *pending;
+    co_exchange         *pending_tail;
+
+    /* Resumed from the top of callbacks, never from inside a coroutine */
+    std::coroutine_handle<> *ready;
+    int                 ready_count;
+    int                 ready_capacity;
+    bool                draining;
+
+    co_scheduler() noexcept : loop(NULL), pool(NULL), root(this), pending(NULL),
+        pending_tail(NULL), ready(NULL), ready_count(0), ready_capacity(0), draining(false) {}
+};
+
+struct co_exchange {
+    co_scheduler    *scheduler;
+    url_t           *url;
+    connection_t    *conn;
+    char            *file;          /* Name of file sink */
+    http_fetch_t    fetch;
+    buffer_t        headers;        /* Extra header lines of request */
+    buffer_t        fields;         /* See http_field_append() */
+    size_t          field_count;
+    int             status;
+    int             error;
+
+    /* Body received since the last read. Two buffers are swapped, so span
+     * of reader stays valid until it reads again */
+    buffer_t        pending;
+    buffer_t        reading;        /* Last span taken from pending */
+    size_t          read_bytes;
+
+    bool            queued;         /* In pending list of scheduler */
+    bool            header_ready;
+    bool            done;
+    bool            abandoned;      /* Response was dropped, stop receiving */
+    std::coroutine_handle<> waiter; /* Awaits header, then body */
+    co_exchange     *next;
+};
+
+static void schedule(co_scheduler *s);
+
+/* Resume later from the top of callback or run() */
+static void make_ready(co_scheduler *s, std::coroutine_handle<> handle)
+{
+    if (s->ready_count == s->ready_capacity) {
+        int capacity = s->ready_capacity ? s->ready_capacity * 2 : 16;
+        std::coroutine_handle<> *ready = (std::coroutine_handle<> *)realloc(
+            s->ready, capacity * sizeof(std::coroutine_handle<>));
+        if (!ready) {
+            LOG_E("Failed to queue coroutine, it's resumed at once");
+            handle.resume();
+            return;
+        }
+        s->ready = ready;
+        s->ready_capacity = capacity;
+    }
+
+    s->ready[s->ready_count++] = handle;
+}
+
+static void drain(co_scheduler *s)
+{
+    if (s->draining)
+        return;
+
+    /* Resumed coroutines may queue more, array can move meanwhile */
+    s->draining = true;
+    for (int i = 0; i < s->ready_count; ++i) {
+        std::coroutine_handle<> handle = s->ready[i];
+        handle.resume();
+    }
+    s->ready_count = 0;
+    s->draining = false;
+}
+
+static void wake(co_exchange *x)
+{
+    if (x->waiter)
+        make_ready(x->scheduler, std::exchange(x->waiter, nullptr));
+}
+
+static void free_exchange(co_exchange *x)
+{
+    buffer_release(&x->headers);
+    buffer_release(&x->fields);
+    buffer_release(&x->pending);
+    buffer_release(&x->reading);
+    free_url(x->url);
+    free(x->file);
+    free(x);
+}
+
+static void push_pending(co_scheduler *s, co_exchange *x)
+{
+    x->next = NULL;
+    if (s->pending_tail)
+        s->pending_tail->next = x;
+    else
+        s->pending = x;
+    s->pending_tail = x;
+    x->queued = true;
+}
+
+static void remove_pending(co_scheduler *s, co_exchange *prev, co_exchange *x)
+{
+    if (prev)
+        prev->next = x->next;
+    else
+        s->pending = x->next;
+    if (s->pending_tail == x)
+        s->pending_tail = prev;
+    x->queued = false;
+}
+
+static void fail_exchange(co_exchange *x, int error)
+{
+    x->error = error;
+    x->done = true;
+    wake(x);
+}
+
+/* Owner dropped exchange, in flight one is freed once it's over */
+static void release_exchange(co_exchange *x)
+{
+    co_exchange *prev = NULL;
+
+    if (x == NULL)
+        return;
+
+    x->abandoned = true;
+    if (x->queued) {
+        for (co_exchange *p = x->scheduler->pending; p != x; p = p->next)
+            prev = p;
+        remove_pending(x->scheduler, prev, x);
+        free_exchange(x);
+    }
+    else if (x->done) {
+        free_exchange(x);
+    }
+}
+
+static void field_cb(void *context, const char *name, size_t name_len,
+                     const char *value, size_t value_len)
+{
+    co_exchange *x = (co_exchange *)context;
+
+    if (http_field_append(&x->fields, name, name_len, value, value_len) != 0) {
+        x->error = HTTPCLIENT_BAD_ALLOC;
+        return;
+    }
+
+    x->field_count++;
+}
+
+static void header_done_cb(void *context, int status)
+{
+    co_exchange *x = (co_exchange *)context;
+
+    x->status = status;
+    x->header_ready = true;
+    wake(x);
+    drain(x->scheduler);
+}
+
+static int span_cb(void *context, const char *data, size_t bytes)
+{
+    co_exchange *x = (co_exchange *)context;
+
+    if (x->abandoned || x->error)
+        return 1;
+
+    /* Receive buffer may be moved by the next receive, reader may await
+     * something else before it reads again */
+    if (buffer_append(&x->pending, data, bytes) != 0) {
+        x->error = HTTPCLIENT_BAD_ALLOC;
+        return 1;
+    }
+
+    if (x->waiter) {
+        std::exchange(x->waiter, nullptr).resume();
+        drain(x->scheduler);
+        return x->abandoned;
+    }
+
+    return 0;
+}
+
+static void exchange_done(void *context, int status)
+{
+    co_exchange *x = (co_exchange *)context;
+    co_scheduler *s = x->scheduler;
+
+    x->done = true;
+    if (status != 0 && x->error == 0)
+        x->error = x->header_ready ? HTTPCLIENT_TRANSFER_ERROR : HTTPCLIENT_CONNECTION_ERROR;
+
+    pool_release(s->pool, x->conn);
+    x->conn = NULL;
+
+    if (x->abandoned)
+        free_exchange(x);
+    else
+        wake(x);
+
+    /* Connection to the same host is free now */
+    schedule(s);
+    drain(s);
+}
+
+/* Host lookups are over, their exchanges can be started */
+static void host_resolved(void *context, int error)
+{
+    co_scheduler *s = (co_scheduler *)context;
+
+    schedule(s);
+    drain(s);
+}
+
+/* Start exchange of pending list. Returns false if it has to wait for its
+ * host or a free connection */
+static bool start_exchange(co_scheduler *s, co_exchange *x)
+{
+    int error = 0;
+    dns_addrs_t *addrs;
+
+    addrs = resolver_lookup_async(resolver_default(), x->url->host, x->url->port,
+                                  s->loop, host_resolved, s, &error);
+    if (addrs == NULL) {
+        if (error == RESOLVER_PENDING)
+            return false;
+
+        LOG_E("%s", x->url->host);
+        print_resolver_error(error);
+        fail_exchange(x, HTTPCLIENT_CONNECTION_ERROR);
+        return true;
+    }
+    dns_addrs_release(addrs);
+
+    x->conn = pool_acquire(s->pool, x->url->host, x->url->port, &error);
+    if (x->conn == NULL) {
+        if (error == POOL_HOST_LIMIT)
+            return false;
+
+        print_pool_error(error);
+        fail_exchange(x, HTTPCLIENT_CONNECTION_ERROR);
+        return true;
+    }
+
+    if (http_fetch_async(s->loop, x->conn, x->url, &x->fetch, exchange_done, x) != 0) {
+        pool_release(s->pool, x->conn);
+        x->conn = NULL;
+        fail_exchange(x, HTTPCLIENT_CONNECTION_ERROR);
+    }
+
+    return true;
+}
+
+/* Exchanges go in order of creation unless their host is busy */
+static void schedule(co_scheduler *s)
+{
+    co_exchange *x = s->pending, *prev = NULL, *next;
+
+    while (x != NULL) {
+        next = x->next;
+        if (start_exchange(s, x))
+            remove_pending(s, prev, x);
+        else
+            prev = x;
+        x = next;
+    }
+}
+
+co_client::co_client(int max_per_host) noexcept : scheduler(nullptr)
+{
+    int error = 0;
+    co_scheduler *s = new (std::nothrow) co_scheduler();
+
+    if (s == NULL)
+        return;
+
+    s->pool = pool_create(max_per_host, POOL_DEFAULT_IDLE_TIMEOUT);
+    s->loop = event_loop_create(&error);
+    if (s->pool == NULL || s->loop == NULL || pool_watch_idle(s->pool, s->loop) != 0) {
+        pool_free(s->pool);
+        event_loop_free(s->loop);
+        delete s;
+        return;
+    }
+
+    scheduler = s;
+}
+
+/* Responses and tasks must not outlive client */
+co_client::~co_client()
+{
+    co_scheduler *s = scheduler;
+
+    if (s == NULL)
+        return;
+
+    while (s->pending) {
+        co_exchange *next = s->pending->next;
+        free_exchange(s->pending);
+        s->pending = next;
+    }
+
+    pool_free(s->pool);
+    resolver_detach(resolver_default(), s->loop);
+    event_loop_free(s->loop);
+    free(s->ready);
+    delete s;
+}
+
+co_get co_client::get(const char *address, const httpclient_options_t *options) noexcept
+{
+    httpclient_options_t defaults;
+    co_exchange *x;
+    int error = 0;
+
+    if (scheduler == nullptr)
+        return co_get(nullptr);
+
+    if (options == NULL) {
+        httpclient_options_init(&defaults);
+        options = &defaults;
+    }
+
+    x = (co_exchange *)calloc(1, sizeof(co_exchange));
+    if (x == NULL)
+        return co_get(nullptr);
+    x->scheduler = scheduler;
+
+    if (address == NULL || options->version != HTTPCLIENT_API_VERSION) {
+        fail_exchange(x, HTTPCLIENT_BAD_OPTIONS);
+        return co_get(x);
+    }
+
+    x->url = parse_url(address, &error);
+    if (error) {
+        fail_exchange(x, HTTPCLIENT_URL_ERROR);
+        return co_get(x);
+    }
+
+    /* Name is kept by exchange, options may be gone before it starts */
+    if (options->sink == HTTPCLIENT_SINK_FILE && options->file) {
+        x->file = strdup(options->file);
+        if (x->file == NULL) {
+            fail_exchange(x, HTTPCLIENT_BAD_ALLOC);
+            return co_get(x);
+        }
+        x->url->file = x->file;
+    }
+
+    if (http_fetch_headers(&x->headers, options->headers, options->compressed) != 0) {
+        fail_exchange(x, HTTPCLIENT_BAD_ALLOC);
+        return co_get(x);
+    }
+
+    x->fetch.method = options->method;
+    x->fetch.headers = x->headers.actual_size ? x->headers.content : NULL;
+    x->fetch.compressed = options->compressed;
+    x->fetch.process_header = field_cb;
+    x->fetch.header_done = header_done_cb;
+    x->fetch.header_context = x;
+    if (options->sink != HTTPCLIENT_SINK_FILE)
+        x->fetch.process_body = span_cb;
+    x->fetch.body_context = x;
+
+    push_pending(scheduler, x);
+    schedule(scheduler);
+
+    return co_get(x);
+}
+
+co_group & co_client::group() noexcept
+{
+    return scheduler->root;
+}
+
+int co_client::run() noexcept
+{
+    co_scheduler *s = scheduler;
+
+    if (s == NULL)
+        return -1;
+
+    drain(s);
+    while (s->loop->active > 0) {
+        if (event_loop_run(s->loop) != 0)
+            return -1;
+        drain(s);
+    }
+
+    if (s->root.count > 0) {
+        LOG_E("%d tasks wait for nothing", s->root.count);
+        return -1;
+    }
+
+    return 0;
+}
+
+void co_group::spawn(co_task<void> task) noexcept
+{
+    std::coroutine_handle<co_promise<void>> handle = std::exchange(task.handle, nullptr);
+
+    if (!handle) {
+        LOG_E("Failed to allocate task");
+        return;
+    }
+
+    handle.promise().group = this;
+    count++;
+    make_ready(scheduler, handle);
+}
+
+std::coroutine_handle<> co_group_finished(co_group *group) noexcept
+{
+    if (--group->count == 0 && group->waiter)
+        return std::exchange(group->waiter, nullptr);
+
+    return std::noop_coroutine();
+}
+
+bool co_wait::await_ready() const noexcept
+{
+    return group->count == 0;
+}
+
+void co_wait::await_suspend(std::coroutine_handle<> waiter) noexcept
+{
+    group->waiter = waiter;
+}
+
+co_get::~co_get()
+{
+    release_exchange(exchange);
+}
+
+bool co_get::await_ready() const noexcept
+{
+    return exchange == nullptr || exchange->header_ready || exchange->done;
+}
+
+void co_get::await_suspend(std::coroutine_handle<> caller) noexcept
+{
+    exchange->waiter = caller;
+}
+
+co_response co_get::await_resume() noexcept
+{
+    return co_response(std::exchange(exchange, nullptr));
+}
+
+bool co_read::await_ready() const noexcept
+{
+    return exchange == nullptr || exchange->pending.actual_size > 0 || exchange->done;
+}
+
+void co_read::await_suspend(std::coroutine_handle<> reader) noexcept
+{
+    exchange->waiter = reader;
+}
+
+co_span co_read::await_resume() noexcept
+{
+    co_exchange *x = exchange;
+    buffer_t taken;
+
+    if (x == nullptr)
+        return co_span{NULL, 0};
+
+    if (x->pending.actual_size == 0)
+        return co_span{NULL, 0};
+
+    /* Storage of previous span is reused for the next copies */
+    taken = x->pending;
+    x->pending = x->reading;
+    x->pending.actual_size = 0;
+    x->reading = taken;
+    x->read_bytes += taken.actual_size;
+
+    return co_span{taken.content, taken.actual_size};
+}
+
+co_response & co_response::operator=(co_response &&other) noexcept
+{
+    if (this != &other) {
+        release_exchange(exchange);
+        exchange = std::exchange(other.exchange, nullptr);
+    }
+    return *this;
+}
+
+co_response::~co_response()
+{
+    release_exchange(exchange);
+}
+
+int co_response::error() const noexcept
+{
+    return exchange ? exchange->error : HTTPCLIENT_BAD_ALLOC;
+}
+
+int co_response::status() const noexcept
+{
+    return exchange ? exchange->status : 0;
+}
+
+httpclient_header_t co_response::header_at(size_t i) const noexcept
+{
+    httpclient_header_t header = { NULL, NULL };
+    const char *p;
+
+    if (exchange == nullptr || i >= exchange->field_count)
+        return header;
+
+    p = exchange->fields.content;
+    for (size_t n = 0; n < 2 * i; ++n)
+        p += strlen(p) + 1;
+
+    header.name = p;
+    header.value = p + strlen(p) + 1;
+
+    return header;
+}
+
+const char * co_response::header(const char *name) const noexcept
+{
+    if (exchange == nullptr || name == NULL)
+        return NULL;
+
+    return http_field_find(exchange->fields.content, exchange->field_count, name);
+}
+
+size_t co_response::header_count() const noexcept
+{
+    return exchange ? exchange->field_count : 0;
+}
+
+size_t co_response::body_size() const noexcept
+{
+    if (exchange == nullptr)
+        return 0;
+
+    return exchange->fetch.process_body ? exchange->read_bytes : exchange->fetch.written_bytes;
+}
@@ -0,0 +1,250 @@
+#ifndef COCLIENT_H
+#define COCLIENT_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+#include "httpclient.h"
+
+/* Coroutine interface of the same engine, needs -std=c++20. Exchanges of
+ * all coroutines of client run on one event loop in calling thread:
+ *
+ *     co_task<void> fetch(co_client &client, const char *url)
+ *     {
+ *         co_response response = co_await client.get(url);
+ *         for (co_span span; (span = co_await response.read()).size; )
+ *             consume(span.data, span.size);
+ *     }
+ *
+ *     client.spawn(fetch(client, url));
+ *     client.run();
+ *
+ * Coroutines are resumed from callbacks of event loop, they must not block */
+
+struct co_scheduler;
+struct co_exchange;
+struct co_group;
+
+/* Frames of coroutines are taken from per-thread free lists by size class */
+void * co_frame_alloc(size_t size) noexcept;
+void co_frame_free(void *frame, size_t size) noexcept;
+
+std::coroutine_handle<> co_group_finished(co_group *group) noexcept;
+
+/* Part of promise shared by tasks of all result types. Task is started
+ * when it's awaited or spawned, its awaiter is resumed by symmetric
+ * transfer once it's over */
+struct co_promise_base {
+    std::coroutine_handle<> continuation;
+    co_group    *group = nullptr;   /* Spawned, frame is destroyed when it's over */
+
+    static void * operator new(size_t size) noexcept { return co_frame_alloc(size); }
+    static void operator delete(void *frame, size_t size) noexcept { co_frame_free(frame, size); }
+
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+        void await_resume() const noexcept {}
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+        {
+            co_promise_base &promise = handle.promise();
+            co_group *group = promise.group;
+
+            if (group == nullptr)
+                return promise.continuation ? promise.continuation : std::noop_coroutine();
+
+            handle.destroy();
+            return co_group_finished(group);
+        }
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    /* Engine has no exceptions, neither do its callbacks */
+    void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct co_task;
+
+template <typename T>
+struct co_promise : co_promise_base {
+    T   value{};
+
+    co_task<T> get_return_object() noexcept;
+    static co_task<T> get_return_object_on_allocation_failure() noexcept { return co_task<T>(); }
+    void return_value(T result) noexcept { value = std::move(result); }
+};
+
+template <>
+struct co_promise<void> : co_promise_base {
+    co_task<void> get_return_object() noexcept;
+    static co_task<void> get_return_object_on_allocation_failure() noexcept;
+    void return_void() const noexcept {}
+};
+
+/* Lazy coroutine with result. Task without frame, when allocation has
+ * failed, gives default value of T when it's awaited */
+template <typename T = void>
+struct co_task {
+    using promise_type = co_promise<T>;
+
+    std::coroutine_handle<promise_type> handle;
+
+    co_task() noexcept : handle(nullptr) {}
+    explicit co_task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+    co_task(co_task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    co_task(const co_task &) = delete;
+    co_task & operator=(const co_task &) = delete;
+
+    co_task & operator=(co_task &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~co_task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return !handle; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+
+    T await_resume() noexcept
+    {
+        if constexpr (!std::is_void_v<T>) {
+            if (!handle)
+                return T();
+            return std::move(handle.promise().value);
+        }
+    }
+};
+
+template <typename T>
+co_task<T> co_promise<T>::get_return_object() noexcept
+{
+    return co_task<T>(std::coroutine_handle<co_promise<T>>::from_promise(*this));
+}
+
+inline co_task<void> co_promise<void>::get_return_object() noexcept
+{
+    return co_task<void>(std::coroutine_handle<co_promise<void>>::from_promise(*this));
+}
+
+inline co_task<void> co_promise<void>::get_return_object_on_allocation_failure() noexcept
+{
+    return co_task<void>();
+}
+
+/* Span of body, valid until the next read. Empty span ends body */
+struct co_span {
+    const char  *data;
+    size_t      size;
+};
+
+struct co_read {
+    co_exchange *exchange;
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> reader) noexcept;
+    co_span await_resume() noexcept;
+};
+
+/* Response of any status. Body is received while it's read, dropping
+ * response stops receiving and closes its connection */
+struct co_response {
+    co_exchange *exchange;
+
+    co_response() noexcept : exchange(nullptr) {}
+    explicit co_response(co_exchange *x) noexcept : exchange(x) {}
+    co_response(co_response &&other) noexcept : exchange(std::exchange(other.exchange, nullptr)) {}
+    co_response(const co_response &) = delete;
+    co_response & operator=(const co_response &) = delete;
+    co_response & operator=(co_response &&other) noexcept;
+    ~co_response();
+
+    /* HTTPCLIENT_NO_ERROR unless response hasn't been received whole,
+     * body error is known once read() has ended it */
+    int error() const noexcept;
+    int status() const noexcept;
+    const char * header(const char *name) const noexcept;
+    size_t header_count() const noexcept;
+    httpclient_header_t header_at(size_t i) const noexcept;
+    size_t body_size() const noexcept;      /* Read so far, or written to file */
+
+    co_read read() noexcept { return co_read{exchange}; }
+};
+
+/* Exchange is started when it's created, awaiting it waits for header */
+struct co_get {
+    co_exchange *exchange;
+
+    co_get(co_exchange *x) noexcept : exchange(x) {}
+    co_get(co_get &&other) noexcept : exchange(std::exchange(other.exchange, nullptr)) {}
+    co_get(const co_get &) = delete;
+    co_get & operator=(const co_get &) = delete;
+    ~co_get();      /* Drops exchange which hasn't been awaited */
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> caller) noexcept;
+    co_response await_resume() noexcept;
+};
+
+struct co_wait {
+    co_group *group;
+
+    bool await_ready() const noexcept;
+    void await_suspend(std::coroutine_handle<> waiter) noexcept;
+    void await_resume() const noexcept {}
+};
+
+/* Spawned tasks run concurrently, wait() resumes once all are over */
+struct co_group {
+    co_scheduler    *scheduler;
+    int             count;
+    std::coroutine_handle<> waiter;
+
+    co_group(co_scheduler *s) noexcept : scheduler(s), count(0), waiter(nullptr) {}
+    co_group(const co_group &) = delete;
+    co_group & operator=(const co_group &) = delete;
+
+    void spawn(co_task<void> task) noexcept;
+    co_wait wait() noexcept { return co_wait{this}; }
+};
+
+struct co_client {
+    co_scheduler    *scheduler;
+
+    /* Connections per host are limited like batch downloads, 0 for default */
+    explicit co_client(int max_per_host = 0) noexcept;
+    co_client(const co_client &) = delete;
+    co_client & operator=(const co_client &) = delete;
+    ~co_client();
+
+    bool ok() const noexcept { return scheduler != nullptr; }
+
+    /* Options as for httpclient_fetch(), file sink saves body to file,
+     * other sinks are read with co_response::read() */
+    co_get get(const char *url, const httpclient_options_t *options = nullptr) noexcept;
+    co_group & group() noexcept;
+    void spawn(co_task<void> task) noexcept { group().spawn(std::move(task)); }
+    /* Drive event loop until spawned tasks and their exchanges are over */
+    int run() noexcept;
+};
+
+#endif // COCLIENT_H
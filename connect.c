@@ -2,17 +2,27 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 
 #include <sys/time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <climits>
 
+#include "uring.h"
 #include "log.h"
 
-/* Max size of HTTP header in most servers is 8KB */
-#define CONN_BUFFER_SIZE    1024*8
+/* Reads start small and double while they fill up, bulk body is read
+ * in large pieces with fewer calls */
+#define CONN_READ_MIN       1024*2
+#define CONN_READ_MAX       1024*256
+#define CONN_BUFFER_INITIAL 1024*4
+/* Default capacity of pipe */
+#define SPLICE_CHUNK_SIZE   1024*64
+/* Pieces passed to one sendmsg, a pipeline of 8 requests takes 48 */
+#define CONN_SEND_IOV_BATCH 64
 
 static const char *conn_errors[] = {
 #define CONN_NO_ERROR               0
@@ -27,34 +37,41 @@ static const char *conn_errors[] = {
   "Bad alloc"
 };
 
+static char * alloc_buffer(connection_t *conn)
+{
+    conn->buffer_size = CONN_BUFFER_INITIAL;
+    conn->read_size = CONN_READ_MIN;
+
+    return conn->buffer = (char *)calloc(1, conn->buffer_size);
+}
+
 connection_t* init_connection(const char *host, const char *port, int *error)
 {
-    int status, error_code = 0;
+    int error_code = 0, dns_error = 0;
     connection_t *conn;
 
-    struct addrinfo hints, *res;
-
     conn = (connection_t *)calloc(1, sizeof(connection_t));
     if (!conn) {
         error_code = CONN_BAD_ALLOC;
         goto err;
     }
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if ((status = getaddrinfo(host, port, &hints, &res)) != 0) {
-        LOG_E("getaddrinfo error: %s", gai_strerror(status));
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+
+    /* Addresses are shared with other connections to host:port */
+    TRACE_MARK(&conn->trace, TRACE_DNS_START);
+    conn->addrs = resolver_lookup(resolver_default(), host, port, &dns_error);
+    TRACE_MARK(&conn->trace, TRACE_DNS_DONE);
+    if (!conn->addrs) {
+        print_resolver_error(dns_error);
         error_code = CONN_INVALID_HOST;
         goto err;
     }
 
-    conn->addr_info = res;
+    conn->addr_info = conn->addrs->list;
     conn->host = strdup(host);
     conn->port = strdup(port);
 
-    conn->buffer = (char *)calloc(1, CONN_BUFFER_SIZE);
+    alloc_buffer(conn);
 
     if (!conn->host || !conn->port || !conn->buffer) {
         error_code = CONN_BAD_ALLOC;
@@ -67,18 +84,81 @@ err:
     if(error)
         *error = error_code;
 
-    if(conn)
-        free(conn);
+    free_connection(conn);
 
     return NULL;
 }
 
+/* New connection to the same host which reuses resolved addresses */
+connection_t* dup_connection(const connection_t *orig, int *error)
+{
+    connection_t *conn = (connection_t *)calloc(1, sizeof(connection_t));
+    if (!conn)
+        goto err;
+
+    conn->addrs = dns_addrs_ref(orig->addrs);
+    conn->addr_info = orig->addr_info;
+    conn->host = strdup(orig->host);
+    conn->port = strdup(orig->port);
+    alloc_buffer(conn);
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+
+    if (!conn->host || !conn->port || !conn->buffer)
+        goto err;
+
+    return conn;
+
+err:
+    if(error)
+        *error = CONN_BAD_ALLOC;
+
+    free_connection(conn);
+
+    return NULL;
+}
+
+/* Race connects to all addresses and switch winner to blocking mode */
+static int open_racing(connection_t *conn)
+{
+    connect_race_t *race = race_start(conn->addr_info);
+    int status, sockfd = -1;
+
+    if (!race)
+        return CONN_BAD_ALLOC;
+
+    while ((status = race_step(race, &sockfd)) == RACE_PENDING)
+        race_wait(race);
+
+    race_free(race);
+
+    if (status != RACE_WON) {
+        LOG_E("Connect failed to all addresses of %s", conn->host);
+        return CONN_CONNECT_ERROR;
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+    conn->sockfd = sockfd;
+    conn->opened = true;
+    TRACE_MARK(&conn->trace, TRACE_CONNECTED);
+
+    return CONN_NO_ERROR;
+}
+
 void open_connection(connection_t *conn, int *error)
 {
     int error_code = 0;
     int sockfd;
     struct addrinfo *res = conn->addr_info;
 
+    TRACE_MARK(&conn->trace, TRACE_CONNECT_START);
+
+    if (res->ai_next) {
+        error_code = open_racing(conn);
+        if (error_code)
+            goto err;
+        return;
+    }
+
     sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if(sockfd <= 0) {
         error_code = CONN_INVALID_SOCKET;
@@ -93,6 +173,7 @@ void open_connection(connection_t *conn, int *error)
 
     conn->sockfd = sockfd;
     conn->opened = true;
+    TRACE_MARK(&conn->trace, TRACE_CONNECTED);
 
     return;
 
@@ -102,12 +183,121 @@ err:
     close_connection(conn);
 }
 
+/* Start connecting without waiting, socket becomes writable once connected */
+void open_connection_async(connection_t *conn, int *error)
+{
+    int error_code = 0;
+    int sockfd;
+    struct addrinfo *res = conn->addr_info;
+
+    TRACE_MARK(&conn->trace, TRACE_CONNECT_START);
+
+    /* Several addresses are raced, see connect_step() */
+    if (res->ai_next) {
+        conn->race = race_start(res);
+        if (!conn->race) {
+            error_code = CONN_BAD_ALLOC;
+            goto err;
+        }
+        conn->sockfd = 0;
+        conn->opened = true;
+        conn->state = CONN_STATE_CONNECTING;
+        return;
+    }
+
+    sockfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+    if(sockfd <= 0) {
+        error_code = CONN_INVALID_SOCKET;
+        goto err;
+    }
+
+    conn->sockfd = sockfd;
+    conn->opened = true;
+
+    if(connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
+        if (errno != EINPROGRESS) {
+            perror("Connect failed");
+            error_code = CONN_CONNECT_ERROR;
+            goto err;
+        }
+        conn->state = CONN_STATE_CONNECTING;
+    }
+    else {
+        conn->state = CONN_STATE_SENDING;
+        TRACE_MARK(&conn->trace, TRACE_CONNECTED);
+    }
+
+    return;
+
+err:
+    if(error)
+        *error = error_code;
+    close_connection(conn);
+}
+
+/* Check result of non-blocking connect, returns 0 on success */
+int connect_result(connection_t *conn)
+{
+    int error = 0;
+    socklen_t len = sizeof error;
+
+    if (getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        return -1;
+
+    if (error) {
+        LOG_E("Connect failed: %s", strerror(error));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Advance non-blocking connect, returns one of CONN_IO_* */
+int connect_step(connection_t *conn)
+{
+    int status, sockfd = -1;
+
+    if (!conn->race) {
+        if (connect_result(conn) != 0)
+            return CONN_IO_ERROR;
+        TRACE_MARK(&conn->trace, TRACE_CONNECTED);
+        return CONN_IO_DONE;
+    }
+
+    status = race_step(conn->race, &sockfd);
+    if (status == RACE_PENDING)
+        return CONN_IO_AGAIN;
+
+    race_free(conn->race);
+    conn->race = NULL;
+
+    if (status != RACE_WON) {
+        LOG_E("Connect failed to all addresses of %s", conn->host);
+        conn->opened = false;
+        conn->sockfd = 0;
+        return CONN_IO_ERROR;
+    }
+
+    conn->sockfd = sockfd;
+    TRACE_MARK(&conn->trace, TRACE_CONNECTED);
+
+    return CONN_IO_DONE;
+}
+
 void close_connection(connection_t *connection)
 {
+    if (connection->race) {
+        race_free(connection->race);
+        connection->race = NULL;
+        connection->opened = false;
+    }
+
     if(connection->sockfd && connection->opened) {
         close(connection->sockfd);
         connection->opened = false;
     }
+    connection->state = CONN_STATE_IDLE;
+    connection->splice_left = 0;
 }
 
 
@@ -125,8 +315,15 @@ void free_connection(connection_t *conn)
     if (conn->buffer)
         free(conn->buffer);
 
-    if(conn->addr_info)
-        freeaddrinfo(conn->addr_info);
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+
+    dns_addrs_release(conn->addrs);
+    arena_free(&conn->arena);
+    free(conn->header_template[0]);
+    free(conn->header_template[1]);
 
     free(conn);
 }
@@ -156,24 +353,71 @@ void print_connection_info(const connection_t *conn)
     }
 }
 
-int send_all(connection_t *conn, const char *buf, int len, int flags)
+/* Gather pieces from byte offset on and send them with one sendmsg. If
+ * there are more pieces than one call takes, kernel is told more follows */
+static ssize_t send_pieces(int sockfd, const struct iovec *iov, int iovcnt, size_t offset, int flags)
 {
-    int total = 0;
-    int sockfd = 0;
+    struct iovec batch[CONN_SEND_IOV_BATCH];
+    struct msghdr msg;
     int n;
 
+    while (iovcnt > 0 && offset >= iov->iov_len) {
+        offset -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+
+    for (n = 0; n < iovcnt && n < CONN_SEND_IOV_BATCH; ++n)
+        batch[n] = iov[n];
+    if (n > 0) {
+        batch[0].iov_base = (char *)batch[0].iov_base + offset;
+        batch[0].iov_len -= offset;
+    }
+    if (iovcnt > n)
+        flags |= MSG_MORE;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = batch;
+    msg.msg_iovlen = n;
+
+    return sendmsg(sockfd, &msg, flags | MSG_NOSIGNAL);
+}
+
+static size_t pieces_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    return len;
+}
+
+int send_all(connection_t *conn, const struct iovec *iov, int iovcnt, int flags)
+{
+    size_t total = 0, len = pieces_length(iov, iovcnt);
+    int sockfd = 0;
+    ssize_t n;
+
     if (conn == NULL || conn->sockfd == 0)
         goto err;
 
     sockfd = conn->sockfd;
+    TRACE_MARK(&conn->trace, TRACE_SEND_START);
 
     while (total < len)
     {
-        n = send(sockfd, buf+total, len-total, flags);
-        if (n == -1) { goto err; }
+        n = send_pieces(sockfd, iov, iovcnt, total, flags);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            goto err;
+        }
         total += n;
     }
 
+    TRACE_MARK(&conn->trace, TRACE_SENT);
+
     return total;
 
 err:
@@ -181,42 +425,195 @@ err:
     return -1;
 }
 
-#define CHUNK_SIZE 2048
+/* Next bytes_received bytes of socket data will be moved to fd at offset
+ * without copying them to user space. Returns -1 if splice isn't available */
+int splice_to_file(connection_t *conn, int fd, off_t offset, size_t bytes)
+{
+    /* Completions of io_uring can't be mixed with splice of the same socket */
+    if (conn->splice_disabled || conn->ring)
+        return -1;
+
+    if (conn->pipe_fds[0] < 0 && pipe2(conn->pipe_fds, O_CLOEXEC) != 0) {
+        conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+        conn->splice_disabled = true;
+        return -1;
+    }
+
+    conn->splice_fd = fd;
+    conn->splice_offset = offset;
+    conn->splice_left = bytes;
+
+    return 0;
+}
+
+/* File doesn't support splice, copy data left in pipe */
+static int copy_from_pipe(connection_t *conn, size_t bytes)
+{
+    ssize_t n, w;
+
+    while (bytes > 0) {
+        n = read(conn->pipe_fds[0], conn->buffer, bytes < conn->buffer_size ? bytes : conn->buffer_size);
+        if (n <= 0)
+            return -1;
+
+        for (ssize_t off = 0; off < n; off += w) {
+            w = pwrite(conn->splice_fd, conn->buffer + off, n - off, conn->splice_offset);
+            if (w < 0 && errno == EINTR)
+                w = 0;
+            else if (w < 0)
+                return -1;
+            conn->splice_offset += w;
+        }
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/* Move one chunk from socket to file through pipe */
+static int splice_chunk(connection_t *conn, size_t *total_size)
+{
+    size_t len = conn->splice_left < SPLICE_CHUNK_SIZE ? conn->splice_left : SPLICE_CHUNK_SIZE;
+    ssize_t n, moved = 0, m;
+
+    n = splice(conn->sockfd, NULL, conn->pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0)
+        return CONN_IO_DONE;
+
+    if (n < 0) {
+        if (errno == EINTR)
+            return CONN_IO_MORE;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return CONN_IO_AGAIN;
+        if (errno == EINVAL) {
+            /* Socket type doesn't support splice, continue in user space */
+            conn->splice_disabled = true;
+            conn->splice_left = 0;
+            return CONN_IO_MORE;
+        }
+        return CONN_IO_ERROR;
+    }
+
+    while (moved < n) {
+        m = splice(conn->pipe_fds[0], NULL, conn->splice_fd, &conn->splice_offset,
+                   n - moved, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0) {
+            conn->splice_disabled = true;
+            if (copy_from_pipe(conn, n - moved) != 0)
+                return CONN_IO_ERROR;
+            break;
+        }
+        moved += m;
+    }
+
+    *total_size += n;
+    conn->bytes_received += n;
+    conn->splice_left -= n;
+
+    if (conn->process_spliced(conn->context, n) != 0)
+        return CONN_IO_DONE;
+
+    if (conn->splice_disabled)
+        conn->splice_left = 0;
+
+    return CONN_IO_MORE;
+}
+
+/* Room for the next read after header received so far, http limits its
+ * size. Buffer is moved only if nothing points into it. Returns read size */
+static size_t reserve_read(connection_t *conn, bool can_move)
+{
+    size_t size = conn->buffer_size;
+    char *buffer;
+
+    while (size < conn->buffer_offset + conn->read_size + 1)
+        size *= 2;
+
+    if (size > conn->buffer_size && can_move) {
+        buffer = (char *)realloc(conn->buffer, size);
+        if (buffer) {
+            conn->buffer = buffer;
+            conn->buffer_size = size;
+        }
+    }
+
+    /* Without more memory the read is shorter */
+    if (conn->buffer_offset + conn->read_size + 1 > conn->buffer_size)
+        return conn->buffer_size - conn->buffer_offset - 1;
+
+    return conn->read_size;
+}
+
+/* Reads which fill up double, mostly empty ones halve */
+static void adapt_read_size(connection_t *conn, size_t requested, size_t received)
+{
+    if (received == requested && conn->read_size < CONN_READ_MAX)
+        conn->read_size *= 2;
+    else if (received < requested / 4 && conn->read_size > CONN_READ_MIN)
+        conn->read_size /= 2;
+}
+
+/* Read one chunk and pass it to response callback */
+static int recv_chunk(connection_t *conn, int flags, size_t *total_size)
+{
+    char *buffer;
+    size_t len;
+    ssize_t bytes_received = 0;
+
+    if (conn->splice_left > 0)
+        return splice_chunk(conn, total_size);
+
+    len = reserve_read(conn, true);
+    if (len == 0) {
+        LOG_E("No memory for HTTP header");
+        return CONN_IO_ERROR;
+    }
+
+    buffer = conn->buffer + conn->buffer_offset;
+    bytes_received = recv(conn->sockfd, buffer, len, flags);
+
+    if (bytes_received > 0) {
+        adapt_read_size(conn, len, bytes_received);
+        *total_size += bytes_received;
+        conn->bytes_received += bytes_received;
+
+        /* Keep data NULL terminated for string lookups in header */
+        buffer[bytes_received] = '\0';
+        if (conn->process_response(conn->context, bytes_received) != 0)
+            return CONN_IO_DONE;
+
+        return CONN_IO_MORE;
+    }
+    else if (bytes_received == 0) {
+        return CONN_IO_DONE;
+    }
+    else if (errno == EINTR) {
+        return CONN_IO_MORE;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return CONN_IO_AGAIN;
+    }
+
+    return CONN_IO_ERROR;
+}
+
 int recv_all(connection_t *conn, int flags)
 {
-    int sockfd = 0;
-    size_t bytes_received = 0;
     size_t total_size = 0;
-    char * buffer = NULL;
+    int status;
 
     if (conn == NULL || conn->sockfd == 0 || conn->buffer == NULL)
         goto err;
 
-    sockfd = conn->sockfd;
-    buffer = conn->buffer;
-
     while(1)
     {
-        bytes_received = recv(sockfd, buffer, CHUNK_SIZE, flags);
-        total_size += bytes_received;
-
-        if (bytes_received > 0) {
-            conn->process_response(conn->context, bytes_received);
-        }
-        else if (bytes_received == 0) {
+        status = recv_chunk(conn, flags, &total_size);
+        if (status == CONN_IO_DONE)
             goto exit;
-        }
-        else if (bytes_received < 0) {
+        else if (status != CONN_IO_MORE)
             goto err;
-        }
-
-        if(conn->buffer_offset + CHUNK_SIZE > CONN_BUFFER_SIZE) {
-            LOG_E("HTTP header can't fit in 8KB");
-            goto err;
-        }
-
-        /* Append new data until all header has been receved */
-        buffer = conn->buffer + conn->buffer_offset;
     }
 
 exit:
@@ -227,6 +624,215 @@ err:
     return 0;
 }
 
+/* Send pending request data until socket buffer is full */
+int send_some(connection_t *conn, int flags)
+{
+    ssize_t n;
+
+    if (conn->send_offset == 0)
+        TRACE_MARK(&conn->trace, TRACE_SEND_START);
+
+    while (conn->send_offset < conn->send_len)
+    {
+        n = send_pieces(conn->sockfd, conn->send_iov, conn->send_iovcnt,
+                        conn->send_offset, flags);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_IO_AGAIN;
+            return CONN_IO_ERROR;
+        }
+        conn->send_offset += n;
+    }
+
+    TRACE_MARK(&conn->trace, TRACE_SENT);
+
+    return CONN_IO_DONE;
+}
+
+/* Drain socket until it would block, required for edge-triggered polling */
+int recv_some(connection_t *conn, int flags)
+{
+    size_t total_size = 0;
+    int status;
+
+    do {
+        status = recv_chunk(conn, flags, &total_size);
+    } while (status == CONN_IO_MORE);
+
+    return status;
+}
+
+/* Write span of response buffer to file at offset when the current receive
+ * completes. Returns -1 if span can't be queued */
+int queue_file_write(connection_t *conn, int fd, const char *data, size_t len, off_t offset)
+{
+    ring_write_t *w;
+
+    if (conn->ring_write_count == CONN_RING_WRITES && flush_file_writes(conn) != 0)
+        return -1;
+
+    w = &conn->ring_writes[conn->ring_write_count++];
+    w->fd = fd;
+    w->data = data;
+    w->len = len;
+    w->offset = offset;
+
+    return 0;
+}
+
+/* Write queued spans right away, before buffer they point to is changed */
+int flush_file_writes(connection_t *conn)
+{
+    ring_write_t *w;
+    ssize_t n;
+
+    for (int i = conn->ring_write_sent; i < conn->ring_write_count; ++i) {
+        w = &conn->ring_writes[i];
+        for (size_t off = 0; off < w->len; off += n) {
+            n = pwrite(w->fd, w->data + off, w->len - off, w->offset + off);
+            if (n < 0 && errno == EINTR)
+                n = 0;
+            else if (n <= 0) {
+                perror("Failed to write file");
+                conn->ring_write_count = conn->ring_write_sent;
+                return -1;
+            }
+        }
+    }
+    conn->ring_write_count = conn->ring_write_sent;
+
+    return 0;
+}
+
+/* Submit queued writes as one chain, followed by the next receive unless
+ * response is over */
+static int ring_queue(connection_t *conn, bool receive)
+{
+    struct io_uring_sqe *sqe;
+    ring_write_t *w;
+    int count = conn->ring_write_count - conn->ring_write_sent;
+    size_t len = 0;
+
+    /* Writes of the chain read the buffer, it can't be moved under them */
+    if (receive && (len = reserve_read(conn, count == 0)) == 0)
+        return -1;
+
+    if (uring_reserve(conn->ring, count + receive) != 0)
+        return -1;
+
+    for (int i = conn->ring_write_sent; i < conn->ring_write_count; ++i) {
+        w = &conn->ring_writes[i];
+        sqe = uring_get_sqe(conn->ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = w->fd;
+        sqe->addr = (uintptr_t)w->data;
+        sqe->len = w->len;
+        sqe->off = w->offset;
+        if (receive || i + 1 < conn->ring_write_count)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = RING_USER_DATA(conn, RING_OP_WRITE);
+        conn->ring_inflight++;
+    }
+    conn->ring_write_sent = conn->ring_write_count;
+
+    if (receive) {
+        sqe = uring_get_sqe(conn->ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->sockfd;
+        sqe->addr = (uintptr_t)(conn->buffer + conn->buffer_offset);
+        sqe->len = len;
+        sqe->user_data = RING_USER_DATA(conn, RING_OP_RECV);
+        conn->ring_inflight++;
+        conn->ring_read_size = len;
+    }
+
+    return 0;
+}
+
+/* Receive the rest of exchange through ring instead of recv_some() */
+int ring_start(connection_t *conn, struct uring *ring)
+{
+    conn->ring = ring;
+    conn->ring_write_count = conn->ring_write_sent = conn->ring_write_done = 0;
+    conn->ring_inflight = 0;
+    conn->ring_status = CONN_IO_AGAIN;
+
+    return ring_queue(conn, true);
+}
+
+/* Pass received data to response callback like recv_chunk() does */
+static int ring_received(connection_t *conn, int res)
+{
+    char *buffer = conn->buffer + conn->buffer_offset;
+
+    if (res > 0) {
+        adapt_read_size(conn, conn->ring_read_size, res);
+        conn->bytes_received += res;
+
+        buffer[res] = '\0';
+        if (conn->process_response(conn->context, res) != 0)
+            return CONN_IO_DONE;
+
+        return CONN_IO_MORE;
+    }
+    else if (res == 0) {
+        return CONN_IO_DONE;
+    }
+    else if (res == -EINTR || res == -EAGAIN) {
+        return CONN_IO_MORE;
+    }
+
+    /* Receive linked after failed write is canceled */
+    if (res != -ECANCELED) {
+        errno = -res;
+        perror("recv");
+    }
+
+    return CONN_IO_ERROR;
+}
+
+/* Handle completion of ring request of connection. Returns CONN_IO_AGAIN
+ * while exchange goes on or requests are in flight, then its status */
+int ring_complete(connection_t *conn, uint64_t user_data, int res)
+{
+    ring_write_t *w;
+    int status;
+
+    conn->ring_inflight--;
+
+    if ((user_data & RING_OP_MASK) == RING_OP_WRITE) {
+        w = &conn->ring_writes[conn->ring_write_done++];
+        if (res != (int)w->len && conn->ring_status != CONN_IO_ERROR) {
+            if (res < 0)
+                errno = -res;
+            else
+                errno = ENOSPC;
+            perror("Failed to write file");
+            conn->ring_status = CONN_IO_ERROR;
+        }
+    }
+    else {
+        /* Writes linked before receive have completed, spans are reused */
+        conn->ring_write_count = conn->ring_write_sent = conn->ring_write_done = 0;
+
+        status = ring_received(conn, res);
+        if (conn->ring_status == CONN_IO_AGAIN && status != CONN_IO_ERROR) {
+            if (ring_queue(conn, status == CONN_IO_MORE) != 0)
+                status = CONN_IO_ERROR;
+        }
+        if (status != CONN_IO_MORE && conn->ring_status == CONN_IO_AGAIN)
+            conn->ring_status = status;
+    }
+
+    if (conn->ring_inflight > 0 || conn->ring_status == CONN_IO_AGAIN)
+        return CONN_IO_AGAIN;
+
+    conn->ring = NULL;
+
+    return conn->ring_status;
+}
 
 void print_connection_error(int error)
 {
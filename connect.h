@@ -1,32 +1,130 @@
 #ifndef CONNECT_H
 #define CONNECT_H
 
+#include <cstdint>
+
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#include "resolver.h"
+#include "eyeballs.h"
+#include "trace.h"
+#include "arena.h"
+
+/* Return non-zero to stop receiving */
+typedef int (*cb)(void *, int bytes);
+/* Called when non-blocking transfer is over, status is 0 on success */
+typedef void (*done_cb)(void *, int status);
+
+/* Results of one step of non-blocking I/O */
+#define CONN_IO_ERROR   -1
+#define CONN_IO_MORE    0   /* Data was processed, socket might have more */
+#define CONN_IO_DONE    1   /* Transfer is over */
+#define CONN_IO_AGAIN   2   /* Wait until socket is ready */
+
+/* Body spans written by one chain of io_uring requests */
+#define CONN_RING_WRITES    32
+
+struct uring;
 
-typedef void (*cb)(void *, int bytes);
+/* Span of response buffer to be written to file at offset */
+typedef struct ring_write {
+    int         fd;
+    const char  *data;
+    size_t      len;
+    off_t       offset;
+} ring_write_t;
+
+/* Kind of io_uring request in low bits of its user data */
+#define RING_OP_RECV        0
+#define RING_OP_WRITE       1
+#define RING_OP_MASK        1
+#define RING_USER_DATA(conn, op)    ((uint64_t)(uintptr_t)(conn) | (op))
+#define RING_CONN(user_data)        ((connection_t *)(uintptr_t)((user_data) & ~(uint64_t)RING_OP_MASK))
+
+enum conn_state {
+    CONN_STATE_IDLE = 0,
+    CONN_STATE_CONNECTING,
+    CONN_STATE_SENDING,
+    CONN_STATE_RECEIVING
+};
 
 typedef struct connection {
     char    *host;
     char    *port;
     struct addrinfo *addr_info;
+    dns_addrs_t     *addrs;     /* Reference to cached addresses */
     int     sockfd;
     bool    opened;
+    connect_race_t  *race;  /* Connects to several addresses in progress */
+    bool    reused;     /* Taken from pool after previous request */
 
-    /* Buffer for response data */
+    /* Buffer for response data, header is kept at its start until it's
+     * parsed. Grows with read size, which follows how full reads are */
     char    *buffer;
+    size_t  buffer_size;
     size_t  buffer_offset;
+    size_t  read_size;
+    size_t  bytes_received;     /* Over connection lifetime */
+    trace_t trace;              /* Resolve, connect and the last send */
+    arena_t arena;              /* Requests of current exchange */
+
+    /* Request data, gathered from pieces by one sendmsg */
+    enum conn_state state;
+    const struct iovec *send_iov;
+    int         send_iovcnt;
+    size_t      send_len;
+    size_t      send_offset;
+
+    /* Headers common to requests of origin, rendered once by http,
+     * indexed by keep-alive */
+    char    *header_template[2];
+    size_t  header_template_len[2];
+
+    /* Body moved from socket to file in kernel, see splice_to_file() */
+    int     pipe_fds[2];
+    int     splice_fd;
+    loff_t  splice_offset;      /* Written at explicit offset like the rest of file */
+    size_t  splice_left;
+    bool    splice_disabled;
+
+    /* Response received through io_uring of event loop. Body spans are
+     * queued while buffer is parsed and written by requests linked before
+     * the next receive, which can't overwrite buffer until they are done */
+    struct uring    *ring;
+    ring_write_t    ring_writes[CONN_RING_WRITES];
+    int             ring_write_count;   /* Queued */
+    int             ring_write_sent;    /* Submitted, the rest is queued */
+    int             ring_write_done;    /* Completed, in order of chain */
+    int             ring_inflight;      /* Submitted requests not completed */
+    int             ring_status;        /* CONN_IO_AGAIN until exchange is over */
+    size_t          ring_read_size;     /* Length of submitted receive */
 
     /* Callback information */
     void    *context;
     cb      process_response;
+    cb      process_spliced;    /* Bytes written to file by splice */
+    done_cb process_done;
 } connection_t;
 
 connection_t * init_connection(const char *host, const char *port, int *error);
+connection_t * dup_connection(const connection_t *conn, int *error);
 void open_connection(connection_t *conn, int *error);
+void open_connection_async(connection_t *conn, int *error);
+int connect_result(connection_t *conn);
+int connect_step(connection_t *conn);
 void close_connection(connection_t *conn);
 void free_connection(connection_t *conn);
-int send_all(connection_t *conn, const char *buf, int len, int flags);
+int send_all(connection_t *conn, const struct iovec *iov, int iovcnt, int flags);
 int recv_all(connection_t *conn, int flags);
+int send_some(connection_t *conn, int flags);
+int recv_some(connection_t *conn, int flags);
+int splice_to_file(connection_t *conn, int fd, off_t offset, size_t bytes);
+int queue_file_write(connection_t *conn, int fd, const char *data, size_t len, off_t offset);
+int flush_file_writes(connection_t *conn);
+int ring_start(connection_t *conn, struct uring *ring);
+int ring_complete(connection_t *conn, uint64_t user_data, int res);
 void print_connection_info(const connection_t *conn);
 void print_connection_error(int error);
 
@@ -0,0 +1,94 @@
+#include "deque.h"
+
+#include <cstdlib>
+#include <cstring>
+
+/* Capacity is rounded up to a power of two */
+int deque_init(work_deque_t *deque, size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    memset(deque, 0, sizeof *deque);
+    deque->items = (void **)calloc(size, sizeof(void *));
+    if (deque->items == NULL)
+        return -1;
+    deque->mask = size - 1;
+
+    return 0;
+}
+
+void deque_release(work_deque_t *deque)
+{
+    free(deque->items);
+    deque->items = NULL;
+}
+
+/* Owner only. Returns -1 if deque is full */
+int deque_push(work_deque_t *deque, void *item)
+{
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if ((size_t)(b - t) > deque->mask)
+        return -1;
+
+    __atomic_store_n(&deque->items[b & deque->mask], item, __ATOMIC_RELAXED);
+    /* Item is visible before thieves can see new bottom */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* Owner only, the most recently pushed item or NULL */
+void * deque_pop(work_deque_t *deque)
+{
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    int64_t t;
+    void *item;
+
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        /* Empty */
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    item = __atomic_load_n(&deque->items[b & deque->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* The last item, thieves race for it */
+        if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+/* Any thread, the oldest item or NULL if deque is empty or another thread
+ * has taken it first */
+void * deque_steal(work_deque_t *deque)
+{
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    int64_t b;
+    void *item;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+
+    item = __atomic_load_n(&deque->items[t & deque->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return item;
+}
@@ -0,0 +1,24 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Lock-free work-stealing deque of Chase and Lev, in the form of Lê et al.
+ * for weak memory models. Owner thread pushes and pops at bottom, other
+ * threads steal from top. Capacity is fixed, a power of two */
+typedef struct work_deque {
+    int64_t     top;        /* Written by thieves and by owner taking the last item */
+    char        pad[64 - sizeof(int64_t)];
+    int64_t     bottom;     /* Written by owner only */
+    void        **items;
+    size_t      mask;
+} work_deque_t;
+
+int deque_init(work_deque_t *deque, size_t capacity);
+void deque_release(work_deque_t *deque);
+int deque_push(work_deque_t *deque, void *item);
+void * deque_pop(work_deque_t *deque);
+void * deque_steal(work_deque_t *deque);
+
+#endif // DEQUE_H
@@ -0,0 +1,789 @@
+#include "digest.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "log.h"
+
+#if defined(__x86_64__)
+#define DIGEST_X86
+#include <immintrin.h>
+#endif
+
+/* Castagnoli polynomial, bit reversed */
+#define CRC32C_POLY     0x82f63b78
+/* Bytes of each of three CRC streams computed at once */
+#define CRC_LANE        4096
+/* File is read back in pieces of that size */
+#define READ_SIZE       (256*1024)
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *data, size_t len);
+typedef void (*blocks_fn)(uint32_t *state, const unsigned char *data, size_t blocks);
+
+static const char *impl_names[] = { "scalar", "hw" };
+
+static const struct {
+    const char              *name;
+    enum digest_algorithm   algorithm;
+} names[] = {
+    { "crc32c",     DIGEST_CRC32C },
+    { "md5",        DIGEST_MD5 },
+    { "sha-256",    DIGEST_SHA256 },
+    { "sha256",     DIGEST_SHA256 },
+};
+
+static const uint32_t md5_init[4] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5_shift[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static digest_value_t check = { DIGEST_NONE, { 0 }, 0, false };
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[8][256];
+/* x^(2^n) mod polynomial, enough for any 64 bit length in bits */
+static uint32_t x2n_table[68];
+static uint32_t lane_shift[2];
+
+static enum digest_impl current_impl;
+static crc_fn crc_update;
+static blocks_fn sha256_blocks;
+
+/* Downloads are checked against this, size is 0 if digest is only printed */
+void digest_set_check(const digest_value_t *value)
+{
+    check = *value;
+}
+
+const digest_value_t * digest_check()
+{
+    return &check;
+}
+
+enum digest_algorithm digest_parse_name(const char *name, size_t len)
+{
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+        if (strlen(names[i].name) == len && strncasecmp(names[i].name, name, len) == 0)
+            return names[i].algorithm;
+    }
+
+    return DIGEST_NONE;
+}
+
+const char * digest_name(enum digest_algorithm algorithm)
+{
+    for (size_t i = 0; i < sizeof(names)/sizeof(names[0]); ++i) {
+        if (names[i].algorithm == algorithm)
+            return names[i].name;
+    }
+
+    return "none";
+}
+
+size_t digest_size(enum digest_algorithm algorithm)
+{
+    switch (algorithm) {
+    case DIGEST_CRC32C:
+        return 4;
+    case DIGEST_MD5:
+        return 16;
+    case DIGEST_SHA256:
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+/* a*b modulo polynomial, x^0 is the highest bit */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/* x^(n*2^k) modulo polynomial */
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+    uint32_t p = (uint32_t)1 << 31;
+
+    while (n) {
+        if (n & 1)
+            p = multmodp(x2n_table[k], p);
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+static void init_tables(void)
+{
+    uint32_t c;
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+    }
+
+    x2n_table[0] = (uint32_t)1 << 30;
+    for (size_t n = 1; n < sizeof(x2n_table)/sizeof(x2n_table[0]); ++n)
+        x2n_table[n] = multmodp(x2n_table[n - 1], x2n_table[n - 1]);
+
+    lane_shift[0] = x2nmodp(CRC_LANE, 3);
+    lane_shift[1] = x2nmodp(2 * CRC_LANE, 3);
+}
+
+/* Eight bytes at a time through eight tables */
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t word;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+    return crc;
+}
+
+#define MD5_STEP(f, a, b, c, d, i, g) do { \
+        uint32_t t = a + f(b, c, d) + md5_k[i] + w[g]; \
+        a = b + ROTL(t, md5_shift[((i) / 16) * 4 + ((i) & 3)]); \
+    } while (0)
+#define MD5_F(b, c, d) (d ^ (b & (c ^ d)))
+#define MD5_G(b, c, d) (c ^ (d & (b ^ c)))
+#define MD5_H(b, c, d) (b ^ c ^ d)
+#define MD5_I(b, c, d) (c ^ (b | ~d))
+
+/* Rounds are unrolled by four, so variables rotate by name */
+static void md5_blocks(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    uint32_t w[16], a, b, c, d;
+
+    while (blocks--) {
+        for (int i = 0; i < 16; ++i)
+            w[i] = data[4*i] | data[4*i + 1] << 8 | data[4*i + 2] << 16 | (uint32_t)data[4*i + 3] << 24;
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+
+        for (int i = 0; i < 16; i += 4) {
+            MD5_STEP(MD5_F, a, b, c, d, i, i);
+            MD5_STEP(MD5_F, d, a, b, c, i + 1, i + 1);
+            MD5_STEP(MD5_F, c, d, a, b, i + 2, i + 2);
+            MD5_STEP(MD5_F, b, c, d, a, i + 3, i + 3);
+        }
+        for (int i = 16; i < 32; i += 4) {
+            MD5_STEP(MD5_G, a, b, c, d, i, (5*i + 1) & 15);
+            MD5_STEP(MD5_G, d, a, b, c, i + 1, (5*i + 6) & 15);
+            MD5_STEP(MD5_G, c, d, a, b, i + 2, (5*i + 11) & 15);
+            MD5_STEP(MD5_G, b, c, d, a, i + 3, (5*i + 16) & 15);
+        }
+        for (int i = 32; i < 48; i += 4) {
+            MD5_STEP(MD5_H, a, b, c, d, i, (3*i + 5) & 15);
+            MD5_STEP(MD5_H, d, a, b, c, i + 1, (3*i + 8) & 15);
+            MD5_STEP(MD5_H, c, d, a, b, i + 2, (3*i + 11) & 15);
+            MD5_STEP(MD5_H, b, c, d, a, i + 3, (3*i + 14) & 15);
+        }
+        for (int i = 48; i < 64; i += 4) {
+            MD5_STEP(MD5_I, a, b, c, d, i, (7*i) & 15);
+            MD5_STEP(MD5_I, d, a, b, c, i + 1, (7*i + 7) & 15);
+            MD5_STEP(MD5_I, c, d, a, b, i + 2, (7*i + 14) & 15);
+            MD5_STEP(MD5_I, b, c, d, a, i + 3, (7*i + 21) & 15);
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        data += DIGEST_BLOCK_SIZE;
+    }
+}
+
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) do { \
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + (g ^ (e & (f ^ g))) + \
+            sha256_k[i] + w[i]; \
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) | (c & (a | b))); \
+        d += t1; \
+        h = t1 + t2; \
+    } while (0)
+
+static void sha256_blocks_scalar(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    uint32_t w[64], s[8], s0, s1;
+
+    while (blocks--) {
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)data[4*i] << 24 | data[4*i + 1] << 16 | data[4*i + 2] << 8 | data[4*i + 3];
+        for (int i = 16; i < 64; ++i) {
+            s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        memcpy(s, state, sizeof s);
+
+        for (int i = 0; i < 64; i += 8) {
+            SHA256_ROUND(s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], i);
+            SHA256_ROUND(s[7], s[0], s[1], s[2], s[3], s[4], s[5], s[6], i + 1);
+            SHA256_ROUND(s[6], s[7], s[0], s[1], s[2], s[3], s[4], s[5], i + 2);
+            SHA256_ROUND(s[5], s[6], s[7], s[0], s[1], s[2], s[3], s[4], i + 3);
+            SHA256_ROUND(s[4], s[5], s[6], s[7], s[0], s[1], s[2], s[3], i + 4);
+            SHA256_ROUND(s[3], s[4], s[5], s[6], s[7], s[0], s[1], s[2], i + 5);
+            SHA256_ROUND(s[2], s[3], s[4], s[5], s[6], s[7], s[0], s[1], i + 6);
+            SHA256_ROUND(s[1], s[2], s[3], s[4], s[5], s[6], s[7], s[0], i + 7);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            state[i] += s[i];
+        data += DIGEST_BLOCK_SIZE;
+    }
+}
+
+#ifdef DIGEST_X86
+/* Three streams over adjacent lanes hide latency of crc32 instruction,
+ * their CRCs are joined by shifting the first two over following lanes */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c0 = crc, c1, c2, w0, w1, w2;
+
+    while (len >= 3 * CRC_LANE) {
+        c1 = c2 = 0;
+        for (size_t i = 0; i < CRC_LANE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC_LANE + i, 8);
+            memcpy(&w2, p + 2 * CRC_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = multmodp(lane_shift[1], c0) ^ multmodp(lane_shift[0], c1) ^ c2;
+        p += 3 * CRC_LANE;
+        len -= 3 * CRC_LANE;
+    }
+
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+        p += 8;
+        len -= 8;
+    }
+
+    crc = c0;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+/* Four rounds at a time with SHA extensions. State is kept as ABEF and
+ * CDGH halves, which is the layout sha256rnds2 works on */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_hw(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    while (blocks--) {
+        abef = state0;
+        cdgh = state1;
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; ++i) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16*i)), mask);
+            }
+            else {
+                tmp = _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4);
+                w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), tmp),
+                    w[(i + 3) & 3]);
+            }
+
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4*i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += DIGEST_BLOCK_SIZE;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static bool impl_supported(enum digest_impl impl)
+{
+    switch (impl) {
+    case DIGEST_IMPL_SCALAR:
+        return true;
+#ifdef DIGEST_X86
+    case DIGEST_IMPL_HW:
+        return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("sha") &&
+            __builtin_cpu_supports("sse4.1");
+#endif
+    default:
+        return false;
+    }
+}
+
+static void use_impl(enum digest_impl impl)
+{
+    switch (impl) {
+#ifdef DIGEST_X86
+    case DIGEST_IMPL_HW:
+        crc_update = crc32c_hw;
+        sha256_blocks = sha256_blocks_hw;
+        break;
+#endif
+    default:
+        crc_update = crc32c_scalar;
+        sha256_blocks = sha256_blocks_scalar;
+        break;
+    }
+
+    current_impl = impl;
+}
+
+/* Tables and the best implementation CPU has, once for all threads */
+static void init_digest(void)
+{
+    init_tables();
+    use_impl(impl_supported(DIGEST_IMPL_HW) ? DIGEST_IMPL_HW : DIGEST_IMPL_SCALAR);
+}
+
+/* Not synchronised with running digests, call before any is started */
+bool digest_set_impl(enum digest_impl impl)
+{
+    pthread_once(&init_once, init_digest);
+
+    if (!impl_supported(impl))
+        return false;
+
+    use_impl(impl);
+
+    return true;
+}
+
+const char * digest_impl_name(void)
+{
+    pthread_once(&init_once, init_digest);
+
+    return impl_names[current_impl];
+}
+
+void digest_init(digest_t *digest, enum digest_algorithm algorithm)
+{
+    pthread_once(&init_once, init_digest);
+
+    memset(digest, 0, sizeof *digest);
+    digest->algorithm = algorithm;
+    digest->crc = 0xffffffff;
+
+    if (algorithm == DIGEST_MD5)
+        memcpy(digest->state, md5_init, sizeof md5_init);
+    else if (algorithm == DIGEST_SHA256)
+        memcpy(digest->state, sha256_init, sizeof sha256_init);
+}
+
+static void hash_blocks(digest_t *digest, const unsigned char *data, size_t blocks)
+{
+    if (digest->algorithm == DIGEST_MD5)
+        md5_blocks(digest->state, data, blocks);
+    else
+        sha256_blocks(digest->state, data, blocks);
+}
+
+void digest_update(digest_t *digest, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t n;
+
+    if (digest->algorithm == DIGEST_NONE || len == 0)
+        return;
+
+    digest->length += len;
+
+    if (digest->algorithm == DIGEST_CRC32C) {
+        digest->crc = crc_update(digest->crc, p, len);
+        return;
+    }
+
+    /* Complete block left from the previous span */
+    if (digest->block_used) {
+        n = DIGEST_BLOCK_SIZE - digest->block_used;
+        if (n > len)
+            n = len;
+        memcpy(digest->block + digest->block_used, p, n);
+        digest->block_used += n;
+        p += n;
+        len -= n;
+        if (digest->block_used < DIGEST_BLOCK_SIZE)
+            return;
+        hash_blocks(digest, digest->block, 1);
+        digest->block_used = 0;
+    }
+
+    if (len >= DIGEST_BLOCK_SIZE) {
+        hash_blocks(digest, p, len / DIGEST_BLOCK_SIZE);
+        p += len & ~(size_t)(DIGEST_BLOCK_SIZE - 1);
+        len &= DIGEST_BLOCK_SIZE - 1;
+    }
+
+    memcpy(digest->block, p, len);
+    digest->block_used = len;
+}
+
+/* Hash len bytes of file from offset, e.g. part written earlier */
+int digest_read(digest_t *digest, int fd, off_t offset, size_t len)
+{
+    char *buffer = (char *)malloc(READ_SIZE);
+    ssize_t n;
+
+    if (buffer == NULL)
+        return -1;
+
+    while (len > 0) {
+        n = pread(fd, buffer, len < READ_SIZE ? len : READ_SIZE, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            free(buffer);
+            return -1;
+        }
+        digest_update(digest, buffer, n);
+        offset += n;
+        len -= n;
+    }
+
+    free(buffer);
+
+    return 0;
+}
+
+/* Digests of adjacent ranges can be joined only for CRC */
+bool digest_combinable(enum digest_algorithm algorithm)
+{
+    return algorithm == DIGEST_CRC32C;
+}
+
+/* Append digest of range which follows the one already hashed */
+int digest_combine(digest_t *digest, const digest_t *next)
+{
+    uint32_t crc1 = ~digest->crc, crc2 = ~next->crc;
+
+    if (!digest_combinable(digest->algorithm) || next->algorithm != digest->algorithm)
+        return -1;
+
+    if (next->length)
+        digest->crc = ~(multmodp(x2nmodp(next->length, 3), crc1) ^ crc2);
+    digest->length += next->length;
+
+    return 0;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Pad last block and produce value, digest can't be updated after that */
+void digest_final(digest_t *digest, digest_value_t *value)
+{
+    uint64_t bits = digest->length * 8;
+    bool md5 = digest->algorithm == DIGEST_MD5;
+
+    memset(value, 0, sizeof *value);
+    value->algorithm = digest->algorithm;
+    value->size = digest_size(digest->algorithm);
+
+    if (digest->algorithm == DIGEST_CRC32C) {
+        put_be32(value->bytes, ~digest->crc);
+        return;
+    }
+    if (value->size == 0)
+        return;
+
+    digest->block[digest->block_used++] = 0x80;
+    if (digest->block_used > DIGEST_BLOCK_SIZE - 8) {
+        memset(digest->block + digest->block_used, 0, DIGEST_BLOCK_SIZE - digest->block_used);
+        hash_blocks(digest, digest->block, 1);
+        digest->block_used = 0;
+    }
+    memset(digest->block + digest->block_used, 0, DIGEST_BLOCK_SIZE - 8 - digest->block_used);
+
+    for (int i = 0; i < 8; ++i)
+        digest->block[DIGEST_BLOCK_SIZE - 8 + i] = md5 ? bits >> (8*i) : bits >> (56 - 8*i);
+    hash_blocks(digest, digest->block, 1);
+    digest->block_used = 0;
+
+    for (size_t i = 0; i < value->size / 4; ++i) {
+        if (md5)
+            put_le32(value->bytes + 4*i, digest->state[i]);
+        else
+            put_be32(value->bytes + 4*i, digest->state[i]);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+/* Standard and url safe alphabets */
+static int base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+' || c == '-')
+        return 62;
+    if (c == '/' || c == '_')
+        return 63;
+
+    return -1;
+}
+
+static bool all_hex(const char *text, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (hex_value(text[i]) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* Value is hex or base64, which is told apart by length */
+bool digest_parse_value(enum digest_algorithm algorithm, const char *text, size_t len,
+                        digest_value_t *value)
+{
+    size_t size = digest_size(algorithm), n = 0;
+    uint32_t bits = 0;
+    int count = 0, v;
+
+    memset(value, 0, sizeof *value);
+    if (size == 0)
+        return false;
+
+    if (len == 2 * size && all_hex(text, len)) {
+        for (size_t i = 0; i < size; ++i)
+            value->bytes[i] = hex_value(text[2*i]) << 4 | hex_value(text[2*i + 1]);
+        n = size;
+    }
+    else {
+        while (len > 0 && text[len - 1] == '=')
+            len--;
+        for (size_t i = 0; i < len; ++i) {
+            v = base64_value(text[i]);
+            if (v < 0)
+                return false;
+            bits = bits << 6 | v;
+            count += 6;
+            if (count >= 8) {
+                if (n == size)
+                    return false;
+                count -= 8;
+                value->bytes[n++] = bits >> count;
+                bits &= (1u << count) - 1;
+            }
+        }
+    }
+
+    if (n != size) {
+        memset(value, 0, sizeof *value);
+        return false;
+    }
+
+    value->algorithm = algorithm;
+    value->size = size;
+
+    return true;
+}
+
+static void trim(const char **begin, const char **end)
+{
+    while (*begin < *end && (**begin == ' ' || **begin == '\t'))
+        (*begin)++;
+    while (*end > *begin && ((*end)[-1] == ' ' || (*end)[-1] == '\t'))
+        (*end)--;
+}
+
+/* Digest or Repr-Digest field, a list of algorithm=value. Value of the
+ * given algorithm is taken, Repr-Digest wraps it in colons */
+bool digest_parse_field(enum digest_algorithm algorithm, const char *text, size_t len,
+                        digest_value_t *value)
+{
+    const char *end = text + len, *item, *item_end, *eq, *name, *v, *v_end;
+
+    for (item = text; item < end; item = item_end + 1) {
+        item_end = scan_char(item, end, ',');
+        eq = scan_char(item, item_end, '=');
+        if (eq == item_end)
+            continue;
+
+        name = item;
+        trim(&name, &eq);
+        if (digest_parse_name(name, eq - name) != algorithm)
+            continue;
+
+        v = eq + 1;
+        v_end = scan_char(v, item_end, ';');
+        trim(&v, &v_end);
+        if (v_end - v >= 2 && *v == ':' && v_end[-1] == ':') {
+            v++;
+            v_end--;
+        }
+
+        return digest_parse_value(algorithm, v, v_end - v, value);
+    }
+
+    return false;
+}
+
+void digest_format(const digest_value_t *value, char *text, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    if (size == 0)
+        return;
+
+    for (i = 0; i < value->size && 2*i + 2 < size; ++i) {
+        text[2*i] = hex[value->bytes[i] >> 4];
+        text[2*i + 1] = hex[value->bytes[i] & 15];
+    }
+    text[2*i] = '\0';
+}
+
+/* Finish digest of downloaded file and compare it with value given on
+ * command line, or else announced by server. ETag is only a guess, its
+ * mismatch is reported but doesn't fail download. Returns 0 or -1 */
+int digest_verify(digest_t *digest, const char *file, const digest_value_t *announced)
+{
+    const digest_value_t *expected = check.size ? &check : announced;
+    const char *name = digest_name(digest->algorithm);
+    digest_value_t computed;
+    char text[2 * DIGEST_MAX_SIZE + 1];
+    bool matches;
+
+    digest_final(digest, &computed);
+    digest_format(&computed, text, sizeof text);
+
+    if (expected == NULL || expected->size == 0 || expected->algorithm != computed.algorithm) {
+        LOG_I("%s of %s: %s", name, file, text);
+        return 0;
+    }
+
+    matches = memcmp(expected->bytes, computed.bytes, computed.size) == 0;
+    if (matches || expected->weak) {
+        LOG_I("%s of %s: %s, %s", name, file, text,
+              !matches ? "ETag isn't a digest" : expected->weak ? "matches ETag" : "verified");
+        return 0;
+    }
+
+    LOG_I("%s of %s: %s", name, file, text);
+    digest_format(expected, text, sizeof text);
+    LOG_E("%s of %s doesn't match expected %s", name, file, text);
+
+    return -1;
+}
@@ -0,0 +1,70 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+/* Largest digest, SHA-256 */
+#define DIGEST_MAX_SIZE     32
+#define DIGEST_BLOCK_SIZE   64
+
+enum digest_algorithm {
+    DIGEST_NONE = 0,
+    DIGEST_CRC32C,
+    DIGEST_MD5,
+    DIGEST_SHA256
+};
+
+/* CRC32C and SHA-256 use SSE4.2 and SHA extensions if CPU has them. The
+ * best implementation is chosen on first use */
+enum digest_impl {
+    DIGEST_IMPL_SCALAR = 0,
+    DIGEST_IMPL_HW
+};
+
+/* Digest value, from command line, server or computed */
+typedef struct digest_value {
+    enum digest_algorithm algorithm;
+    unsigned char   bytes[DIGEST_MAX_SIZE];
+    size_t          size;       /* 0 if there is no value */
+    bool            weak;       /* Guessed from ETag, may be no digest at all */
+} digest_value_t;
+
+/* Digest computed incrementally over spans of data */
+typedef struct digest {
+    enum digest_algorithm algorithm;
+    uint64_t        length;     /* Bytes hashed so far */
+    uint32_t        crc;
+    uint32_t        state[8];
+    unsigned char   block[DIGEST_BLOCK_SIZE];
+    size_t          block_used;
+} digest_t;
+
+/* Algorithm and optional expected value of downloads, see main() */
+void digest_set_check(const digest_value_t *check);
+const digest_value_t * digest_check();
+
+enum digest_algorithm digest_parse_name(const char *name, size_t len);
+const char * digest_name(enum digest_algorithm algorithm);
+size_t digest_size(enum digest_algorithm algorithm);
+bool digest_parse_value(enum digest_algorithm algorithm, const char *text, size_t len,
+                        digest_value_t *value);
+bool digest_parse_field(enum digest_algorithm algorithm, const char *text, size_t len,
+                        digest_value_t *value);
+void digest_format(const digest_value_t *value, char *text, size_t size);
+
+void digest_init(digest_t *digest, enum digest_algorithm algorithm);
+void digest_update(digest_t *digest, const void *data, size_t len);
+int digest_read(digest_t *digest, int fd, off_t offset, size_t len);
+bool digest_combinable(enum digest_algorithm algorithm);
+int digest_combine(digest_t *digest, const digest_t *next);
+void digest_final(digest_t *digest, digest_value_t *value);
+int digest_verify(digest_t *digest, const char *file, const digest_value_t *announced);
+
+/* Switch implementation, for benchmarks. Returns false if CPU lacks it */
+bool digest_set_impl(enum digest_impl impl);
+const char * digest_impl_name(void);
+
+#endif // DIGEST_H
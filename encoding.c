@@ -0,0 +1,210 @@
+#include "encoding.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+static const struct {
+    const char          *name;
+    enum content_coding coding;
+} codings[] = {
+    { "identity",   CODING_IDENTITY },
+    { "gzip",       CODING_GZIP },
+    { "x-gzip",     CODING_GZIP },
+    { "deflate",    CODING_DEFLATE },
+    { "zstd",       CODING_ZSTD },
+};
+
+/* Single coding of Content-Encoding value, several stacked codings
+ * aren't supported */
+enum content_coding content_coding_parse(const char *value, size_t len)
+{
+    while (len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        len--;
+    }
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+
+    for (size_t i = 0; i < sizeof(codings)/sizeof(codings[0]); ++i) {
+        if (strlen(codings[i].name) == len && strncasecmp(codings[i].name, value, len) == 0)
+            return codings[i].coding;
+    }
+
+    return CODING_UNKNOWN;
+}
+
+const char * content_coding_name(enum content_coding coding)
+{
+    for (size_t i = 0; i < sizeof(codings)/sizeof(codings[0]); ++i) {
+        if (codings[i].coding == coding)
+            return codings[i].name;
+    }
+
+    return "unknown";
+}
+
+/* Codings this build can decode */
+const char * accept_encoding_header()
+{
+#ifdef HAVE_ZSTD
+    return "Accept-Encoding: zstd, gzip, deflate\r\n";
+#else
+    return "Accept-Encoding: gzip, deflate\r\n";
+#endif
+}
+
+int content_decoder_init(content_decoder_t *decoder, enum content_coding coding,
+                         decoded_cb on_data, void *context)
+{
+    memset(decoder, 0, sizeof *decoder);
+
+    if (coding != CODING_GZIP && coding != CODING_DEFLATE) {
+#ifdef HAVE_ZSTD
+        if (coding != CODING_ZSTD)
+            return -1;
+#else
+        return -1;
+#endif
+    }
+
+    decoder->coding = coding;
+    decoder->on_data = on_data;
+    decoder->context = context;
+    decoder->window = (char *)malloc(ENCODING_WINDOW);
+    if (decoder->window == NULL)
+        return -1;
+
+#ifdef HAVE_ZSTD
+    if (coding == CODING_ZSTD) {
+        decoder->zstd = ZSTD_createDStream();
+        if (decoder->zstd == NULL || ZSTD_isError(ZSTD_initDStream(decoder->zstd))) {
+            content_decoder_free(decoder);
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* "deflate" should have zlib wrapper, but some servers send raw stream */
+static bool zlib_header(unsigned char cmf)
+{
+    return (cmf & 0x0f) == Z_DEFLATED && (cmf >> 4) <= 7;
+}
+
+static int pass_window(content_decoder_t *decoder, size_t bytes)
+{
+    if (bytes == 0)
+        return 0;
+
+    decoder->out_bytes += bytes;
+
+    return decoder->on_data(decoder->context, decoder->window, bytes);
+}
+
+static int inflate_data(content_decoder_t *decoder, const char *data, size_t len)
+{
+    z_stream *zs = &decoder->zs;
+    size_t produced;
+    int ret, bits = 15 + 16;
+
+    if (!decoder->zs_ready) {
+        if (decoder->coding == CODING_DEFLATE)
+            bits = zlib_header((unsigned char)data[0]) ? 15 : -15;
+        if (inflateInit2(zs, bits) != Z_OK)
+            return ENCODING_ERROR;
+        decoder->zs_ready = true;
+    }
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = len;
+
+    do {
+        /* Another member of concatenated gzip */
+        if (decoder->finished) {
+            if (zs->avail_in == 0)
+                break;
+            if (decoder->coding != CODING_GZIP || inflateReset(zs) != Z_OK)
+                return ENCODING_ERROR;
+            decoder->finished = false;
+        }
+
+        zs->next_out = (Bytef *)decoder->window;
+        zs->avail_out = ENCODING_WINDOW;
+
+        ret = inflate(zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            return ENCODING_ERROR;
+
+        produced = ENCODING_WINDOW - zs->avail_out;
+        if (pass_window(decoder, produced) != 0)
+            return ENCODING_STOPPED;
+
+        if (ret == Z_STREAM_END)
+            decoder->finished = true;
+        else if (ret == Z_BUF_ERROR && produced == 0)
+            break;
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+    return decoder->finished ? ENCODING_DONE : ENCODING_MORE;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_data(content_decoder_t *decoder, const char *data, size_t len)
+{
+    ZSTD_inBuffer in = { data, len, 0 };
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    do {
+        out.dst = decoder->window;
+        out.size = ENCODING_WINDOW;
+        out.pos = 0;
+
+        ret = ZSTD_decompressStream(decoder->zstd, &out, &in);
+        if (ZSTD_isError(ret))
+            return ENCODING_ERROR;
+
+        if (pass_window(decoder, out.pos) != 0)
+            return ENCODING_STOPPED;
+
+        /* Frame is over, the next one may follow */
+        decoder->finished = ret == 0;
+    } while (in.pos < in.size || out.pos == out.size);
+
+    return decoder->finished ? ENCODING_DONE : ENCODING_MORE;
+}
+#endif
+
+/* Decode the next span of body and pass decoded data to callback */
+int content_decode(content_decoder_t *decoder, const char *data, size_t len)
+{
+    if (len == 0)
+        return decoder->finished ? ENCODING_DONE : ENCODING_MORE;
+
+    decoder->in_bytes += len;
+
+#ifdef HAVE_ZSTD
+    if (decoder->coding == CODING_ZSTD)
+        return zstd_data(decoder, data, len);
+#endif
+
+    return inflate_data(decoder, data, len);
+}
+
+void content_decoder_free(content_decoder_t *decoder)
+{
+    if (decoder->zs_ready)
+        inflateEnd(&decoder->zs);
+    decoder->zs_ready = false;
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(decoder->zstd);
+    decoder->zstd = NULL;
+#endif
+
+    free(decoder->window);
+    decoder->window = NULL;
+}
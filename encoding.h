@@ -0,0 +1,57 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <cstddef>
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Decoded data is passed on in pieces of at most this size */
+#define ENCODING_WINDOW     (64*1024)
+
+enum content_coding {
+    CODING_IDENTITY = 0,
+    CODING_GZIP,
+    CODING_DEFLATE,
+    CODING_ZSTD,
+    CODING_UNKNOWN
+};
+
+/* Results of content_decode */
+#define ENCODING_ERROR      -1
+#define ENCODING_MORE       0   /* All input consumed */
+#define ENCODING_DONE       1   /* End of compressed stream */
+#define ENCODING_STOPPED    2   /* Data callback asked to stop */
+
+/* Called for every piece of decoded data. Return non-zero to stop decoding */
+typedef int (*decoded_cb)(void *context, const char *data, size_t bytes);
+
+/* Streaming decompression of body. Input may be split anywhere, output
+ * goes through one window buffer, so whole body is never held in memory */
+typedef struct content_decoder {
+    enum content_coding coding;
+    z_stream    zs;
+    bool        zs_ready;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+    char        *window;
+    size_t      in_bytes;
+    size_t      out_bytes;
+    bool        finished;
+
+    void        *context;
+    decoded_cb  on_data;
+} content_decoder_t;
+
+enum content_coding content_coding_parse(const char *value, size_t len);
+const char * content_coding_name(enum content_coding coding);
+const char * accept_encoding_header();
+int content_decoder_init(content_decoder_t *decoder, enum content_coding coding,
+                         decoded_cb on_data, void *context);
+int content_decode(content_decoder_t *decoder, const char *data, size_t len);
+void content_decoder_free(content_decoder_t *decoder);
+
+#endif // ENCODING_H
@@ -0,0 +1,446 @@
+#include "event_loop.h"
+
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define MAX_EVENTS  256
+/* Submission queue shared by connections of loop, each one takes at most
+ * CONN_RING_WRITES + 1 entries per receive */
+#define RING_ENTRIES 256
+
+static const char *loop_errors[] = {
+#define LOOP_NO_ERROR               0
+  "No error",
+#define LOOP_EPOLL_ERROR            1
+  "Failed to create epoll",
+#define LOOP_BAD_ALLOC              2
+  "Bad alloc"
+};
+
+/* Backend of loops created from now on */
+static enum loop_backend default_backend = LOOP_BACKEND_EPOLL;
+static bool ring_unavailable = false;
+
+void event_loop_use_backend(enum loop_backend backend)
+{
+    default_backend = backend;
+}
+
+static void reap_ring(void *context);
+
+/* Falls back to epoll when kernel can't give a ring, reported once */
+static void create_ring(event_loop_t *loop)
+{
+    int error;
+
+    if (ring_unavailable)
+        return;
+
+    loop->ring = (uring_t *)calloc(1, sizeof(uring_t));
+    if (!loop->ring)
+        return;
+
+    error = uring_init(loop->ring, RING_ENTRIES);
+    if (error == URING_NO_ERROR &&
+        event_loop_watch(loop, loop->ring->fd, reap_ring, loop) == 0)
+        return;
+
+    if (error) {
+        print_uring_error(error);
+        ring_unavailable = true;
+    }
+    LOG_I("Using epoll instead of io_uring");
+
+    uring_exit(loop->ring);
+    free(loop->ring);
+    loop->ring = NULL;
+}
+
+event_loop_t * event_loop_create(int *error)
+{
+    int error_code = 0;
+    event_loop_t *loop = (event_loop_t *)calloc(1, sizeof(event_loop_t));
+    if (!loop) {
+        error_code = LOOP_BAD_ALLOC;
+        goto err;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("epoll_create1");
+        error_code = LOOP_EPOLL_ERROR;
+        goto err;
+    }
+
+    if (default_backend == LOOP_BACKEND_URING)
+        create_ring(loop);
+
+    return loop;
+
+err:
+    LOG_E("Event loop problem: %s", loop_errors[error_code]);
+    if (error)
+        *error = error_code;
+
+    free(loop);
+
+    return NULL;
+}
+
+void event_loop_free(event_loop_t *loop)
+{
+    if (!loop)
+        return;
+
+    if (loop->ring) {
+        uring_exit(loop->ring);
+        free(loop->ring);
+    }
+
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+
+    free(loop->racing);
+    free(loop->decided);
+
+    while (loop->watches) {
+        event_watch_t *next = loop->watches->next;
+        free(loop->watches);
+        loop->watches = next;
+    }
+
+    free(loop);
+}
+
+/* Watch sockets of connect attempts started since the last call */
+static int watch_attempts(event_loop_t *loop, connection_t *conn)
+{
+    struct epoll_event ev;
+    connect_attempt_t *a;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+
+    for (int i = 0; i < conn->race->started; ++i) {
+        a = &conn->race->attempts[i];
+        if (a->fd < 0 || a->registered)
+            continue;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, a->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        a->registered = true;
+    }
+
+    return 0;
+}
+
+static int start_racing(event_loop_t *loop, connection_t *conn)
+{
+    /* Both lists together never hold more than capacity */
+    if (loop->racing_count + loop->decided_count == loop->racing_capacity) {
+        int capacity = loop->racing_capacity ? loop->racing_capacity * 2 : 16;
+        connection_t **racing = (connection_t **)realloc(loop->racing, capacity * sizeof(connection_t *));
+        if (!racing)
+            return -1;
+        loop->racing = racing;
+
+        racing = (connection_t **)realloc(loop->decided, capacity * sizeof(connection_t *));
+        if (!racing)
+            return -1;
+        loop->decided = racing;
+        loop->racing_capacity = capacity;
+    }
+
+    loop->racing[loop->racing_count++] = conn;
+
+    return watch_attempts(loop, conn);
+}
+
+static void stop_racing(event_loop_t *loop, connection_t *conn)
+{
+    for (int i = 0; i < loop->racing_count; ++i) {
+        if (loop->racing[i] == conn) {
+            loop->racing[i] = loop->racing[--loop->racing_count];
+            loop->decided[loop->decided_count++] = conn;
+            return;
+        }
+    }
+}
+
+/* Start connecting, or sending on already opened connection, and watch
+ * socket until transfer is over */
+int event_loop_add(event_loop_t *loop, connection_t *conn)
+{
+    int error = 0;
+    struct epoll_event ev;
+
+    if (conn->opened) {
+        conn->state = CONN_STATE_SENDING;
+    }
+    else {
+        open_connection_async(conn, &error);
+        if (error) {
+            print_connection_error(error);
+            return -1;
+        }
+    }
+
+    if (conn->race) {
+        if (start_racing(loop, conn) != 0) {
+            stop_racing(loop, conn);
+            close_connection(conn);
+            return -1;
+        }
+        loop->active++;
+        return 0;
+    }
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->sockfd, &ev) < 0) {
+        perror("epoll_ctl");
+        close_connection(conn);
+        return -1;
+    }
+
+    loop->active++;
+
+    return 0;
+}
+
+/* Watch descriptor for reading, it doesn't keep loop running by itself */
+int event_loop_watch(event_loop_t *loop, int fd, watch_cb process_ready, void *context)
+{
+    struct epoll_event ev;
+    event_watch_t *watch = (event_watch_t *)calloc(1, sizeof(event_watch_t));
+    if (!watch)
+        return -1;
+
+    watch->fd = fd;
+    watch->process_ready = process_ready;
+    watch->context = context;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = watch;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        free(watch);
+        return -1;
+    }
+
+    watch->next = loop->watches;
+    loop->watches = watch;
+
+    return 0;
+}
+
+void event_loop_unwatch(event_loop_t *loop, int fd)
+{
+    event_watch_t **p = &loop->watches, *watch;
+
+    while ((watch = *p) != NULL) {
+        if (watch->fd == fd) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+            *p = watch->next;
+            free(watch);
+            return;
+        }
+        p = &watch->next;
+    }
+}
+
+static bool race_decided(event_loop_t *loop, void *ptr)
+{
+    for (int i = 0; i < loop->decided_count; ++i) {
+        if (loop->decided[i] == ptr)
+            return true;
+    }
+
+    return false;
+}
+
+static event_watch_t * find_watch(event_loop_t *loop, void *ptr)
+{
+    for (event_watch_t *watch = loop->watches; watch != NULL; watch = watch->next) {
+        if (watch == ptr)
+            return watch;
+    }
+
+    return NULL;
+}
+
+static void finish(event_loop_t *loop, connection_t *conn, int status)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    conn->state = CONN_STATE_IDLE;
+    loop->active--;
+
+    if (conn->process_done)
+        conn->process_done(conn->context, status == CONN_IO_DONE ? 0 : -1);
+}
+
+/* Socket leaves epoll, completions of ring drive it until response is over */
+static int receive_with_ring(event_loop_t *loop, connection_t *conn)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+
+    if (ring_start(conn, loop->ring) != 0) {
+        conn->ring = NULL;
+        return CONN_IO_ERROR;
+    }
+
+    return CONN_IO_AGAIN;
+}
+
+/* Dispatch completions of all connections, ring is readable while its
+ * completion queue isn't empty */
+static void reap_ring(void *context)
+{
+    event_loop_t *loop = (event_loop_t *)context;
+    struct io_uring_cqe *cqe;
+    connection_t *conn;
+    uint64_t user_data;
+    int res, status;
+
+    while ((cqe = uring_peek_cqe(loop->ring)) != NULL) {
+        user_data = cqe->user_data;
+        res = cqe->res;
+        uring_cqe_seen(loop->ring);
+
+        conn = RING_CONN(user_data);
+        status = ring_complete(conn, user_data, res);
+        if (status != CONN_IO_AGAIN)
+            finish(loop, conn, status);
+    }
+}
+
+/* Advance connection state machine as far as socket allows */
+static void handle_events(event_loop_t *loop, connection_t *conn, uint32_t events)
+{
+    int status = CONN_IO_AGAIN;
+
+    /* Event reported before socket was handed over to ring */
+    if (conn->ring)
+        return;
+
+    if (conn->state == CONN_STATE_CONNECTING) {
+        if (!conn->race && !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+
+        if (conn->race) {
+            status = connect_step(conn);
+            if (status == CONN_IO_AGAIN && watch_attempts(loop, conn) == 0)
+                return;
+            stop_racing(loop, conn);
+        }
+        else {
+            status = connect_step(conn);
+        }
+
+        if (status != CONN_IO_DONE) {
+            status = CONN_IO_ERROR;
+            goto exit;
+        }
+        conn->state = CONN_STATE_SENDING;
+    }
+
+    if (conn->state == CONN_STATE_SENDING) {
+        status = send_some(conn, 0);
+        if (status != CONN_IO_DONE)
+            goto exit;
+
+        conn->state = CONN_STATE_RECEIVING;
+    }
+
+    if (conn->state == CONN_STATE_RECEIVING) {
+        if (loop->ring)
+            status = receive_with_ring(loop, conn);
+        else
+            status = recv_some(conn, 0);
+    }
+
+exit:
+    if (status != CONN_IO_AGAIN)
+        finish(loop, conn, status);
+}
+
+/* Time until the next connect attempt of racing connections */
+static int next_timeout(event_loop_t *loop)
+{
+    int timeout = -1, t;
+
+    for (int i = 0; i < loop->racing_count; ++i) {
+        t = race_timeout(loop->racing[i]->race);
+        if (t >= 0 && (timeout < 0 || t < timeout))
+            timeout = t;
+    }
+
+    return timeout;
+}
+
+/* Start next attempts of races which haven't been decided in time */
+static void expire_races(event_loop_t *loop)
+{
+    connection_t *conn;
+
+    for (int i = 0; i < loop->racing_count; ) {
+        conn = loop->racing[i];
+        if (race_timeout(conn->race) != 0) {
+            ++i;
+            continue;
+        }
+
+        handle_events(loop, conn, 0);
+
+        /* Connection left the list, the same index holds another one now */
+        if (i < loop->racing_count && loop->racing[i] == conn)
+            ++i;
+    }
+}
+
+/* Dispatch events until all connections are finished */
+int event_loop_run(event_loop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    while (loop->active > 0)
+    {
+        /* Requests queued by all connections since the last wait go to
+         * kernel in one call */
+        if (loop->ring && uring_submit(loop->ring) < 0)
+            return -1;
+
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, next_timeout(loop));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
+        }
+
+        loop->decided_count = 0;
+
+        for (int i = 0; i < n; ++i) {
+            event_watch_t *watch = find_watch(loop, events[i].data.ptr);
+            if (watch)
+                watch->process_ready(watch->context);
+            else if (!race_decided(loop, events[i].data.ptr))
+                handle_events(loop, (connection_t *)events[i].data.ptr, events[i].events);
+        }
+
+        loop->decided_count = 0;
+        expire_races(loop);
+    }
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "connect.h"
+#include "uring.h"
+
+enum loop_backend {
+    LOOP_BACKEND_EPOLL = 0,
+    LOOP_BACKEND_URING      /* Responses received and saved through io_uring */
+};
+
+/* Called when watched descriptor becomes readable */
+typedef void (*watch_cb)(void *context);
+
+/* Descriptor other than connection socket, e.g. eventfd of worker threads */
+typedef struct event_watch {
+    int             fd;
+    watch_cb        process_ready;
+    void            *context;
+    struct event_watch *next;
+} event_watch_t;
+
+/* Edge-triggered epoll reactor which drives many non-blocking connections
+ * in one thread. Connection is detached and its process_done callback is
+ * called once the transfer is over, callback decides whether to close it.
+ * With io_uring backend connections of loop share one ring for receiving
+ * responses and writing bodies, ring descriptor is watched by epoll */
+typedef struct event_loop {
+    int     epfd;
+    int     active;     /* Connections and other jobs in flight */
+    event_watch_t *watches;
+    uring_t *ring;      /* NULL if loop uses epoll only */
+
+    /* Connections racing several addresses, they need timers */
+    connection_t    **racing;
+    int             racing_count;
+    int             racing_capacity;
+    /* Races decided while dispatching current events, their losing
+     * sockets may still have events which must be skipped */
+    connection_t    **decided;
+    int             decided_count;
+} event_loop_t;
+
+void event_loop_use_backend(enum loop_backend backend);
+event_loop_t * event_loop_create(int *error);
+void event_loop_free(event_loop_t *loop);
+int event_loop_add(event_loop_t *loop, connection_t *conn);
+int event_loop_run(event_loop_t *loop);
+int event_loop_watch(event_loop_t *loop, int fd, watch_cb process_ready, void *context);
+void event_loop_unwatch(event_loop_t *loop, int fd);
+
+#endif // EVENT_LOOP_H
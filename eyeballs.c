@@ -0,0 +1,186 @@
+#include "eyeballs.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static void now(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static long ms_until(const struct timespec *ts)
+{
+    struct timespec current;
+    long ms;
+
+    now(&current);
+    ms = (ts->tv_sec - current.tv_sec) * 1000 + (ts->tv_nsec - current.tv_nsec) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+/* Interleave families starting with the first one of resolver order */
+static void order_addresses(connect_race_t *race, const struct addrinfo *list)
+{
+    const struct addrinfo *first = list, *other = list;
+    int family = list->ai_family;
+
+    while (race->count < RACE_MAX_ATTEMPTS && (first || other)) {
+        while (first && first->ai_family != family)
+            first = first->ai_next;
+        if (first) {
+            race->attempts[race->count++].addr = first;
+            first = first->ai_next;
+        }
+
+        while (other && other->ai_family == family)
+            other = other->ai_next;
+        if (other && race->count < RACE_MAX_ATTEMPTS) {
+            race->attempts[race->count++].addr = other;
+            other = other->ai_next;
+        }
+    }
+}
+
+/* Failed attempt doesn't hold the next one back */
+static void fail_attempt(connect_race_t *race, connect_attempt_t *a)
+{
+    if (a->fd >= 0)
+        close(a->fd);
+    a->fd = -1;
+    race->failed++;
+    now(&race->next_attempt);
+}
+
+/* Start connect to the next address */
+static void start_attempt(connect_race_t *race)
+{
+    connect_attempt_t *a = &race->attempts[race->started++];
+    const struct addrinfo *ai = a->addr;
+
+    now(&race->next_attempt);
+    race->next_attempt.tv_nsec += RACE_ATTEMPT_DELAY_MS * 1000000L;
+    if (race->next_attempt.tv_nsec >= 1000000000L) {
+        race->next_attempt.tv_sec++;
+        race->next_attempt.tv_nsec -= 1000000000L;
+    }
+
+    a->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+    if (a->fd < 0) {
+        fail_attempt(race, a);
+        return;
+    }
+
+    if (connect(a->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        LOG_D("Connect attempt %d failed: %s", race->started, strerror(errno));
+        fail_attempt(race, a);
+    }
+}
+
+connect_race_t * race_start(const struct addrinfo *list)
+{
+    connect_race_t *race = (connect_race_t *)calloc(1, sizeof(connect_race_t));
+    if (!race)
+        return NULL;
+
+    order_addresses(race, list);
+    for (int i = 0; i < race->count; ++i)
+        race->attempts[i].fd = -1;
+
+    start_attempt(race);
+
+    return race;
+}
+
+/* Check started attempts and start the next one when its time has come,
+ * failure brings it forward. Winner socket is taken from race */
+int race_step(connect_race_t *race, int *fd)
+{
+    struct pollfd fds[RACE_MAX_ATTEMPTS];
+    int index[RACE_MAX_ATTEMPTS];
+    int n = 0, error;
+    socklen_t len;
+
+    for (int i = 0; i < race->started; ++i) {
+        if (race->attempts[i].fd < 0)
+            continue;
+        fds[n].fd = race->attempts[i].fd;
+        fds[n].events = POLLOUT;
+        fds[n].revents = 0;
+        index[n++] = i;
+    }
+
+    if (n > 0 && poll(fds, n, 0) > 0) {
+        for (int i = 0; i < n; ++i) {
+            connect_attempt_t *a = &race->attempts[index[i]];
+
+            if (!fds[i].revents)
+                continue;
+
+            len = sizeof error;
+            if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0) {
+                LOG_D("Connect attempt %d won", index[i] + 1);
+                *fd = a->fd;
+                a->fd = -1;
+                return RACE_WON;
+            }
+
+            LOG_D("Connect attempt %d failed: %s", index[i] + 1, strerror(error));
+            fail_attempt(race, a);
+        }
+    }
+
+    while (race->started < race->count && ms_until(&race->next_attempt) == 0)
+        start_attempt(race);
+
+    return race->failed == race->count ? RACE_FAILED : RACE_PENDING;
+}
+
+/* Milliseconds until the next attempt, -1 if all addresses are started */
+int race_timeout(const connect_race_t *race)
+{
+    if (race->started == race->count)
+        return -1;
+
+    return ms_until(&race->next_attempt);
+}
+
+/* Block until some attempt finishes or the next one is due */
+void race_wait(connect_race_t *race)
+{
+    struct pollfd fds[RACE_MAX_ATTEMPTS];
+    int n = 0;
+
+    for (int i = 0; i < race->started; ++i) {
+        if (race->attempts[i].fd < 0)
+            continue;
+        fds[n].fd = race->attempts[i].fd;
+        fds[n].events = POLLOUT;
+        fds[n].revents = 0;
+        n++;
+    }
+
+    if (poll(fds, n, race_timeout(race)) < 0 && errno != EINTR)
+        perror("poll");
+}
+
+/* Cancel attempts which are still in progress */
+void race_free(connect_race_t *race)
+{
+    if (!race)
+        return;
+
+    for (int i = 0; i < race->started; ++i) {
+        if (race->attempts[i].fd >= 0)
+            close(race->attempts[i].fd);
+    }
+
+    free(race);
+}
@@ -0,0 +1,39 @@
+#ifndef EYEBALLS_H
+#define EYEBALLS_H
+
+#include <ctime>
+
+#include <netdb.h>
+
+/* Delay before the next address is tried, RFC 8305 recommends 250 ms */
+#define RACE_ATTEMPT_DELAY_MS   250
+#define RACE_MAX_ATTEMPTS       8
+
+/* Results of race_step */
+#define RACE_FAILED     -1
+#define RACE_PENDING    0
+#define RACE_WON        1
+
+typedef struct connect_attempt {
+    const struct addrinfo *addr;
+    int     fd;             /* -1 if not started or failed */
+    bool    registered;     /* Watched by event loop */
+} connect_attempt_t;
+
+/* Non-blocking connects to several addresses of host, started one by one
+ * with a delay, families alternate. The first connected socket wins */
+typedef struct connect_race {
+    connect_attempt_t attempts[RACE_MAX_ATTEMPTS];
+    int     count;
+    int     started;
+    int     failed;
+    struct timespec next_attempt;
+} connect_race_t;
+
+connect_race_t * race_start(const struct addrinfo *list);
+int race_step(connect_race_t *race, int *fd);
+int race_timeout(const connect_race_t *race);
+void race_wait(connect_race_t *race);
+void race_free(connect_race_t *race);
+
+#endif // EYEBALLS_H
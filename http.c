@@ -2,28 +2,81 @@
 
 #include "log.h"
 #include "buffer.h"
+#include "scan.h"
 
 #include <cstdlib>
+#include <cstdint>
+#include <strings.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEMPLATE_BUFF_SIZE 128
+/* Smaller bodies aren't worth extra syscalls of splice */
+#define SPLICE_MIN_SIZE 1024*64
+/* Progress of continued download is recorded after that many bytes */
+#define JOURNAL_SYNC_SIZE 1024*1024
+
+#define HTTP_PROTOCOL "HTTP/1.1"
+#define HTTP_CONTENT_LENGTH "Content-Length"
+#define HTTP_TRANSFER_ENCODING "Transfer-Encoding"
+#define HTTP_ACCEPT_RANGES "Accept-Ranges"
+#define HTTP_CONNECTION "Connection"
+#define HTTP_CONTENT_RANGE "Content-Range"
+#define HTTP_ETAG "ETag"
+#define HTTP_LAST_MODIFIED "Last-Modified"
+#define HTTP_CONTENT_ENCODING "Content-Encoding"
+#define HTTP_DIGEST "Digest"
+#define HTTP_REPR_DIGEST "Repr-Digest"
+#define HTTP_CONTENT_MD5 "Content-MD5"
+
+http_request_t * new_request(connection_t *conn);
+int request_pieces(http_request_t *request, const char *method, const char *path,
+                   const char *headers, bool keep_alive);
+http_request_t * build_request(connection_t *conn, const char *method, const char *path,
+                               const char *headers, bool keep_alive);
+void request_free(http_request_t *request);
+void header_field_cb(void *context, const char *name, size_t name_len,
+                     const char *value, size_t value_len);
+int response_cb(void *context, int bytes);
+void request_done_cb(void *context, int status);
+int request_status(http_request_t *request);
+int spliced_cb(void *context, int bytes);
+int pipeline_response_cb(void *context, int bytes);
+int pipeline_spliced_cb(void *context, int bytes);
+void pipeline_done_cb(void *context, int status);
+int chunk_received_cb(void *context, const char *data, size_t bytes);
+void update_journal(http_request_t *request, bool force);
+void announced_digest(http_request_t *request, digest_value_t *value);
+void trace_finish(http_request_t *request);
+void http_pipeline_free(http_pipeline_t *pipeline);
+
+static size_t header_limit = HTTP_DEFAULT_HEADER_LIMIT;
+
+/* Header is accumulated in connection buffer, limit bounds its growth */
+void http_set_header_limit(size_t limit)
+{
+    header_limit = limit;
+}
 
-#define REQUEST_BUFF_SIZE 1024
-
-#define HTTP_PROTOCOL "HTTP/1.0"
-#define HTTP_CONTENT_LENGTH "Content-Length:"
-#define HTTP_TRANSFER_ENCODING "Transfer-Encoding:"
-#define HTTP_BODY_SEPARATOR "\r\n\r\n"
+static bool compression = false;
 
-http_request_t * build_request(const char *host, const char *path);
-void request_free(http_request_t *request);
-void response_cb(void *context, int bytes);
+/* Ask for compressed bodies of whole resources and decode them on the fly.
+ * Ranges would be ranges of compressed data, they are always identity */
+void http_set_compression(bool enabled)
+{
+    compression = enabled;
+}
 
-int http_make_request(connection_t *conn, url_t *url)
+static const char * accept_encoding()
 {
-    if (conn == NULL || url == NULL) {
-        return -1;
-    }
+    return compression ? accept_encoding_header() : NULL;
+}
 
+int execute_request(connection_t *conn, http_request_t *request)
+{
     int error = 0, bytes = 0;
-    http_request_t *request = NULL;
 
     open_connection(conn, &error);
     if (error) {
@@ -31,219 +84,902 @@ int http_make_request(connection_t *conn, url_t *url)
         goto err;
     }
 
-    request = build_request(conn->host, url->path);
-    if (request == NULL) { goto err; }
-    request->url = url;
     request->conn = conn;
 
     /* Initialize context and callback for response processing */
     conn->context = (void*) request;
     conn->process_response = response_cb;
+    conn->process_spliced = spliced_cb;
+    conn->buffer_offset = 0;
 
-    bytes = send_all(conn, request->request_buf, strlen(request->request_buf), 0);
-    if (bytes == 0) { goto err; }
+    bytes = send_all(conn, request->request_iov, request->request_iovcnt, 0);
+    if (bytes < 0) { goto err; }
     LOG_D("Bytes send: %d", bytes);
 
     bytes = recv_all(conn, 0);
     LOG_D("Bytes received %d", bytes);
+    trace_finish(request);
 
     close_connection(conn);
 
-    LOG_I("\nRequest has been completed");
-
-    return 0;
+    return request_status(request);
 
 err:
     LOG_E("Error in make_request");
-    request_free(request);
     close_connection(conn);
 
     return -1;
 }
 
-http_request_t * build_request(const char *host, const char *path)
+int http_make_request(connection_t *conn, url_t *url)
 {
-    char *request_string = NULL;
-    http_request_t *request = NULL;
-    buffer_t *buf = NULL;
+    if (conn == NULL || url == NULL) {
+        return -1;
+    }
+
     int status = 0;
+    http_request_t *request = NULL;
 
-    request = (http_request_t *)calloc(1, sizeof(http_request_t));
-    if (request == NULL) { goto err; }
+    request = build_request(conn, "GET", url->target, accept_encoding(), false);
+    if (request == NULL) { return -1; }
+    request->url = url;
+    request->show_progress = true;
+
+    status = execute_request(conn, request);
+    if (status == 0 && request->decoder)
+        LOG_I("\nDecoded %zu bytes of %s body to %zu", request->decoder->in_bytes,
+              content_coding_name(request->coding), request->decoder->out_bytes);
+    request_free(request);
 
-    buf = buffer_alloc(REQUEST_BUFF_SIZE);
-    if (buf == NULL) { goto err; }
+    if (status == 0)
+        LOG_I("\nRequest has been completed");
 
-    status |= buffer_appendf(buf, "GET %s %s\r\n", path, HTTP_PROTOCOL); /* Use HTTP/1.1 for chunked */
-    status |= buffer_appendf(buf, "Host: %s\r\n", host);
-    status |= buffer_appendf(buf, "Connection: close\r\n\r\n");
-    if (status) {
-        LOG_E("Request is too long");
-        goto err;
+    return status;
+}
+
+/* Download url to file, continuing partial file of previous run if its
+ * journal is found and resource hasn't been changed since then */
+int http_continue_request(connection_t *conn, url_t *url)
+{
+    char headers[JOURNAL_VALIDATOR_SIZE + 64];
+    struct stat st;
+    size_t offset = 0;
+    int status = 0, error = 0;
+    http_request_t *request = NULL;
+    journal_t *journal = NULL;
+
+    if (conn == NULL || url == NULL) {
+        return -1;
     }
 
-    request_string = buffer_to_string(buf);
-    if (request_string == NULL) { goto err; };
+    journal = journal_open(url->file, &error);
+    if (journal == NULL) {
+        print_journal_error(error);
+        return -1;
+    }
+    /* Broken journal is empty, file is downloaded from start */
+    if (error)
+        print_journal_error(error);
+
+    /* File must still have all bytes recorded in journal */
+    offset = journal_completed(journal);
+    if (offset && (stat(url->file, &st) != 0 || (size_t)st.st_size < offset))
+        offset = 0;
+
+    if (offset && offset == journal->length) {
+        LOG_I("File has already been downloaded");
+        journal_remove(journal);
+        journal_free(journal);
+        return 0;
+    }
 
-    request->request_buf = request_string;
+    if (offset) {
+        LOG_I("Continue download from byte %zu", offset);
+        snprintf(headers, sizeof headers, "Range: bytes=%zu-\r\nIf-Range: %s\r\n",
+                 offset, journal->validator);
+    }
 
-    buffer_free(buf);
+    request = build_request(conn, "GET", url->target, offset ? headers : NULL, false);
+    if (request == NULL) {
+        journal_free(journal);
+        return -1;
+    }
+    request->url = url;
+    request->show_progress = true;
+    request->resume_offset = offset;
+    request->journal = journal;
+    request->journal_synced = offset;
 
-    return request;
+    status = execute_request(conn, request);
+
+    if (status == 0)
+        journal_remove(journal);
+    else
+        update_journal(request, true);
 
-err:
     request_free(request);
-    buffer_free(buf);
+    journal_free(journal);
 
-    return NULL;
+    if (status == 0)
+        LOG_I("\nRequest has been completed");
+
+    return status;
 }
 
-void request_free(http_request_t * request)
+/* Start request in event loop, process_done is called once it is over.
+ * Connection is left open if it can be reused for the next request */
+int http_make_request_async(event_loop_t *loop, connection_t *conn, url_t *url,
+                            done_cb process_done, void *context)
 {
-    if (request == NULL)
+    http_request_t *request = NULL;
+
+    if (loop == NULL || conn == NULL || url == NULL) {
+        return -1;
+    }
+
+    request = build_request(conn, "GET", url->target, accept_encoding(), true);
+    if (request == NULL) { return -1; }
+    request->url = url;
+    request->conn = conn;
+    request->loop = loop;
+    request->process_done = process_done;
+    request->done_context = context;
+
+    conn->context = (void*) request;
+    conn->process_response = response_cb;
+    conn->process_spliced = spliced_cb;
+    conn->process_done = request_done_cb;
+    conn->buffer_offset = 0;
+    conn->send_iov = request->request_iov;
+    conn->send_iovcnt = request->request_iovcnt;
+    conn->send_len = request->request_len;
+    conn->send_offset = 0;
+
+    if (event_loop_add(loop, conn) != 0) {
+        request_free(request);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Idle connection might be closed by server just before it was reused.
+ * Send request again over a new connection if nothing has been received */
+bool retry_request(http_request_t *request)
+{
+    connection_t *conn = request->conn;
+
+    if (!conn->reused || request->retried || request->header_parsed || conn->buffer_offset)
+        return false;
+
+    LOG_D("Retry request over new connection");
+
+    close_connection(conn);
+    conn->reused = false;
+    conn->send_offset = 0;
+    request->retried = true;
+    http_parser_init(&request->parser, header_field_cb, request);
+    chunked_init(&request->chunks, chunk_received_cb, request);
+
+    return event_loop_add(request->loop, conn) == 0;
+}
+
+/* Report phases of request. Connection was resolved and opened for it
+ * unless connection has been reused */
+void trace_finish(http_request_t *request)
+{
+    trace_t trace = request->trace;
+    connection_t *conn = request->conn;
+    bool reused = conn && conn->reused;
+
+    if (!trace_enabled || !request->url)
         return;
 
-    if(request->request_buf)
-        free(request->request_buf);
+    trace_mark(&trace, TRACE_DONE);
 
-    if(request->file)
-        fclose(request->file);
+    for (int p = reused ? TRACE_SEND_START : TRACE_DNS_START; conn && p <= TRACE_SENT; ++p)
+        trace.at[p] = conn->trace.at[p];
 
-    free(request);
+    trace_request(&trace, request->url->host, request->url->port, request->url->path,
+                  request->response_code, request->written_bytes, reused);
 }
 
-/* Find value of field and return offset */
-size_t fetch_field_value(const char *buffer, const char *field_name, char **field_value)
+/* Report result to owner and free request */
+void finish_request(http_request_t *request, int status)
 {
-    size_t offset = 0;
-    const char *header_begin = 0, *header_end = 0;
+    done_cb process_done;
+    void *context;
 
-    if ((header_begin = strstr(buffer, field_name)) != NULL) {
-        header_end = strchr(header_begin, '\r');
-        offset = header_end - buffer;
-        size_t field_size = header_end - header_begin - strlen(field_name);
+    if (!HTTP_IS_REQUEUE(status))
+        trace_finish(request);
 
-        *field_value = strndup(header_begin + strlen(field_name), field_size);
+    /* Library user reports its exchanges itself */
+    if (request->fetch) {
+        request->fetch->response_code = request->response_code;
+        request->fetch->written_bytes = request->written_bytes;
     }
+    else if (status == 0 && request->decoder) {
+        LOG_I("Downloaded %s (%zu bytes, %zu of %s)", request->url->file, request->written_bytes,
+              request->decoder->in_bytes, content_coding_name(request->coding));
+    }
+    else if (status == 0) {
+        LOG_I("Downloaded %s (%zu bytes)", request->url->file, request->written_bytes);
+    }
+    else if (HTTP_IS_REQUEUE(status)) {
+        LOG_D("Request %s wasn't answered", request->url->path);
+    }
+    else {
+        LOG_E("Failed to download %s%s", request->conn->host, request->url->path);
+    }
+
+    /* Owner may start the next exchange over connection from callback,
+     * it resets connection arena where request lives */
+    process_done = request->process_done;
+    context = request->done_context;
+    request_free(request);
 
-    return offset;
+    if (process_done)
+        process_done(context, status);
 }
 
-#define HTTP_VERSION    "/1.1 "
-size_t fetch_response_code(const char *buffer, int *response_code)
+void request_done_cb(void *context, int status)
 {
-    char *field_value = 0;
-    size_t offset = fetch_field_value(buffer, "HTTP", &field_value);
+    http_request_t *request = (http_request_t *)context;
 
-    if (field_value) {
-        *response_code = atoi(field_value+strlen(HTTP_VERSION));
+    if (status == 0)
+        status = request_status(request);
 
-        free(field_value);
+    if (status != 0 && retry_request(request))
+        return;
+
+    if (!request->complete || !request->keep_alive)
+        close_connection(request->conn);
+
+    finish_request(request, status);
+}
+
+/* Write requests for all urls back-to-back and receive responses in the
+ * same order. process_done is called for every url once connection is
+ * over, with HTTP_REQUEUE for requests which haven't been answered */
+int http_pipeline_async(event_loop_t *loop, connection_t *conn, url_t *urls[],
+                        void *contexts[], int count, done_cb process_done)
+{
+    http_pipeline_t *pipeline = NULL;
+    http_request_t *request;
+
+    if (loop == NULL || conn == NULL || urls == NULL || count < 1) {
+        return -1;
+    }
+
+    /* Previous exchange over connection is over */
+    arena_reset(&conn->arena);
+
+    pipeline = (http_pipeline_t *)arena_calloc(&conn->arena, sizeof(http_pipeline_t));
+    if (pipeline == NULL) { goto err; }
+
+    pipeline->requests = (http_request_t **)arena_calloc(&conn->arena, count * sizeof(http_request_t *));
+    if (pipeline->requests == NULL) { goto err; }
+    pipeline->conn = conn;
+
+    /* Pieces of all requests go out in one gathered write */
+    pipeline->send_iov = (struct iovec *)arena_alloc(&conn->arena,
+                                                     count * REQUEST_IOV_MAX * sizeof(struct iovec));
+    if (pipeline->send_iov == NULL) { goto err; }
+
+    for (int i = 0; i < count; ++i) {
+        request = new_request(conn);
+        if (request == NULL) { goto err; }
+
+        request->url = urls[i];
+        request->loop = loop;
+        request->process_done = process_done;
+        request->done_context = contexts[i];
+
+        pipeline->requests[pipeline->count++] = request;
+        if (request_pieces(request, "GET", urls[i]->target, accept_encoding(), true) != 0) { goto err; }
+
+        memcpy(pipeline->send_iov + pipeline->send_iovcnt, request->request_iov,
+               request->request_iovcnt * sizeof(struct iovec));
+        pipeline->send_iovcnt += request->request_iovcnt;
+        pipeline->send_len += request->request_len;
     }
 
-    return offset;
+    conn->context = (void*) pipeline;
+    conn->process_response = pipeline_response_cb;
+    conn->process_spliced = pipeline_spliced_cb;
+    conn->process_done = pipeline_done_cb;
+    conn->buffer_offset = 0;
+    conn->send_iov = pipeline->send_iov;
+    conn->send_iovcnt = pipeline->send_iovcnt;
+    conn->send_len = pipeline->send_len;
+    conn->send_offset = 0;
+
+    if (event_loop_add(loop, conn) != 0) { goto err; }
+
+    return 0;
+
+err:
+    LOG_E("Failed to start pipeline");
+    http_pipeline_free(pipeline);
+
+    return -1;
 }
 
+/* Pipeline lives in connection arena, only requests hold resources */
+void http_pipeline_free(http_pipeline_t *pipeline)
+{
+    if (pipeline == NULL)
+        return;
 
+    for (int i = 0; pipeline->requests && i < pipeline->count; ++i)
+        request_free(pipeline->requests[i]);
+}
 
-size_t fetch_content_length(const char *buffer, int *content_length)
+/* Data after the end of one response is the beginning of the next one */
+int pipeline_response_cb(void *context, int bytes)
 {
-    char *field_value = 0;
-    size_t offset = fetch_field_value(buffer, HTTP_CONTENT_LENGTH, &field_value);
+    http_pipeline_t *pipeline = (http_pipeline_t *)context;
+    connection_t *conn = pipeline->conn;
+    http_request_t *request;
+
+    while (pipeline->answered < pipeline->count) {
+        request = pipeline->requests[pipeline->answered];
 
-    if(field_value) {
-        *content_length = atoi(field_value);
-        free(field_value);
+        if (response_cb(request, bytes) == 0)
+            return 0;
+
+        /* Failed or stopped, the rest can't be told apart */
+        if (!request->complete)
+            return 1;
+
+        pipeline->answered++;
+
+        if (!request->keep_alive)
+            return 1;
+
+        if (request->surplus_size == 0)
+            return pipeline->answered == pipeline->count;
+
+        /* Body of answered response may still wait in buffer to be written */
+        if (flush_file_writes(conn) != 0) {
+            request->failed = true;
+            return 1;
+        }
+
+        memmove(conn->buffer, request->surplus, request->surplus_size);
+        conn->buffer[request->surplus_size] = '\0';
+        conn->buffer_offset = 0;
+        bytes = request->surplus_size;
     }
 
-    return offset;
+    LOG_E("Data after the last response in pipeline");
+
+    return 1;
 }
 
-size_t fetch_transfer_encoding(const char *buffer, bool *chunked_encoding)
+/* Splice stops exactly at the end of body, there is no data of next response */
+int pipeline_spliced_cb(void *context, int bytes)
 {
-    char *field_value = 0;
-    size_t offset = fetch_field_value(buffer, HTTP_TRANSFER_ENCODING, &field_value);
+    http_pipeline_t *pipeline = (http_pipeline_t *)context;
+    http_request_t *request = pipeline->requests[pipeline->answered];
 
-    if(field_value) {
-        if (strcmp(field_value, "chunked") == 0)
-            *chunked_encoding = true;
-        free(field_value);
+    if (spliced_cb(request, bytes) == 0)
+        return 0;
+
+    pipeline->answered++;
+
+    return !request->keep_alive || pipeline->answered == pipeline->count;
+}
+
+void pipeline_done_cb(void *context, int status)
+{
+    http_pipeline_t *pipeline = (http_pipeline_t *)context;
+    http_request_t *last = NULL, *request;
+    bool announced_close;
+    int count = pipeline->count, result;
+
+    if (pipeline->answered > 0)
+        last = pipeline->requests[pipeline->answered - 1];
+    announced_close = status == 0 && last && !last->keep_alive;
+
+    if (status != 0 || pipeline->answered < pipeline->count || !last->keep_alive)
+        close_connection(pipeline->conn);
+
+    /* Connection is given back with the last request, which may reset its
+     * arena, so pipeline isn't touched after that */
+    for (int i = 0; i < count; ++i) {
+        request = pipeline->requests[i];
+        if (i < pipeline->answered || request->failed)
+            result = request_status(request);
+        else if (announced_close)
+            result = HTTP_REQUEUE_CLOSED;
+        else
+            result = HTTP_REQUEUE;
+        pipeline->requests[i] = NULL;
+        finish_request(request, result);
     }
+}
 
-    return offset;
+/* Check that whole response has been received */
+int request_status(http_request_t *request)
+{
+    digest_value_t announced;
+    int status = 0;
+
+    if (!request->header_parsed || request->failed)
+        return -1;
+
+    if (request->response_code != HTTP_OK && request->response_code != HTTP_PARTIAL &&
+        !request->any_status)
+        return -1;
+
+    /* Body is framed by length or chunks but connection has been closed earlier */
+    if ((request->chunked || request->has_content_length) && !request->complete)
+        return -1;
+
+    /* Compressed stream must be over, otherwise body is truncated */
+    if (request->decoder && !request->decoder->finished) {
+        LOG_E("Compressed body is incomplete");
+        return -1;
+    }
+
+    /* Body is reported as downloaded once it's in file, synced by policy */
+    if (request->sink) {
+        status = sink_close(request->sink);
+        request->sink = NULL;
+    }
+
+    if (status == 0 && request->digest) {
+        /* Progress line is still open */
+        if (request->show_progress)
+            fputc('\n', stdout);
+        announced_digest(request, &announced);
+        status = digest_verify(request->digest, request->url->file, &announced);
+        request->digest = NULL;
+    }
+
+    return status;
 }
 
-bool find_body(http_request_t * request, const char *buffer_begin, int bytes)
+int http_probe(connection_t *conn, url_t *url, size_t *content_length, bool *accept_ranges,
+               digest_value_t *announced)
 {
-    size_t header_size = request->header_size;
+    int status = 0;
+    http_request_t *request = NULL;
 
-    const char *body = strstr(buffer_begin + header_size, HTTP_BODY_SEPARATOR);
-    if(body) {
-        request->header_size = body - buffer_begin;
-        request->header_parsed = true;
+    if (conn == NULL || url == NULL) {
+        return -1;
+    }
 
-        return true;
+    request = build_request(conn, "HEAD", url->target, NULL, false);
+    if (request == NULL) { return -1; }
+    request->url = url;
+    request->head = true;
+
+    status = execute_request(conn, request);
+    if (status == 0 && request->response_code != HTTP_OK)
+        status = -1;
+
+    *content_length = request->content_length;
+    *accept_ranges = request->accept_ranges;
+    if (announced)
+        announced_digest(request, announced);
+
+    request_free(request);
+
+    return status;
+}
+
+/* Fetch bytes [first, last] of resource, body is passed to process_body */
+int http_get_range(connection_t *conn, url_t *url, size_t first, size_t last,
+                   body_cb process_body, void *context)
+{
+    char range[64];
+    int status = 0;
+    http_request_t *request = NULL;
+
+    if (conn == NULL || url == NULL || process_body == NULL) {
+        return -1;
+    }
+
+    snprintf(range, sizeof range, "Range: bytes=%zu-%zu\r\n", first, last);
+
+    request = build_request(conn, "GET", url->target, range, false);
+    if (request == NULL) { return -1; }
+    request->url = url;
+    request->range = true;
+    request->process_body = process_body;
+    request->body_context = context;
+
+    status = execute_request(conn, request);
+    request_free(request);
+
+    return status;
+}
+
+/* Request of library user, response of any status is passed on */
+static http_request_t * build_fetch(connection_t *conn, url_t *url, http_fetch_t *fetch,
+                                    bool keep_alive)
+{
+    const char *method = fetch->method ? fetch->method : "GET";
+    http_request_t *request;
+
+    request = build_request(conn, method, url->target, fetch->headers, keep_alive);
+    if (request == NULL)
+        return NULL;
+
+    request->url = url;
+    request->head = strcmp(method, "HEAD") == 0;
+    request->any_status = true;
+    request->compressed = fetch->compressed;
+    request->process_body = fetch->process_body;
+    request->body_context = fetch->body_context;
+    request->process_header = fetch->process_header;
+    request->header_done = fetch->header_done;
+    request->header_context = fetch->header_context;
+
+    return request;
+}
+
+/* Exchange for library user, the same as single download but response of
+ * any status is passed on. Returns -1 if it hasn't been received whole */
+int http_fetch(connection_t *conn, url_t *url, http_fetch_t *fetch)
+{
+    int status = 0;
+    http_request_t *request = NULL;
+
+    if (conn == NULL || url == NULL || fetch == NULL) {
+        return -1;
     }
 
-    /* Move header offset in buffer. One part of body separator might be in one chunk
-     * "... \r\n\r" and other part in next chunk "\n". To avoid that add to offset -3 */
-    request->header_size += bytes - 3;
+    request = build_fetch(conn, url, fetch, false);
+    if (request == NULL) { return -1; }
+
+    status = execute_request(conn, request);
+    fetch->response_code = request->response_code;
+    fetch->written_bytes = request->written_bytes;
+    request_free(request);
 
-    return false;
+    return status;
 }
 
-size_t parse_header(http_request_t * request, const char *buffer_begin)
+/* Non-blocking exchange of library user over persistent connection. Results
+ * are in fetch when process_done is called, connection is closed by then
+ * unless it can be reused */
+int http_fetch_async(event_loop_t *loop, connection_t *conn, url_t *url, http_fetch_t *fetch,
+                     done_cb process_done, void *context)
 {
-    size_t offset = 0, body_offset = 0;
+    http_request_t *request = NULL;
+
+    if (loop == NULL || conn == NULL || url == NULL || fetch == NULL) {
+        return -1;
+    }
 
-    offset += fetch_response_code(buffer_begin+offset, &request->response_code);
-    offset += fetch_content_length(buffer_begin+offset, &request->content_length);
-    offset += fetch_transfer_encoding(buffer_begin+offset, &request->chunked);
+    request = build_fetch(conn, url, fetch, true);
+    if (request == NULL) { return -1; }
+    request->conn = conn;
+    request->loop = loop;
+    request->fetch = fetch;
+    request->process_done = process_done;
+    request->done_context = context;
 
-    body_offset = request->header_size + strlen(HTTP_BODY_SEPARATOR);
+    conn->context = (void*) request;
+    conn->process_response = response_cb;
+    conn->process_spliced = spliced_cb;
+    conn->process_done = request_done_cb;
+    conn->buffer_offset = 0;
+    conn->send_iov = request->request_iov;
+    conn->send_iovcnt = request->request_iovcnt;
+    conn->send_len = request->request_len;
+    conn->send_offset = 0;
+
+    if (event_loop_add(loop, conn) != 0) {
+        request_free(request);
+        return -1;
+    }
 
-    return body_offset;
+    return 0;
 }
 
-int save_body_to_file(http_request_t * request, const char *buffer, int bytes)
+/* Extra header lines of fetch, followed by Accept-Encoding if it's asked for */
+int http_fetch_headers(buffer_t *headers, const char *extra, bool compressed)
 {
-    size_t bytes_written = 0;
+    if (extra && buffer_append(headers, extra, strlen(extra)) != 0)
+        return -1;
+
+    if (compressed &&
+        buffer_append(headers, accept_encoding_header(), strlen(accept_encoding_header())) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Fields of fetch response are kept as name and value, each terminated */
+int http_field_append(buffer_t *fields, const char *name, size_t name_len,
+                      const char *value, size_t value_len)
+{
+    if (buffer_append(fields, name, name_len) != 0 ||
+        buffer_append(fields, "", 1) != 0 ||
+        buffer_append(fields, value, value_len) != 0 ||
+        buffer_append(fields, "", 1) != 0)
+        return -1;
 
-    /* Need to create file */
-    if (request->file == NULL) {
+    return 0;
+}
 
-        if(request->url && request->url)
-            request->file = fopen(request->url->file, "wb");
+/* Value of the first of count fields with name, names are case insensitive */
+const char * http_field_find(const char *fields, size_t count, const char *name)
+{
+    const char *p = fields;
 
-        if (request->file == NULL)
-            perror("Failed to open file");
+    for (size_t i = 0; i < count; ++i) {
+        const char *value = p + strlen(p) + 1;
+        if (strcasecmp(p, name) == 0)
+            return value;
+        p = value + strlen(value) + 1;
     }
 
-    if (request->file)
-        bytes_written = fwrite(buffer , sizeof(char), bytes, request->file);
+    return NULL;
+}
+
+/* Request and its data are allocated from connection arena */
+http_request_t * new_request(connection_t *conn)
+{
+    http_request_t *request;
+
+    request = (http_request_t *)arena_calloc(&conn->arena, sizeof(http_request_t));
+    if (request == NULL)
+        return NULL;
 
-    return bytes_written;
+    request->conn = conn;
+    http_parser_init(&request->parser, header_field_cb, request);
+    chunked_init(&request->chunks, chunk_received_cb, request);
+
+    return request;
 }
 
-size_t parse_chunk_size(http_request_t * request, const char *begin_chunk)
+/* Host and Connection headers are the same for every request to origin,
+ * they are rendered once and kept by connection */
+const char * header_template(connection_t *conn, bool keep_alive, size_t *len)
 {
-    const char *size_end = strchr(begin_chunk, '\n');
+    buffer_t buf;
+    int status = 0;
+
+    if (conn->header_template[keep_alive] == NULL) {
+        if (buffer_init(&buf, TEMPLATE_BUFF_SIZE, NULL) != 0)
+            return NULL;
+
+        /* IPv6 literal is bracketed like in url */
+        status |= buffer_appendf(&buf, strchr(conn->host, ':') ? "Host: [%s]\r\n" : "Host: %s\r\n",
+                                 conn->host);
+        status |= buffer_appendf(&buf, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+        if (status) {
+            buffer_release(&buf);
+            return NULL;
+        }
 
-    char *size_hex = strndup(begin_chunk, size_end-begin_chunk-1);
-    if(size_hex) {
-        request->chunk_size = (size_t)strtol(size_hex, NULL, 16);
-        free(size_hex);
+        conn->header_template[keep_alive] = buf.content;
+        conn->header_template_len[keep_alive] = buf.actual_size;
     }
 
-    return size_end-begin_chunk+1;
+    *len = conn->header_template_len[keep_alive];
+
+    return conn->header_template[keep_alive];
+}
+
+static void add_piece(http_request_t *request, const char *data, size_t len)
+{
+    struct iovec *iov = &request->request_iov[request->request_iovcnt++];
+
+    iov->iov_base = (void *)data;
+    iov->iov_len = len;
+    request->request_len += len;
 }
 
-int save_body_to_file_by_chunks(http_request_t * , const char *, int )
+/* Request is sent from pieces in place: request line parts, per request
+ * headers and header template of origin. Path and headers must stay
+ * valid until request has been sent */
+int request_pieces(http_request_t *request, const char *method, const char *path,
+                   const char *headers, bool keep_alive)
 {
-    /* Not implemented */
+    const char *tail;
+    size_t tail_len;
+
+    tail = header_template(request->conn, keep_alive, &tail_len);
+    if (tail == NULL)
+        return -1;
+
+    request->request_iovcnt = 0;
+    request->request_len = 0;
+    add_piece(request, method, strlen(method));
+    add_piece(request, " ", 1);
+    add_piece(request, path, strlen(path));
+    add_piece(request, " " HTTP_PROTOCOL "\r\n", sizeof(" " HTTP_PROTOCOL "\r\n") - 1);
+    if (headers)
+        add_piece(request, headers, strlen(headers));
+    add_piece(request, tail, tail_len);
+
     return 0;
 }
 
+/* Start of a new exchange over connection, data of the previous one in
+ * connection arena is dropped */
+http_request_t * build_request(connection_t *conn, const char *method, const char *path,
+                               const char *headers, bool keep_alive)
+{
+    http_request_t *request = NULL;
+
+    arena_reset(&conn->arena);
+
+    request = new_request(conn);
+    if (request == NULL) { goto err; }
+
+    if (request_pieces(request, method, path, headers, keep_alive) != 0) {
+        LOG_E("Failed to build request");
+        goto err;
+    }
+
+    return request;
+
+err:
+    request_free(request);
+
+    return NULL;
+}
+
+/* Close what request holds, its memory belongs to connection arena */
+void request_free(http_request_t * request)
+{
+    if (request == NULL)
+        return;
+
+    sink_close(request->sink);
+    request->sink = NULL;
+
+    if (request->decoder)
+        content_decoder_free(request->decoder);
+    request->decoder = NULL;
+}
+
+/* Content-Length value which isn't NULL terminated */
+bool parse_content_length(const char *value, size_t len, size_t *content_length)
+{
+    size_t result = 0;
+
+    if (len == 0)
+        return false;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (value[i] < '0' || value[i] > '9' || result > (SIZE_MAX - 9) / 10)
+            return false;
+        result = result * 10 + (value[i] - '0');
+    }
+
+    *content_length = result;
+
+    return true;
+}
+
+/* Content-Range of partial response: bytes first-last/total */
+bool parse_content_range(const char *value, size_t len, size_t *first, size_t *total)
+{
+    const char *end = value + len, *dash, *slash;
+    size_t last;
+
+    if (len < 6 || strncasecmp(value, "bytes ", 6) != 0)
+        return false;
+    value += 6;
+
+    dash = scan_char(value, end, '-');
+    slash = scan_char(dash, end, '/');
+    if (slash == end)
+        return false;
+
+    if (!parse_content_length(value, dash - value, first) ||
+        !parse_content_length(dash + 1, slash - dash - 1, &last) || last < *first)
+        return false;
+
+    *total = 0;
+    if (end - slash == 2 && slash[1] == '*')
+        return true;
+
+    return parse_content_length(slash + 1, end - slash - 1, total);
+}
+
+/* Validator which doesn't fit is useless, it's left empty */
+void copy_validator(char *validator, const char *value, size_t len)
+{
+    if (len >= JOURNAL_VALIDATOR_SIZE)
+        len = 0;
+
+    memcpy(validator, value, len);
+    validator[len] = '\0';
+}
+
+void header_field_cb(void *context, const char *name, size_t name_len,
+                     const char *value, size_t value_len)
+{
+    http_request_t *request = (http_request_t *)context;
+
+    if (request->process_header)
+        request->process_header(request->header_context, name, name_len, value, value_len);
+
+    if (http_name_equals(name, name_len, HTTP_CONTENT_LENGTH)) {
+        request->has_content_length =
+            parse_content_length(value, value_len, &request->content_length);
+    }
+    else if (http_name_equals(name, name_len, HTTP_TRANSFER_ENCODING)) {
+        if (http_value_contains(value, value_len, "chunked"))
+            request->chunked = true;
+    }
+    else if (http_name_equals(name, name_len, HTTP_CONNECTION)) {
+        if (http_value_contains(value, value_len, "close"))
+            request->connection_close = true;
+    }
+    else if (http_name_equals(name, name_len, HTTP_ACCEPT_RANGES)) {
+        if (http_value_contains(value, value_len, "bytes"))
+            request->accept_ranges = true;
+    }
+    else if (http_name_equals(name, name_len, HTTP_CONTENT_RANGE)) {
+        request->has_content_range = parse_content_range(value, value_len,
+            &request->range_first, &request->range_total);
+    }
+    else if (http_name_equals(name, name_len, HTTP_ETAG)) {
+        copy_validator(request->etag, value, value_len);
+    }
+    else if (http_name_equals(name, name_len, HTTP_LAST_MODIFIED)) {
+        copy_validator(request->last_modified, value, value_len);
+    }
+    else if (http_name_equals(name, name_len, HTTP_CONTENT_ENCODING)) {
+        request->coding = content_coding_parse(value, value_len);
+    }
+    else if (http_name_equals(name, name_len, HTTP_DIGEST) ||
+             http_name_equals(name, name_len, HTTP_REPR_DIGEST)) {
+        if (digest_check()->algorithm && request->announced.size == 0)
+            digest_parse_field(digest_check()->algorithm, value, value_len, &request->announced);
+    }
+    else if (http_name_equals(name, name_len, HTTP_CONTENT_MD5)) {
+        /* It's of partial body in 206 response */
+        if (digest_check()->algorithm == DIGEST_MD5 && request->announced.size == 0 &&
+            request->parser.status_code == HTTP_OK)
+            digest_parse_value(DIGEST_MD5, value, value_len, &request->announced);
+    }
+}
+
+file_sink_t * open_body_file(http_request_t * request)
+{
+    size_t expected = request->has_content_length ? request->content_length : 0;
+    int error = 0;
+
+    /* Partial response continues existing file */
+    if (request->sink == NULL && request->url) {
+        request->sink = sink_open(request->url->file, request->resume_offset, expected, &error);
+        if (request->sink == NULL)
+            print_sink_error(error);
+    }
+
+    return request->sink;
+}
+
+int save_body_to_file(http_request_t * request, const char *buffer, int bytes)
+{
+    connection_t *conn = request->conn;
+    file_sink_t *sink = open_body_file(request);
+
+    if (sink == NULL)
+        return -1;
+
+    /* Journal records only bytes which reached file, they are written synchronously */
+    /* Decoded data lives in decoder window until the next piece */
+    if (conn && conn->ring && !request->journal && !sink->direct && !request->decoder) {
+        if (queue_file_write(conn, sink->fd, buffer, bytes, sink_position(sink)) != 0)
+            return -1;
+        return sink_skip(sink, bytes);
+    }
+
+    return sink_write(sink, buffer, bytes);
+}
+
 void print_buffer(const char *buffer, int bytes)
 {
     for(int i = 0; i < bytes; ++i) {
@@ -254,22 +990,344 @@ void print_buffer(const char *buffer, int bytes)
 void print_progress(http_request_t *request)
 {
     if (request->content_length) {
-        int progress = (float)request->written_bytes/request->content_length * 100;
+        size_t total = request->resume_offset + request->content_length;
+        size_t done = request->decoder ? request->body_received : request->written_bytes;
+        int progress = (float)(request->resume_offset + done)/total * 100;
         fprintf(stdout, "\rProgress: %d %%", progress);
         fflush(stdout);
     }
 }
 
-void response_cb(void *context, int bytes)
+/* Record bytes which reached file, so download can be continued after failure */
+void update_journal(http_request_t *request, bool force)
+{
+    size_t done = request->resume_offset + request->written_bytes;
+
+    if (request->journal == NULL || request->journal->validator[0] == '\0')
+        return;
+
+    if (!force && done - request->journal_synced < JOURNAL_SYNC_SIZE)
+        return;
+
+    if (request->sink && sink_flush(request->sink) != 0)
+        return;
+
+    if (journal_add(request->journal, 0, done) == 0 && journal_save(request->journal) == 0)
+        request->journal_synced = done;
+}
+
+/* Strong ETag is preferred, weak one never matches in If-Range */
+const char * resource_validator(http_request_t *request)
+{
+    if (request->etag[0] && strncmp(request->etag, "W/", 2) != 0)
+        return request->etag;
+
+    return request->last_modified;
+}
+
+/* Check that partial response continues file, whole resource is written
+ * from start. Returns false if response can't be used */
+bool resume_response(http_request_t *request)
+{
+    const char *validator = resource_validator(request);
+
+    if (request->response_code == HTTP_PARTIAL && request->resume_offset) {
+        if (!request->has_content_range || request->range_first != request->resume_offset) {
+            LOG_E("Partial response doesn't continue file");
+            return false;
+        }
+        return true;
+    }
+
+    if (request->response_code != HTTP_OK)
+        return true;
+
+    if (request->resume_offset)
+        LOG_I("Resource has been changed, download it from start");
+
+    request->resume_offset = 0;
+    request->journal_synced = 0;
+    journal_reset(request->journal, validator,
+                  request->has_content_length ? request->content_length : 0);
+
+    if (validator[0] == '\0') {
+        LOG_I("Server sent no ETag or Last-Modified, download can't be continued later");
+        journal_remove(request->journal);
+    }
+
+    return true;
+}
+
+/* Let kernel move left bytes of body from socket to file. Data which is
+ * already in user space is buffered by sink, flush it first. Spliced data
+ * can't be decoded or hashed */
+void start_splice(http_request_t *request, size_t left)
+{
+    if (left < SPLICE_MIN_SIZE || request->process_body || request->decoder || request->digest ||
+        !request->conn->process_spliced)
+        return;
+
+    if (request->response_code != HTTP_OK && request->response_code != HTTP_PARTIAL)
+        return;
+
+    /* Direct writes must be aligned, splice can't do that */
+    if (!open_body_file(request) || request->sink->direct || sink_flush(request->sink) != 0)
+        return;
+
+    if (splice_to_file(request->conn, request->sink->fd, sink_position(request->sink), left) == 0)
+        LOG_D("Splice %zu bytes to file", left);
+}
+
+int spliced_cb(void *context, int bytes)
+{
+    http_request_t *request = (http_request_t *)context;
+
+    request->body_received += bytes;
+    request->written_bytes += bytes;
+    sink_skip(request->sink, bytes);
+    update_journal(request, false);
+    if (request->show_progress)
+        print_progress(request);
+
+    /* Rest of chunk has been moved, continue with delimiter and next size */
+    if (request->chunked) {
+        chunked_skip(&request->chunks, bytes);
+        return 0;
+    }
+
+    if (request->body_received == request->content_length) {
+        request->complete = true;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Pass span of decoded body to consumer. Returns non-zero to stop receiving */
+int consume_body(http_request_t *request, const char *buffer, size_t bytes)
+{
+    if (request->digest)
+        digest_update(request->digest, buffer, bytes);
+
+    if (request->process_body) {
+        request->written_bytes += bytes;
+        return request->process_body(request->body_context, buffer, bytes);
+    }
+
+    if (save_body_to_file(request, buffer, bytes) != 0) {
+        request->failed = true;
+        return 1;
+    }
+    request->written_bytes += bytes;
+    update_journal(request, false);
+    if (request->show_progress)
+        print_progress(request);
+
+    return 0;
+}
+
+int decoded_body_cb(void *context, const char *data, size_t bytes)
+{
+    return consume_body((http_request_t *)context, data, bytes);
+}
+
+/* Decoder of compressed body is set up once header is known */
+bool start_decoding(http_request_t *request)
+{
+    connection_t *conn = request->conn;
+
+    if (!(compression || request->compressed) || request->coding == CODING_IDENTITY ||
+        request->range || request->resume_offset)
+        return true;
+
+    if (request->coding == CODING_UNKNOWN) {
+        LOG_I("Body has unsupported Content-Encoding, it's saved as is");
+        return true;
+    }
+
+    request->decoder = (content_decoder_t *)arena_calloc(&conn->arena, sizeof(content_decoder_t));
+    if (request->decoder == NULL)
+        return false;
+
+    if (content_decoder_init(request->decoder, request->coding, decoded_body_cb, request) != 0) {
+        LOG_E("Failed to decode %s body", content_coding_name(request->coding));
+        content_decoder_free(request->decoder);
+        request->decoder = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* Value announced by server for algorithm being checked. S3 and some other
+ * servers use hex MD5 or SHA-256 of body as strong ETag, it's only a guess */
+void announced_digest(http_request_t *request, digest_value_t *value)
+{
+    enum digest_algorithm algorithm = digest_check()->algorithm;
+    size_t len = strlen(request->etag);
+
+    /* Server hashed encoded body, file has decoded one */
+    memset(value, 0, sizeof *value);
+    if (request->decoder)
+        return;
+
+    *value = request->announced;
+    if (value->size || (algorithm != DIGEST_MD5 && algorithm != DIGEST_SHA256))
+        return;
+
+    if (len == 2 * digest_size(algorithm) + 2 && request->etag[0] == '"' && request->etag[len - 1] == '"' &&
+        digest_parse_value(algorithm, request->etag + 1, len - 2, value))
+        value->weak = true;
+}
+
+/* Body is hashed while it's saved, continued download hashes the part
+ * written before first */
+bool start_digest(http_request_t *request)
+{
+    enum digest_algorithm algorithm = digest_check()->algorithm;
+    bool ok;
+    int fd;
+
+    if (algorithm == DIGEST_NONE || request->range || request->url == NULL)
+        return true;
+
+    request->digest = (digest_t *)arena_alloc(&request->conn->arena, sizeof(digest_t));
+    if (request->digest == NULL)
+        return false;
+    digest_init(request->digest, algorithm);
+
+    if (request->resume_offset == 0)
+        return true;
+
+    fd = open(request->url->file, O_RDONLY | O_CLOEXEC);
+    ok = fd >= 0 && digest_read(request->digest, fd, 0, request->resume_offset) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!ok)
+        LOG_E("Failed to hash beginning of %s", request->url->file);
+
+    return ok;
+}
+
+/* Pass span of body to consumer. Returns non-zero to stop receiving */
+int deliver_body(http_request_t *request, const char *buffer, size_t bytes)
+{
+    int status;
+
+    if (request->response_code != HTTP_OK && request->response_code != HTTP_PARTIAL &&
+        !request->any_status) {
+        print_buffer(buffer, bytes);
+        return 0;
+    }
+
+    if (request->decoder == NULL)
+        return consume_body(request, buffer, bytes);
+
+    status = content_decode(request->decoder, buffer, bytes);
+    if (status == ENCODING_ERROR) {
+        LOG_E("Broken %s encoding", content_coding_name(request->coding));
+        request->failed = true;
+    }
+
+    return status == ENCODING_ERROR || status == ENCODING_STOPPED;
+}
+
+int chunk_received_cb(void *context, const char *data, size_t bytes)
+{
+    http_request_t *request = (http_request_t *)context;
+
+    request->body_received += bytes;
+
+    return deliver_body(request, data, bytes);
+}
+
+/* Decode chunked body. Returns non-zero when last chunk has been received,
+ * consumer stopped or encoding is broken */
+int decode_chunks(http_request_t *request, const char *buffer, size_t bytes)
+{
+    size_t consumed = 0;
+    int status;
+
+    status = chunked_decode(&request->chunks, buffer, bytes, &consumed);
+
+    switch (status) {
+    case CHUNKED_ERROR:
+        LOG_E("Broken chunked encoding");
+        request->failed = true;
+        return 1;
+
+    case CHUNKED_DONE:
+        request->complete = true;
+        request->surplus = buffer + consumed;
+        request->surplus_size = bytes - consumed;
+        return 1;
+
+    case CHUNKED_STOPPED:
+        return 1;
+    }
+
+    /* Large chunk, its data doesn't need to pass through user space */
+    if (request->chunks.state == CHUNK_STATE_DATA)
+        start_splice(request, request->chunks.chunk_left);
+
+    return 0;
+}
+
+/* Responses which never have a body regardless of header fields */
+bool body_expected(http_request_t *request)
+{
+    int code = request->response_code;
+
+    return !request->head && code != HTTP_NOCONTENT && code != HTTP_NOTMODIFIED &&
+        (code < 100 || code >= 200);
+}
+
+/* Split received data by body framing. Returns non-zero when response is over */
+int frame_body(http_request_t *request, const char *buffer, size_t bytes)
+{
+    int status;
+
+    if (request->chunked)
+        return decode_chunks(request, buffer, bytes);
+
+    if (request->has_content_length) {
+        if (bytes > request->content_length - request->body_received) {
+            request->surplus_size = bytes - (request->content_length - request->body_received);
+            bytes -= request->surplus_size;
+            request->surplus = buffer + bytes;
+        }
+
+        request->body_received += bytes;
+        if (request->body_received == request->content_length)
+            request->complete = true;
+
+        status = bytes ? deliver_body(request, buffer, bytes) : 0;
+
+        if (!request->complete && !status)
+            start_splice(request, request->content_length - request->body_received);
+
+        return request->complete || status;
+    }
+
+    /* Body lasts until connection is closed */
+    request->keep_alive = false;
+
+    return deliver_body(request, buffer, bytes);
+}
+
+int response_cb(void *context, int bytes)
 {
     http_request_t *request = 0;
     size_t body_offset = 0;
     char *buffer = 0;
+    int expected_code = HTTP_OK;
+    enum parser_state state;
 
-    if(!context) { return; }
+    if(!context) { return 1; }
 
     request = (http_request_t *)context;
-    buffer = request->conn->buffer;
+    buffer = request->conn->buffer + request->conn->buffer_offset;
+    TRACE_MARK_ONCE(&request->trace, TRACE_FIRST_BYTE);
 
 #ifdef DEBUG
     for(int i = 0; i < bytes; ++i) {
@@ -278,36 +1336,79 @@ void response_cb(void *context, int bytes)
 #endif
     /* Wait until all header has been received */
     if(!request->header_parsed) {
-        bool body_presented = find_body(request, buffer, bytes);
+        buffer = request->conn->buffer;
+        state = http_parser_execute(&request->parser, buffer, request->conn->buffer_offset + bytes);
 
-        if (body_presented) {
-            body_offset = parse_header(request, buffer);
-
-            if (request->response_code != HTTP_OK) {
-                LOG_E("Bad response code: %d", request->response_code);
-                LOG_E("\nContent: ");
-            }
+        if (state == PARSER_ERROR) {
+            LOG_E("Malformed response header");
+            request->failed = true;
+            return 1;
+        }
 
-            buffer += body_offset;
-            bytes -= body_offset;
-            request->conn->buffer_offset = 0;
+        /* Header stays in buffer until it's complete, limit its memory */
+        if (state == PARSER_DONE ? request->parser.header_size > header_limit
+                                 : request->conn->buffer_offset + bytes >= header_limit) {
+            LOG_E("HTTP header is larger than %zu bytes", header_limit);
+            request->failed = true;
+            return 1;
         }
-        else {
+
+        if (state != PARSER_DONE) {
             request->conn->buffer_offset += bytes;
+            return 0;
         }
-    }
 
-    if (request->response_code == HTTP_OK) {
-        if (request->chunked) {
-            /* Not implemented */
-            save_body_to_file_by_chunks(request, buffer, bytes);
+        request->header_parsed = true;
+        request->response_code = request->parser.status_code;
+        request->keep_alive = !request->connection_close &&
+            request->parser.version_major == 1 && request->parser.version_minor >= 1;
+
+        body_offset = request->parser.header_size;
+        bytes = request->conn->buffer_offset + bytes - body_offset;
+        buffer += body_offset;
+        request->conn->buffer_offset = 0;
+
+        if (request->journal && !resume_response(request)) {
+            request->failed = true;
+            return 1;
         }
-        else {
-            request->written_bytes += save_body_to_file(request, buffer, bytes);
-            print_progress(request);
+
+        /* Server ignored Range header, body doesn't match requested bytes */
+        if (request->range || request->resume_offset)
+            expected_code = HTTP_PARTIAL;
+
+        if (request->response_code != expected_code && !request->any_status) {
+            LOG_E("Bad response code: %d", request->response_code);
+            if (request->range || request->head) {
+                request->failed = true;
+                return 1;
+            }
+            LOG_E("\nContent: ");
+        }
+
+        if (request->header_done)
+            request->header_done(request->header_context, request->response_code);
+
+        /* Error page of library user is decoded too, but it isn't hashed */
+        if (body_expected(request) &&
+            (request->response_code == expected_code || request->any_status) &&
+            !start_decoding(request)) {
+            request->failed = true;
+            return 1;
+        }
+        if (request->response_code == expected_code && body_expected(request) &&
+            !start_digest(request)) {
+            request->failed = true;
+            return 1;
+        }
+
+        if (!body_expected(request)) {
+            request->complete = true;
+            request->surplus = buffer;
+            request->surplus_size = bytes;
+            return 1;
         }
     }
-    else {
-        print_buffer(buffer, bytes);
-    }
+
+    return frame_body(request, buffer, bytes);
 }
@@ -3,11 +3,22 @@
 
 #include "url.h"
 #include "connect.h"
+#include "event_loop.h"
+#include "parser.h"
+#include "chunked.h"
+#include "journal.h"
+#include "sink.h"
+#include "encoding.h"
+#include "digest.h"
+#include "buffer.h"
 
 #include <cstdio>
 
+#include <sys/uio.h>
+
 #define HTTP_OK             200     /**< request completed ok */
 #define HTTP_NOCONTENT		204     /**< request does not have content */
+#define HTTP_PARTIAL		206     /**< partial content for range request */
 #define HTTP_MOVEPERM		301     /**< the uri moved permanently */
 #define HTTP_MOVETEMP		302     /**< the uri moved temporarily */
 #define HTTP_NOTMODIFIED	304     /**< page was not modified from last */
@@ -19,27 +30,151 @@
 #define HTTP_NOTIMPLEMENTED     501 /**< not implemented */
 #define HTTP_SERVUNAVAIL        503 /**< the server is not available */
 
+/* Status passed to done callback of request which has never been answered
+ * because connection was closed, it is safe to send it again */
+#define HTTP_REQUEUE            1
+/* Same, but server announced the close with an earlier response, so the
+ * request hasn't failed and sending it again is always fine */
+#define HTTP_REQUEUE_CLOSED     2
+#define HTTP_IS_REQUEUE(status) ((status) == HTTP_REQUEUE || (status) == HTTP_REQUEUE_CLOSED)
+
+/* Responses with larger header are refused, see http_set_header_limit() */
+#define HTTP_DEFAULT_HEADER_LIMIT   (64*1024)
+
+/* Pieces of request: method, space, path, protocol, headers, template */
+#define REQUEST_IOV_MAX         6
+
+/* Called for every span of response body. Return non-zero to stop receiving */
+typedef int (*body_cb)(void *context, const char *data, size_t bytes);
+
 typedef struct http_request {
     connection_t    *conn;
+    event_loop_t    *loop;
     url_t           *url;
-    char            *request_buf;
+    struct iovec    request_iov[REQUEST_IOV_MAX];
+    int             request_iovcnt;
+    size_t          request_len;
+    bool            head;
+    bool            range;
+    bool            failed;
+    bool            retried;
+    bool            show_progress;
+    bool            any_status;     /* Body of every status goes to consumer */
+    bool            compressed;     /* Asked for compressed body in headers */
 
     int     response_code;
-    int     content_length;
+    size_t  content_length;
+    bool    has_content_length;
+    bool    accept_ranges;
+    bool    connection_close;
+    bool    keep_alive;     /* Server lets connection open after response */
 
-    size_t  header_size;
+    /* Validators of resource, weak ETag can't be used in If-Range */
+    char    etag[JOURNAL_VALIDATOR_SIZE];
+    char    last_modified[JOURNAL_VALIDATOR_SIZE];
+
+    /* Content-Range of partial response, total is 0 if unknown */
+    bool    has_content_range;
+    size_t  range_first;
+    size_t  range_total;
+
+    http_parser_t   parser;
     bool    header_parsed;
 
+    /* First byte of response and completion, see trace_finish() */
+    trace_t trace;
+
+    /* Whole body has been received, connection may be reused */
+    size_t  body_received;
+    bool    complete;
+
+    /* Received data after the end of response, belongs to the next one */
+    const char  *surplus;
+    size_t      surplus_size;
+
     /* For chunked transfer encoding */
     bool    chunked;
-    size_t  curr_chunk_size;
-    size_t  chunk_size;
+    chunked_decoder_t chunks;
 
-    FILE    *file;
+    /* Content-Encoding of body, decoded before it's consumed if enabled */
+    enum content_coding coding;
+    content_decoder_t   *decoder;
+
+    /* Digest of saved body, checked against value announced by server */
+    digest_t        *digest;
+    digest_value_t  announced;
+
+    file_sink_t *sink;
     size_t  written_bytes;
+
+    /* Continued download, file already has resume_offset bytes */
+    size_t      resume_offset;
+    journal_t   *journal;
+    size_t      journal_synced;
+
+    /* Optional body consumer, otherwise body is saved to url->file */
+    void    *body_context;
+    body_cb process_body;
+
+    /* Optional observer of every header field, and of whole header with
+     * response code once it's parsed */
+    void        *header_context;
+    header_cb   process_header;
+    done_cb     header_done;
+
+    /* Exchange of library user, results are copied back when it's over */
+    struct http_fetch   *fetch;
+
+    /* Completion of non-blocking request */
+    void    *done_context;
+    done_cb process_done;
 } http_request_t;
 
+/* Exchange of library user, see httpclient.h. Response of any status is
+ * accepted, its code is set once header has been received */
+typedef struct http_fetch {
+    const char  *method;        /* GET if NULL, request has no body */
+    const char  *headers;       /* Extra header lines, each ends with CRLF */
+    bool        compressed;     /* Headers ask for compressed body, decode it */
+    body_cb     process_body;   /* Otherwise body is saved to url->file */
+    void        *body_context;
+    header_cb   process_header;
+    done_cb     header_done;    /* Header is parsed, called with response code */
+    void        *header_context;
+    int         response_code;
+    size_t      written_bytes;  /* Body passed to consumer or file */
+} http_fetch_t;
+
+/* Requests sent over one connection without waiting for responses */
+typedef struct http_pipeline {
+    connection_t    *conn;
+    http_request_t  **requests;
+    int             count;
+    int             answered;   /* Responses received completely */
+    struct iovec    *send_iov;     /* Pieces of all requests */
+    int             send_iovcnt;
+    size_t          send_len;
+} http_pipeline_t;
+
+void http_set_header_limit(size_t limit);
+void http_set_compression(bool enabled);
 int http_make_request(connection_t *conn, url_t *url);
+int http_continue_request(connection_t *conn, url_t *url);
+int http_probe(connection_t *conn, url_t *url, size_t *content_length, bool *accept_ranges,
+               digest_value_t *announced);
+int http_make_request_async(event_loop_t *loop, connection_t *conn, url_t *url,
+                            done_cb process_done, void *context);
+int http_pipeline_async(event_loop_t *loop, connection_t *conn, url_t *urls[],
+                        void *contexts[], int count, done_cb process_done);
+int http_get_range(connection_t *conn, url_t *url, size_t first, size_t last,
+                   body_cb process_body, void *context);
+int http_fetch(connection_t *conn, url_t *url, http_fetch_t *fetch);
+int http_fetch_async(event_loop_t *loop, connection_t *conn, url_t *url, http_fetch_t *fetch,
+                     done_cb process_done, void *context);
+int http_fetch_headers(buffer_t *headers, const char *extra, bool compressed);
+int http_field_append(buffer_t *fields, const char *name, size_t name_len,
+                      const char *value, size_t value_len);
+const char * http_field_find(const char *fields, size_t count, const char *name);
 
 #endif // HTTP_H
 
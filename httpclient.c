@@ -0,0 +1,237 @@
+#include "httpclient.h"
+
+#include "http.h"
+#include "buffer.h"
+#include "log.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#define FIELDS_BUFF_SIZE    1024
+#define BODY_BUFF_SIZE      4096
+
+static const char *httpclient_errors[] = {
+  "No error",
+  "Bad options",
+  "Malformed url",
+  "Failed to connect or send request",
+  "Response hasn't been received whole",
+  "Bad alloc",
+  "Body is larger than limit",
+  "Aborted by body callback"
+};
+
+/* Public response first, storage of its strings behind it */
+typedef struct response_storage {
+    httpclient_response_t       response;
+    const httpclient_options_t  *options;
+    buffer_t    fields;     /* See http_field_append() */
+    buffer_t    body;
+    int         error;      /* Set by callbacks which stopped fetch */
+} response_storage_t;
+
+void httpclient_options_init(httpclient_options_t *options)
+{
+    memset(options, 0, sizeof *options);
+    options->version = HTTPCLIENT_API_VERSION;
+    options->sink = HTTPCLIENT_SINK_MEMORY;
+}
+
+static void field_cb(void *context, const char *name, size_t name_len,
+                     const char *value, size_t value_len)
+{
+    response_storage_t *storage = (response_storage_t *)context;
+
+    if (storage->error)
+        return;
+
+    if (http_field_append(&storage->fields, name, name_len, value, value_len) != 0) {
+        storage->error = HTTPCLIENT_BAD_ALLOC;
+        return;
+    }
+
+    storage->response.header_count++;
+}
+
+static int memory_body_cb(void *context, const char *data, size_t bytes)
+{
+    response_storage_t *storage = (response_storage_t *)context;
+    size_t limit = storage->options->max_body;
+
+    if (limit && storage->body.actual_size + bytes > limit) {
+        storage->error = HTTPCLIENT_BODY_TOO_LARGE;
+        return 1;
+    }
+
+    if (buffer_append(&storage->body, data, bytes) != 0) {
+        storage->error = HTTPCLIENT_BAD_ALLOC;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int user_body_cb(void *context, const char *data, size_t bytes)
+{
+    response_storage_t *storage = (response_storage_t *)context;
+
+    if (storage->options->on_body(storage->options->context, data, bytes) != 0) {
+        storage->error = HTTPCLIENT_ABORTED;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Fields are complete, point headers into their storage */
+static int index_fields(response_storage_t *storage)
+{
+    httpclient_response_t *response = &storage->response;
+    const char *p = storage->fields.content;
+
+    response->headers = (httpclient_header_t *)calloc(response->header_count + 1,
+                                                      sizeof(httpclient_header_t));
+    if (response->headers == NULL)
+        return -1;
+
+    for (size_t i = 0; i < response->header_count; ++i) {
+        response->headers[i].name = p;
+        p += strlen(p) + 1;
+        response->headers[i].value = p;
+        p += strlen(p) + 1;
+    }
+
+    return 0;
+}
+
+/* Fetch url in calling thread. Response of any status is returned, NULL
+ * if it hasn't been received whole, error tells why */
+httpclient_response_t * httpclient_fetch(const char *address, const httpclient_options_t *options,
+                                         int *error)
+{
+    httpclient_options_t defaults;
+    response_storage_t *storage = NULL;
+    http_fetch_t fetch;
+    buffer_t headers;
+    url_t *url = NULL;
+    connection_t *conn = NULL;
+    int error_code = 0, status = 0;
+
+    memset(&headers, 0, sizeof headers);
+    memset(&fetch, 0, sizeof fetch);
+
+    if (options == NULL) {
+        httpclient_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (address == NULL || options->version != HTTPCLIENT_API_VERSION ||
+        (options->sink == HTTPCLIENT_SINK_CALLBACK && options->on_body == NULL)) {
+        error_code = HTTPCLIENT_BAD_OPTIONS;
+        goto err;
+    }
+
+    storage = (response_storage_t *)calloc(1, sizeof(response_storage_t));
+    if (storage == NULL ||
+        buffer_init(&storage->fields, FIELDS_BUFF_SIZE, NULL) != 0 ||
+        buffer_init(&headers, FIELDS_BUFF_SIZE, NULL) != 0 ||
+        http_fetch_headers(&headers, options->headers, options->compressed) != 0 ||
+        (options->sink == HTTPCLIENT_SINK_MEMORY && buffer_init(&storage->body, BODY_BUFF_SIZE, NULL) != 0)) {
+        error_code = HTTPCLIENT_BAD_ALLOC;
+        goto err;
+    }
+    storage->options = options;
+
+    url = parse_url(address, &status);
+    if (status) {
+        error_code = HTTPCLIENT_URL_ERROR;
+        goto err;
+    }
+
+    /* Name is kept by caller, url only points to it */
+    if (options->sink == HTTPCLIENT_SINK_FILE && options->file)
+        url->file = (char *)options->file;
+
+    conn = init_connection(url->host, url->port, &status);
+    if (status) {
+        error_code = HTTPCLIENT_CONNECTION_ERROR;
+        goto err;
+    }
+
+    fetch.method = options->method;
+    fetch.headers = headers.actual_size ? headers.content : NULL;
+    fetch.compressed = options->compressed;
+    fetch.process_header = field_cb;
+    fetch.header_context = storage;
+    if (options->sink == HTTPCLIENT_SINK_MEMORY)
+        fetch.process_body = memory_body_cb;
+    else if (options->sink == HTTPCLIENT_SINK_CALLBACK)
+        fetch.process_body = user_body_cb;
+    fetch.body_context = storage;
+
+    status = http_fetch(conn, url, &fetch);
+
+    if (storage->error)
+        error_code = storage->error;
+    else if (status != 0)
+        error_code = fetch.response_code ? HTTPCLIENT_TRANSFER_ERROR : HTTPCLIENT_CONNECTION_ERROR;
+    else if (index_fields(storage) != 0)
+        error_code = HTTPCLIENT_BAD_ALLOC;
+    if (error_code)
+        goto err;
+
+    storage->response.status = fetch.response_code;
+    storage->response.body = storage->body.content;
+    storage->response.body_size = fetch.written_bytes;
+
+    buffer_release(&headers);
+    free_connection(conn);
+    free_url(url);
+
+    if (error)
+        *error = HTTPCLIENT_NO_ERROR;
+
+    return &storage->response;
+
+err:
+    if (error)
+        *error = error_code;
+
+    buffer_release(&headers);
+    free_connection(conn);
+    free_url(url);
+    httpclient_response_free(storage ? &storage->response : NULL);
+
+    return NULL;
+}
+
+const char * httpclient_response_header(const httpclient_response_t *response, const char *name)
+{
+    const response_storage_t *storage = (const response_storage_t *)response;
+
+    if (response == NULL || name == NULL)
+        return NULL;
+
+    return http_field_find(storage->fields.content, response->header_count, name);
+}
+
+void httpclient_response_free(httpclient_response_t *response)
+{
+    response_storage_t *storage = (response_storage_t *)response;
+
+    if (storage == NULL)
+        return;
+
+    buffer_release(&storage->fields);
+    buffer_release(&storage->body);
+    free(storage->response.headers);
+    free(storage);
+}
+
+const char * httpclient_error_string(int error)
+{
+    if ((size_t)error >= sizeof(httpclient_errors)/sizeof(httpclient_errors[0]))
+        return "Wrong error number";
+
+    return httpclient_errors[error];
+}
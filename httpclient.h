@@ -0,0 +1,76 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Embeddable client, the same engine as ./http without a process and a
+ * temporary file per fetch. Build with make lib, link libhttpclient.a with
+ * -pthread -lz. Only this header is needed, internal ones may change, it
+ * can be included by C and C++ programs */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Options are checked against it, see httpclient_options_init() */
+#define HTTPCLIENT_API_VERSION      1
+
+#define HTTPCLIENT_NO_ERROR         0
+#define HTTPCLIENT_BAD_OPTIONS      1
+#define HTTPCLIENT_URL_ERROR        2
+#define HTTPCLIENT_CONNECTION_ERROR 3
+#define HTTPCLIENT_TRANSFER_ERROR   4
+#define HTTPCLIENT_BAD_ALLOC        5
+#define HTTPCLIENT_BODY_TOO_LARGE   6
+#define HTTPCLIENT_ABORTED          7
+
+/* Where body of response goes */
+enum httpclient_sink {
+    HTTPCLIENT_SINK_MEMORY = 0,     /* Growable buffer of response */
+    HTTPCLIENT_SINK_CALLBACK,       /* Spans passed to on_body */
+    HTTPCLIENT_SINK_FILE            /* File written like ./http does */
+};
+
+/* Called for every span of body. Return non-zero to abort fetch */
+typedef int (*httpclient_body_cb)(void *context, const char *data, size_t bytes);
+
+typedef struct httpclient_options {
+    unsigned    version;        /* HTTPCLIENT_API_VERSION */
+    const char  *method;        /* Method without request body, GET by default */
+    const char  *headers;       /* Extra header lines, each ends with CRLF */
+    bool        compressed;     /* Ask for gzip or deflate body and decode it */
+
+    enum httpclient_sink sink;
+    size_t      max_body;       /* Memory sink fails beyond it, 0 for no limit */
+    httpclient_body_cb on_body; /* Callback sink */
+    void        *context;
+    const char  *file;          /* File sink, name from url if NULL */
+} httpclient_options_t;
+
+typedef struct httpclient_header {
+    const char  *name;
+    const char  *value;
+} httpclient_header_t;
+
+/* Response of any status, owned by caller until httpclient_response_free() */
+typedef struct httpclient_response {
+    int                 status;         /* HTTP status code */
+    httpclient_header_t *headers;       /* In order of response */
+    size_t              header_count;
+    char                *body;          /* Memory sink, terminated, NULL otherwise */
+    size_t              body_size;      /* Bytes of body passed to sink */
+} httpclient_response_t;
+
+void httpclient_options_init(httpclient_options_t *options);
+httpclient_response_t * httpclient_fetch(const char *url, const httpclient_options_t *options,
+                                         int *error);
+const char * httpclient_response_header(const httpclient_response_t *response, const char *name);
+void httpclient_response_free(httpclient_response_t *response);
+const char * httpclient_error_string(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTPCLIENT_H
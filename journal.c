@@ -0,0 +1,222 @@
+#include "journal.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#include "log.h"
+
+#define JOURNAL_MAGIC "http-journal 1"
+#define JOURNAL_LINE_SIZE (JOURNAL_VALIDATOR_SIZE + 32)
+
+static const char *journal_errors[] = {
+  "No error",
+  "Bad alloc",
+  "Malformed journal",
+  "Failed to read or write journal"
+};
+
+static int load_journal(journal_t *journal, FILE *f)
+{
+    char line[JOURNAL_LINE_SIZE];
+    size_t begin, end, len;
+
+    if (!fgets(line, sizeof line, f) || strncmp(line, JOURNAL_MAGIC "\n", sizeof line) != 0)
+        return JOURNAL_MALFORMED;
+
+    while (fgets(line, sizeof line, f)) {
+        len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n')
+            return JOURNAL_MALFORMED;
+        line[--len] = '\0';
+
+        if (strncmp(line, "validator ", 10) == 0) {
+            /* Truncated one would never match the resource again */
+            if (len - 10 >= JOURNAL_VALIDATOR_SIZE)
+                return JOURNAL_MALFORMED;
+            memcpy(journal->validator, line + 10, len - 10 + 1);
+        }
+        else if (sscanf(line, "length %zu", &journal->length) == 1) {
+            continue;
+        }
+        else if (sscanf(line, "range %zu %zu", &begin, &end) == 2) {
+            if (begin >= end || journal_add(journal, begin, end) != 0)
+                return JOURNAL_MALFORMED;
+        }
+        else {
+            return JOURNAL_MALFORMED;
+        }
+    }
+
+    if (journal->validator[0] == '\0')
+        return JOURNAL_MALFORMED;
+
+    return JOURNAL_NO_ERROR;
+}
+
+/* Load journal of file if it exists, otherwise it's empty */
+journal_t * journal_open(const char *file, int *error)
+{
+    journal_t *journal = NULL;
+    FILE *f = NULL;
+
+    *error = JOURNAL_NO_ERROR;
+
+    journal = (journal_t *)calloc(1, sizeof(journal_t));
+    if (journal == NULL) { goto err; }
+
+    journal->path = (char *)malloc(strlen(file) + sizeof(JOURNAL_SUFFIX));
+    if (journal->path == NULL) { goto err; }
+    sprintf(journal->path, "%s%s", file, JOURNAL_SUFFIX);
+
+    f = fopen(journal->path, "r");
+    if (f == NULL) {
+        if (errno != ENOENT)
+            *error = JOURNAL_IO_ERROR;
+        return journal;
+    }
+
+    *error = load_journal(journal, f);
+    fclose(f);
+
+    /* Nothing can be trusted in broken journal */
+    if (*error)
+        journal_reset(journal, "", 0);
+
+    return journal;
+
+err:
+    *error = JOURNAL_BAD_ALLOC;
+    journal_free(journal);
+
+    return NULL;
+}
+
+/* Write to temporary file and rename it, so journal is never half written */
+int journal_save(journal_t *journal)
+{
+    char *tmp = NULL;
+    FILE *f = NULL;
+    int status = 0;
+
+    tmp = (char *)malloc(strlen(journal->path) + 5);
+    if (tmp == NULL)
+        return JOURNAL_BAD_ALLOC;
+    sprintf(tmp, "%s.tmp", journal->path);
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(tmp);
+        return JOURNAL_IO_ERROR;
+    }
+
+    fprintf(f, JOURNAL_MAGIC "\n");
+    fprintf(f, "validator %s\n", journal->validator);
+    if (journal->length)
+        fprintf(f, "length %zu\n", journal->length);
+    for (int i = 0; i < journal->count; ++i)
+        fprintf(f, "range %zu %zu\n", journal->ranges[i].begin, journal->ranges[i].end);
+
+    if (fclose(f) != 0 || rename(tmp, journal->path) != 0) {
+        unlink(tmp);
+        status = JOURNAL_IO_ERROR;
+    }
+
+    free(tmp);
+
+    return status;
+}
+
+/* Forget progress, e.g. resource has been changed */
+void journal_reset(journal_t *journal, const char *validator, size_t length)
+{
+    strncpy(journal->validator, validator, JOURNAL_VALIDATOR_SIZE - 1);
+    journal->validator[JOURNAL_VALIDATOR_SIZE - 1] = '\0';
+    journal->length = length;
+    journal->count = 0;
+}
+
+/* Mark [begin, end) as completed, merging with adjacent ranges */
+int journal_add(journal_t *journal, size_t begin, size_t end)
+{
+    journal_range_t *r;
+    int i, j;
+
+    if (begin >= end)
+        return 0;
+
+    /* First range which ends at or after begin */
+    for (i = 0; i < journal->count && journal->ranges[i].end < begin; ++i)
+        ;
+
+    /* Ranges [i, j) touch the new one */
+    for (j = i; j < journal->count && journal->ranges[j].begin <= end; ++j) {
+        if (journal->ranges[j].begin < begin)
+            begin = journal->ranges[j].begin;
+        if (journal->ranges[j].end > end)
+            end = journal->ranges[j].end;
+    }
+
+    if (i == j) {
+        if (journal->count == journal->capacity) {
+            int capacity = journal->capacity ? journal->capacity * 2 : 4;
+            r = (journal_range_t *)realloc(journal->ranges, capacity * sizeof(journal_range_t));
+            if (r == NULL)
+                return JOURNAL_BAD_ALLOC;
+            journal->ranges = r;
+            journal->capacity = capacity;
+        }
+        memmove(&journal->ranges[i + 1], &journal->ranges[i],
+                (journal->count - i) * sizeof(journal_range_t));
+        journal->count++;
+        j = i + 1;
+    }
+
+    journal->ranges[i].begin = begin;
+    journal->ranges[i].end = end;
+
+    memmove(&journal->ranges[i + 1], &journal->ranges[j],
+            (journal->count - j) * sizeof(journal_range_t));
+    journal->count -= j - i - 1;
+
+    return 0;
+}
+
+/* Length of completed prefix of file */
+size_t journal_completed(journal_t *journal)
+{
+    if (journal->count == 0 || journal->ranges[0].begin != 0)
+        return 0;
+
+    return journal->ranges[0].end;
+}
+
+/* Download is over, journal isn't needed anymore */
+void journal_remove(journal_t *journal)
+{
+    if (unlink(journal->path) != 0 && errno != ENOENT)
+        perror("Failed to remove journal");
+}
+
+void journal_free(journal_t *journal)
+{
+    if (journal == NULL)
+        return;
+
+    free(journal->path);
+    free(journal->ranges);
+    free(journal);
+}
+
+void print_journal_error(int error)
+{
+    if ((size_t)error >= sizeof(journal_errors)/sizeof(journal_errors[0])) {
+        LOG_E("Wrong error number");
+        return;
+    }
+
+    LOG_E("Journal problem: %s", journal_errors[error]);
+}
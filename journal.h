@@ -0,0 +1,41 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstddef>
+
+/* Sidecar file next to partially downloaded file */
+#define JOURNAL_SUFFIX          ".journal"
+#define JOURNAL_VALIDATOR_SIZE  256
+
+#define JOURNAL_NO_ERROR        0
+#define JOURNAL_BAD_ALLOC       1
+#define JOURNAL_MALFORMED       2
+#define JOURNAL_IO_ERROR        3
+
+/* Bytes [begin, end) are on disk */
+typedef struct journal_range {
+    size_t  begin;
+    size_t  end;
+} journal_range_t;
+
+/* Progress of download, it can be continued only if resource still
+ * matches validator (strong ETag or Last-Modified date) */
+typedef struct journal {
+    char            *path;
+    char            validator[JOURNAL_VALIDATOR_SIZE];
+    size_t          length;     /* Size of whole resource, 0 if unknown */
+    journal_range_t *ranges;    /* Sorted and not overlapping */
+    int             count;
+    int             capacity;
+} journal_t;
+
+journal_t * journal_open(const char *file, int *error);
+int journal_save(journal_t *journal);
+void journal_reset(journal_t *journal, const char *validator, size_t length);
+int journal_add(journal_t *journal, size_t begin, size_t end);
+size_t journal_completed(journal_t *journal);
+void journal_remove(journal_t *journal);
+void journal_free(journal_t *journal);
+void print_journal_error(int error);
+
+#endif // JOURNAL_H
@@ -0,0 +1,185 @@
+#include "parser.h"
+
+#include <cstring>
+#include <strings.h>
+
+#include "scan.h"
+
+void http_parser_init(http_parser_t *parser, header_cb on_header, void *context)
+{
+    memset(parser, 0, sizeof(http_parser_t));
+    parser->state = PARSER_VERSION;
+    parser->on_header = on_header;
+    parser->context = context;
+}
+
+/* "HTTP/1.1" */
+static bool parse_version(http_parser_t *parser, const char *begin, size_t len)
+{
+    if (len != 8 || memcmp(begin, "HTTP/", 5) != 0 || begin[6] != '.')
+        return false;
+
+    if (begin[5] < '0' || begin[5] > '9' || begin[7] < '0' || begin[7] > '9')
+        return false;
+
+    parser->version_major = begin[5] - '0';
+    parser->version_minor = begin[7] - '0';
+
+    return true;
+}
+
+static void emit_header(http_parser_t *parser, const char *data, size_t value_end)
+{
+    size_t value_begin = parser->token_begin;
+
+    while (value_end > value_begin && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+        value_end--;
+
+    if (parser->on_header)
+        parser->on_header(parser->context, data + parser->name_begin,
+                          parser->name_end - parser->name_begin,
+                          data + value_begin, value_end - value_begin);
+}
+
+/* Parse data[parser->offset, len). Returns PARSER_DONE once empty line after
+ * header has been found, PARSER_ERROR on malformed header, otherwise the
+ * state in which more data is needed */
+enum parser_state http_parser_execute(http_parser_t *parser, const char *data, size_t len)
+{
+    size_t pos = parser->offset;
+    const char *eol, *end = data + len;
+    char c;
+
+    while (pos < len && parser->state != PARSER_DONE && parser->state != PARSER_ERROR) {
+        c = data[pos];
+
+        switch (parser->state) {
+        case PARSER_VERSION:
+            if (c == ' ') {
+                if (!parse_version(parser, data + parser->token_begin, pos - parser->token_begin))
+                    parser->state = PARSER_ERROR;
+                else
+                    parser->state = PARSER_STATUS_CODE;
+            }
+            pos++;
+            break;
+
+        case PARSER_STATUS_CODE:
+            if (c >= '0' && c <= '9') {
+                parser->status_code = parser->status_code * 10 + (c - '0');
+                if (parser->status_code > 999)
+                    parser->state = PARSER_ERROR;
+                pos++;
+            }
+            else if (c == ' ' || c == '\r' || c == '\n') {
+                parser->state = parser->status_code >= 100 ? PARSER_REASON : PARSER_ERROR;
+            }
+            else {
+                parser->state = PARSER_ERROR;
+            }
+            break;
+
+        case PARSER_REASON:
+            /* Reason phrase is ignored, jump to end of line */
+            eol = scan_char(data + pos, end, '\n');
+            if (eol == end) {
+                pos = len;
+                break;
+            }
+            pos = eol - data + 1;
+            parser->state = PARSER_NAME_START;
+            break;
+
+        case PARSER_NAME_START:
+            if (c == '\r') {
+                parser->state = PARSER_HEADER_END;
+                pos++;
+            }
+            else if (c == '\n') {
+                parser->state = PARSER_DONE;
+                parser->header_size = ++pos;
+            }
+            else if (c == ':' || c == ' ' || c == '\t') {
+                /* Empty names and obsolete line folding aren't supported */
+                parser->state = PARSER_ERROR;
+            }
+            else {
+                parser->name_begin = pos++;
+                parser->state = PARSER_NAME;
+            }
+            break;
+
+        case PARSER_NAME:
+            eol = scan_chars2(data + pos, end, ':', '\n');
+            pos = eol - data;
+            if (eol == end)
+                break;
+
+            if (*eol == '\n') {
+                parser->state = PARSER_ERROR;
+                break;
+            }
+            parser->name_end = pos++;
+            parser->state = PARSER_VALUE_START;
+            break;
+
+        case PARSER_VALUE_START:
+            if (c == ' ' || c == '\t') {
+                pos++;
+                break;
+            }
+            parser->token_begin = pos;
+            parser->state = PARSER_VALUE;
+            break;
+
+        case PARSER_VALUE:
+            eol = scan_char(data + pos, end, '\n');
+            if (eol == end) {
+                pos = len;
+                break;
+            }
+            pos = eol - data;
+            emit_header(parser, data, (pos > parser->token_begin && data[pos - 1] == '\r') ? pos - 1 : pos);
+            pos++;
+            parser->state = PARSER_NAME_START;
+            break;
+
+        case PARSER_HEADER_END:
+            if (c == '\n') {
+                parser->state = PARSER_DONE;
+                parser->header_size = ++pos;
+            }
+            else {
+                parser->state = PARSER_ERROR;
+            }
+            break;
+
+        case PARSER_DONE:
+        case PARSER_ERROR:
+            break;
+        }
+    }
+
+    parser->offset = pos;
+
+    return parser->state;
+}
+
+/* Field names are case-insensitive */
+bool http_name_equals(const char *name, size_t len, const char *expected)
+{
+    return strlen(expected) == len && strncasecmp(name, expected, len) == 0;
+}
+
+/* Case-insensitive search of token in field value which isn't NULL terminated */
+bool http_value_contains(const char *value, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+
+    for (size_t i = 0; i + token_len <= len; ++i) {
+        if (strncasecmp(value + i, token, token_len) == 0)
+            return true;
+    }
+
+    return false;
+}
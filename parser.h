@@ -0,0 +1,48 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <cstddef>
+
+/* Called for every header field, name and value point into parsed buffer */
+typedef void (*header_cb)(void *context, const char *name, size_t name_len,
+                          const char *value, size_t value_len);
+
+enum parser_state {
+    PARSER_VERSION = 0,
+    PARSER_STATUS_CODE,
+    PARSER_REASON,
+    PARSER_NAME_START,
+    PARSER_NAME,
+    PARSER_VALUE_START,
+    PARSER_VALUE,
+    PARSER_HEADER_END,
+    PARSER_DONE,
+    PARSER_ERROR
+};
+
+/* Resumable parser of response status line and header. Header is parsed
+ * in the buffer where it's being accumulated, each call continues from
+ * the offset where previous call stopped, so every byte is seen once */
+typedef struct http_parser {
+    enum parser_state state;
+    size_t  offset;         /* Bytes of buffer already parsed */
+    size_t  token_begin;    /* Start of version, name or value */
+    size_t  name_begin;
+    size_t  name_end;
+
+    int     version_major;
+    int     version_minor;
+    int     status_code;
+    size_t  header_size;    /* Offset of body once parsing is done */
+
+    void        *context;
+    header_cb   on_header;
+} http_parser_t;
+
+void http_parser_init(http_parser_t *parser, header_cb on_header, void *context);
+enum parser_state http_parser_execute(http_parser_t *parser, const char *data, size_t len);
+
+bool http_name_equals(const char *name, size_t len, const char *expected);
+bool http_value_contains(const char *value, size_t len, const char *token);
+
+#endif // PARSER_H
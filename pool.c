@@ -0,0 +1,411 @@
+#include "pool.h"
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static const char *pool_errors[] = {
+  "No error",
+  "Too many connections to host",
+  "Failed to create connection",
+  "Bad alloc"
+};
+
+connection_pool_t * pool_create(int max_per_host, int idle_timeout)
+{
+    connection_pool_t *pool = (connection_pool_t *)calloc(1, sizeof(connection_pool_t));
+    if (!pool)
+        return NULL;
+
+    pool->max_per_host = max_per_host > 0 ? max_per_host : POOL_DEFAULT_MAX_PER_HOST;
+    pool->idle_timeout = idle_timeout >= 0 ? idle_timeout : POOL_DEFAULT_IDLE_TIMEOUT;
+    pool->timer_fd = -1;
+
+    return pool;
+}
+
+static void free_pooled(connection_t *conn)
+{
+    close_connection(conn);
+    free_connection(conn);
+}
+
+void pool_free(connection_pool_t *pool)
+{
+    pool_host_t *h, *next;
+
+    if (!pool)
+        return;
+
+    if (pool->timer_fd >= 0) {
+        event_loop_unwatch(pool->loop, pool->timer_fd);
+        close(pool->timer_fd);
+    }
+
+    for (h = pool->hosts; h != NULL; h = next) {
+        next = h->next;
+
+        for (int i = 0; i < h->idle_count; ++i)
+            free_pooled(h->idle[i].conn);
+
+        free(h->idle);
+        free(h->host);
+        free(h->port);
+        free(h);
+    }
+
+    free(pool);
+}
+
+static pool_host_t * find_host(connection_pool_t *pool, const char *host, const char *port)
+{
+    for (pool_host_t *h = pool->hosts; h != NULL; h = h->next) {
+        if (strcmp(h->host, host) == 0 && strcmp(h->port, port) == 0)
+            return h;
+    }
+
+    return NULL;
+}
+
+static size_t limit_bucket(const char *host, const char *port)
+{
+    size_t hash = 5381;
+
+    for (const char *p = host; *p; ++p)
+        hash = hash * 33 + (unsigned char)*p;
+    for (const char *p = port; *p; ++p)
+        hash = hash * 33 + (unsigned char)*p;
+
+    return hash % POOL_LIMIT_BUCKETS;
+}
+
+static host_limit_t * find_limit(host_limit_t *list, const char *host, const char *port)
+{
+    for (host_limit_t *l = list; l != NULL; l = l->next) {
+        if (strcmp(l->host, host) == 0 && strcmp(l->port, port) == 0)
+            return l;
+    }
+
+    return NULL;
+}
+
+/* Counter of host, added by the first thread which needs it. Readers walk
+ * lists without lock, entry is complete before it's published */
+static host_limit_t * host_limit(pool_limits_t *limits, const char *host, const char *port)
+{
+    host_limit_t **bucket = &limits->buckets[limit_bucket(host, port)];
+    host_limit_t *l = find_limit(__atomic_load_n(bucket, __ATOMIC_ACQUIRE), host, port);
+
+    if (l)
+        return l;
+
+    pthread_mutex_lock(&limits->lock);
+
+    l = find_limit(*bucket, host, port);
+    if (l == NULL) {
+        l = (host_limit_t *)calloc(1, sizeof(host_limit_t));
+        if (l)
+            l->host = strdup(host);
+        if (l)
+            l->port = strdup(port);
+        if (l && l->host && l->port) {
+            l->next = *bucket;
+            __atomic_store_n(bucket, l, __ATOMIC_RELEASE);
+        }
+        else if (l) {
+            free(l->host);
+            free(l->port);
+            free(l);
+            l = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&limits->lock);
+
+    return l;
+}
+
+static bool limit_acquire(pool_limits_t *limits, host_limit_t *l)
+{
+    int n = __atomic_load_n(&l->in_use, __ATOMIC_RELAXED);
+
+    do {
+        if (n >= limits->max_per_host)
+            return false;
+    } while (!__atomic_compare_exchange_n(&l->in_use, &n, n + 1, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+static void limit_release(pool_limits_t *limits, host_limit_t *l)
+{
+    int n = __atomic_fetch_sub(&l->in_use, 1, __ATOMIC_ACQ_REL);
+
+    /* Other threads may wait for this host */
+    if (n == limits->max_per_host && limits->process_freed)
+        limits->process_freed(limits->context);
+}
+
+pool_limits_t * pool_limits_create(int max_per_host, limit_cb process_freed, void *context)
+{
+    pool_limits_t *limits = (pool_limits_t *)calloc(1, sizeof(pool_limits_t));
+    if (!limits)
+        return NULL;
+
+    pthread_mutex_init(&limits->lock, NULL);
+    limits->max_per_host = max_per_host > 0 ? max_per_host : POOL_DEFAULT_MAX_PER_HOST;
+    limits->process_freed = process_freed;
+    limits->context = context;
+
+    return limits;
+}
+
+void pool_limits_free(pool_limits_t *limits)
+{
+    host_limit_t *l, *next;
+
+    if (!limits)
+        return;
+
+    for (int i = 0; i < POOL_LIMIT_BUCKETS; ++i) {
+        for (l = limits->buckets[i]; l != NULL; l = next) {
+            next = l->next;
+            free(l->host);
+            free(l->port);
+            free(l);
+        }
+    }
+
+    pthread_mutex_destroy(&limits->lock);
+    free(limits);
+}
+
+/* Connections of pool count against limits, set before pool is used */
+void pool_share_limits(connection_pool_t *pool, pool_limits_t *limits)
+{
+    pool->limits = limits;
+}
+
+static pool_host_t * add_host(connection_pool_t *pool, const char *host, const char *port, int *error)
+{
+    int error_code = 0;
+    pool_host_t *h = (pool_host_t *)calloc(1, sizeof(pool_host_t));
+    if (!h) {
+        error_code = POOL_BAD_ALLOC;
+        goto err;
+    }
+
+    h->idle = (pool_entry_t *)calloc(pool->max_per_host, sizeof(pool_entry_t));
+    if (!h->idle) {
+        error_code = POOL_BAD_ALLOC;
+        goto err;
+    }
+
+    h->host = strdup(host);
+    h->port = strdup(port);
+    if (!h->host || !h->port) {
+        error_code = POOL_BAD_ALLOC;
+        goto err;
+    }
+
+    if (pool->limits) {
+        h->limit = host_limit(pool->limits, host, port);
+        if (!h->limit) {
+            error_code = POOL_BAD_ALLOC;
+            goto err;
+        }
+    }
+
+    h->next = pool->hosts;
+    pool->hosts = h;
+
+    return h;
+
+err:
+    if (error)
+        *error = error_code;
+
+    if (h) {
+        free(h->idle);
+        free(h->host);
+        free(h->port);
+    }
+    free(h);
+
+    return NULL;
+}
+
+static void evict_host(connection_pool_t *pool, pool_host_t *h, time_t now)
+{
+    int kept = 0;
+
+    for (int i = 0; i < h->idle_count; ++i) {
+        if (now - h->idle[i].since >= pool->idle_timeout)
+            free_pooled(h->idle[i].conn);
+        else
+            h->idle[kept++] = h->idle[i];
+    }
+
+    h->idle_count = kept;
+}
+
+void pool_evict_idle(connection_pool_t *pool)
+{
+    time_t now = time(NULL);
+
+    for (pool_host_t *h = pool->hosts; h != NULL; h = h->next)
+        evict_host(pool, h, now);
+}
+
+static void idle_timer_cb(void *context)
+{
+    connection_pool_t *pool = (connection_pool_t *)context;
+    uint64_t expirations;
+
+    if (read(pool->timer_fd, &expirations, sizeof expirations) < 0)
+        LOG_D("Nothing to read from timerfd");
+
+    pool_evict_idle(pool);
+}
+
+/* Check idle connections of all hosts every idle timeout while loop runs,
+ * otherwise only connections of acquired host are checked */
+int pool_watch_idle(connection_pool_t *pool, event_loop_t *loop)
+{
+    struct itimerspec interval;
+    int fd;
+
+    memset(&interval, 0, sizeof interval);
+    interval.it_interval.tv_sec = pool->idle_timeout > 0 ? pool->idle_timeout : 1;
+    interval.it_value = interval.it_interval;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    if (timerfd_settime(fd, 0, &interval, NULL) < 0 ||
+        event_loop_watch(loop, fd, idle_timer_cb, pool) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    pool->loop = loop;
+    pool->timer_fd = fd;
+
+    return 0;
+}
+
+/* Server might have closed idle connection, check it without blocking */
+static bool connection_alive(connection_t *conn)
+{
+    char c;
+    ssize_t n = recv(conn->sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Return idle connection to host or a new one. New connection isn't opened */
+connection_t * pool_acquire(connection_pool_t *pool, const char *host, const char *port, int *error)
+{
+    int error_code = 0;
+    connection_t *conn = NULL;
+    pool_host_t *h = find_host(pool, host, port);
+
+    if (!h) {
+        h = add_host(pool, host, port, &error_code);
+        if (!h)
+            goto err;
+    }
+
+    evict_host(pool, h, time(NULL));
+
+    /* Idle connection counts against shared limit once it's taken */
+    if (pool->limits && !limit_acquire(pool->limits, h->limit)) {
+        error_code = POOL_HOST_LIMIT;
+        goto err;
+    }
+
+    /* Most recently used connection is the most likely to be alive */
+    while (h->idle_count > 0) {
+        conn = h->idle[--h->idle_count].conn;
+        if (connection_alive(conn)) {
+            conn->reused = true;
+            h->in_use++;
+            return conn;
+        }
+        free_pooled(conn);
+    }
+
+    if (h->in_use >= pool->max_per_host) {
+        error_code = POOL_HOST_LIMIT;
+        goto err_limit;
+    }
+
+    /* Resolver cache is hit unless addresses have expired */
+    conn = init_connection(host, port, &error_code);
+    if (!conn) {
+        error_code = POOL_CONNECTION_ERROR;
+        goto err_limit;
+    }
+
+    h->in_use++;
+
+    return conn;
+
+err_limit:
+    if (pool->limits)
+        limit_release(pool->limits, h->limit);
+err:
+    if (error)
+        *error = error_code;
+
+    return NULL;
+}
+
+/* Keep connection for later requests if it's still open, otherwise free it */
+void pool_release(connection_pool_t *pool, connection_t *conn)
+{
+    pool_host_t *h;
+
+    if (!conn)
+        return;
+
+    h = find_host(pool, conn->host, conn->port);
+    if (!h) {
+        free_pooled(conn);
+        return;
+    }
+
+    h->in_use--;
+    if (pool->limits)
+        limit_release(pool->limits, h->limit);
+
+    if (!conn->opened || h->idle_count >= pool->max_per_host) {
+        free_pooled(conn);
+        return;
+    }
+
+    h->idle[h->idle_count].conn = conn;
+    h->idle[h->idle_count].since = time(NULL);
+    h->idle_count++;
+}
+
+void print_pool_error(int error)
+{
+    if ((size_t)error >= sizeof(pool_errors)/sizeof(pool_errors[0])) {
+        LOG_E("Wrong error number");
+        return;
+    }
+
+    LOG_E("Connection pool problem: %s", pool_errors[error]);
+}
@@ -0,0 +1,83 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <ctime>
+
+#include <pthread.h>
+
+#include "connect.h"
+#include "event_loop.h"
+
+typedef struct pool_entry {
+    connection_t    *conn;
+    time_t          since;      /* When connection became idle */
+} pool_entry_t;
+
+#define POOL_LIMIT_BUCKETS          64
+
+/* Connections in use to one host:port by pools of all threads */
+typedef struct host_limit {
+    char            *host;
+    char            *port;
+    int             in_use;
+    struct host_limit *next;
+} host_limit_t;
+
+/* Called by thread which freed connection to host that was at its limit */
+typedef void (*limit_cb)(void *context);
+
+/* Per-host limit shared by pools of several threads, so one origin can't
+ * take every connection. Counters are updated without lock, it guards only
+ * insertion of hosts, which are never removed */
+typedef struct pool_limits {
+    pthread_mutex_t lock;
+    host_limit_t    *buckets[POOL_LIMIT_BUCKETS];
+    int             max_per_host;
+    limit_cb        process_freed;
+    void            *context;
+} pool_limits_t;
+
+/* Connections to one host:port, addresses come from resolver cache */
+typedef struct pool_host {
+    char            *host;
+    char            *port;
+    pool_entry_t    *idle;
+    int             idle_count;
+    int             in_use;
+    host_limit_t    *limit;     /* Shared counter if pool has limits */
+    struct pool_host *next;
+} pool_host_t;
+
+/* Keeps idle persistent connections per host:port and reuses them */
+typedef struct connection_pool {
+    pool_host_t     *hosts;
+    int             max_per_host;   /* Connections in use and idle */
+    int             idle_timeout;   /* Seconds before idle connection is closed */
+    pool_limits_t   *limits;        /* Shared with pools of other threads, or NULL */
+    /* Timer of loop which closes idle connections of every host */
+    event_loop_t    *loop;
+    int             timer_fd;
+} connection_pool_t;
+
+#define POOL_DEFAULT_MAX_PER_HOST   6
+#define POOL_DEFAULT_IDLE_TIMEOUT   30
+
+/* Errors of pool_acquire, caller waits for a free connection on host limit */
+#define POOL_NO_ERROR               0
+#define POOL_HOST_LIMIT             1
+#define POOL_CONNECTION_ERROR       2
+#define POOL_BAD_ALLOC              3
+
+connection_pool_t * pool_create(int max_per_host, int idle_timeout);
+void pool_free(connection_pool_t *pool);
+connection_t * pool_acquire(connection_pool_t *pool, const char *host, const char *port, int *error);
+void pool_release(connection_pool_t *pool, connection_t *conn);
+void pool_evict_idle(connection_pool_t *pool);
+int pool_watch_idle(connection_pool_t *pool, event_loop_t *loop);
+void print_pool_error(int error);
+
+pool_limits_t * pool_limits_create(int max_per_host, limit_cb process_freed, void *context);
+void pool_limits_free(pool_limits_t *limits);
+void pool_share_limits(connection_pool_t *pool, pool_limits_t *limits);
+
+#endif // POOL_H
@@ -0,0 +1,666 @@
+#include "resolver.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <cstdint>
+
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include "event_loop.h"
+#include "log.h"
+
+static const char *resolver_errors[] = {
+  "No error",
+  "Host not found",
+  "Lookup is in progress",
+  "Bad alloc",
+  "Failed to start resolver thread",
+  "Failed to read hosts file"
+};
+
+static resolver_t *default_resolver = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+resolver_t * resolver_create(int threads, int *error)
+{
+    resolver_t *resolver = (resolver_t *)calloc(1, sizeof(resolver_t));
+    if (!resolver) {
+        if (error)
+            *error = RESOLVER_BAD_ALLOC;
+        return NULL;
+    }
+
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->jobs_ready, NULL);
+    pthread_cond_init(&resolver->resolved, NULL);
+    resolver->max_threads = threads > 0 ? threads : RESOLVER_DEFAULT_THREADS;
+    resolver->ttl = RESOLVER_DEFAULT_TTL;
+    resolver->negative_ttl = RESOLVER_DEFAULT_NEGATIVE_TTL;
+
+    return resolver;
+}
+
+void resolver_free(resolver_t *resolver)
+{
+    dns_entry_t *e, *next;
+
+    if (!resolver)
+        return;
+
+    /* Threads finish lookups they have started */
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopping = true;
+    pthread_cond_broadcast(&resolver->jobs_ready);
+    pthread_mutex_unlock(&resolver->lock);
+
+    for (int i = 0; i < resolver->threads_count; ++i)
+        pthread_join(resolver->threads[i], NULL);
+    free(resolver->threads);
+
+    while (resolver->channels)
+        resolver_detach(resolver, resolver->channels->loop);
+
+    for (int i = 0; i < RESOLVER_BUCKETS; ++i) {
+        for (e = resolver->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            while (e->waiters) {
+                dns_waiter_t *w = e->waiters;
+                e->waiters = w->next;
+                free(w);
+            }
+            dns_addrs_release(e->addrs);
+            free(e->host);
+            free(e->port);
+            free(e);
+        }
+    }
+
+    while (resolver->hosts) {
+        dns_host_t *h = resolver->hosts;
+        resolver->hosts = h->next;
+        free(h->name);
+        free(h);
+    }
+
+    pthread_cond_destroy(&resolver->resolved);
+    pthread_cond_destroy(&resolver->jobs_ready);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver);
+}
+
+static void create_default()
+{
+    default_resolver = resolver_create(RESOLVER_DEFAULT_THREADS, NULL);
+}
+
+/* Process wide resolver used by init_connection */
+resolver_t * resolver_default()
+{
+    pthread_once(&default_once, create_default);
+
+    return default_resolver;
+}
+
+void resolver_free_default()
+{
+    resolver_free(default_resolver);
+    default_resolver = NULL;
+}
+
+void resolver_set_ttl(resolver_t *resolver, int ttl, int negative_ttl)
+{
+    pthread_mutex_lock(&resolver->lock);
+    if (ttl >= 0)
+        resolver->ttl = ttl;
+    if (negative_ttl >= 0)
+        resolver->negative_ttl = negative_ttl;
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+/* Name is resolved to ip without DNS, several ips may be added for one name */
+int resolver_add_host(resolver_t *resolver, const char *name, const char *ip)
+{
+    dns_host_t *h, **tail;
+
+    h = (dns_host_t *)calloc(1, sizeof(dns_host_t));
+    if (!h)
+        return RESOLVER_BAD_ALLOC;
+
+    if (inet_pton(AF_INET, ip, &h->addr.v4) == 1)
+        h->family = AF_INET;
+    else if (inet_pton(AF_INET6, ip, &h->addr.v6) == 1)
+        h->family = AF_INET6;
+    else {
+        free(h);
+        return RESOLVER_HOSTS_ERROR;
+    }
+
+    h->name = strdup(name);
+    if (!h->name) {
+        free(h);
+        return RESOLVER_BAD_ALLOC;
+    }
+
+    /* Keep order of file, the first address is tried first */
+    pthread_mutex_lock(&resolver->lock);
+    for (tail = &resolver->hosts; *tail != NULL; tail = &(*tail)->next)
+        ;
+    *tail = h;
+    pthread_mutex_unlock(&resolver->lock);
+
+    return RESOLVER_NO_ERROR;
+}
+
+/* Lines of /etc/hosts format: ip name [aliases...] [# comment] */
+int resolver_load_hosts(resolver_t *resolver, const char *path)
+{
+    char line[512], *ip, *name, *save;
+    int status = RESOLVER_NO_ERROR;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror("Failed to open hosts file");
+        return RESOLVER_HOSTS_ERROR;
+    }
+
+    while (status == RESOLVER_NO_ERROR && fgets(line, sizeof line, f)) {
+        line[strcspn(line, "#\n")] = '\0';
+
+        ip = strtok_r(line, " \t", &save);
+        if (!ip)
+            continue;
+
+        while (status == RESOLVER_NO_ERROR && (name = strtok_r(NULL, " \t", &save)))
+            status = resolver_add_host(resolver, name, ip);
+    }
+
+    fclose(f);
+
+    return status;
+}
+
+dns_addrs_t * dns_addrs_ref(dns_addrs_t *addrs)
+{
+    if (addrs)
+        __atomic_add_fetch(&addrs->refs, 1, __ATOMIC_RELAXED);
+
+    return addrs;
+}
+
+void dns_addrs_release(dns_addrs_t *addrs)
+{
+    struct addrinfo *ai, *next;
+
+    if (!addrs || __atomic_sub_fetch(&addrs->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (addrs->stub) {
+        for (ai = addrs->list; ai != NULL; ai = next) {
+            next = ai->ai_next;
+            free(ai);
+        }
+    }
+    else if (addrs->list) {
+        freeaddrinfo(addrs->list);
+    }
+
+    free(addrs);
+}
+
+/* Addresses of hosts table, list node and its sockaddr are one allocation.
+ * Called under lock. Returns NULL if host isn't in table */
+static struct addrinfo * lookup_hosts(resolver_t *resolver, const char *host, const char *port)
+{
+    struct addrinfo *list = NULL, **tail = &list, *ai;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    char *end;
+    long number = strtol(port, &end, 10);
+
+    if (*end != '\0' || number <= 0 || number > UINT16_MAX)
+        return NULL;
+
+    for (dns_host_t *h = resolver->hosts; h != NULL; h = h->next) {
+        if (strcasecmp(h->name, host) != 0)
+            continue;
+
+        ai = (struct addrinfo *)calloc(1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in6));
+        if (!ai)
+            break;
+
+        ai->ai_family = h->family;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_protocol = IPPROTO_TCP;
+        ai->ai_addr = (struct sockaddr *)(ai + 1);
+
+        if (h->family == AF_INET) {
+            sin = (struct sockaddr_in *)ai->ai_addr;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(number);
+            sin->sin_addr = h->addr.v4;
+            ai->ai_addrlen = sizeof(struct sockaddr_in);
+        }
+        else {
+            sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(number);
+            sin6->sin6_addr = h->addr.v6;
+            ai->ai_addrlen = sizeof(struct sockaddr_in6);
+        }
+
+        *tail = ai;
+        tail = &ai->ai_next;
+    }
+
+    return list;
+}
+
+/* Resolve host without lock held. Returns error code */
+static int resolve(resolver_t *resolver, const char *host, const char *port, dns_addrs_t **result)
+{
+    struct addrinfo hints, *list = NULL;
+    dns_addrs_t *addrs;
+    bool stub;
+    int status;
+
+    *result = NULL;
+
+    addrs = (dns_addrs_t *)calloc(1, sizeof(dns_addrs_t));
+    if (!addrs)
+        return RESOLVER_BAD_ALLOC;
+
+    pthread_mutex_lock(&resolver->lock);
+    list = lookup_hosts(resolver, host, port);
+    pthread_mutex_unlock(&resolver->lock);
+    stub = list != NULL;
+
+    if (!stub) {
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ((status = getaddrinfo(host, port, &hints, &list)) != 0) {
+            LOG_E("getaddrinfo error: %s", gai_strerror(status));
+            free(addrs);
+            return RESOLVER_NOT_FOUND;
+        }
+    }
+
+    addrs->list = list;
+    addrs->stub = stub;
+    addrs->refs = 1;
+    *result = addrs;
+
+    return RESOLVER_NO_ERROR;
+}
+
+static unsigned hash_key(const char *host, const char *port)
+{
+    unsigned hash = 2166136261u;
+
+    for (const char *p = host; *p; ++p)
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*p)) * 16777619u;
+    for (const char *p = port; *p; ++p)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    return hash % RESOLVER_BUCKETS;
+}
+
+/* Find or add cache entry. Called under lock */
+static dns_entry_t * get_entry(resolver_t *resolver, const char *host, const char *port)
+{
+    unsigned bucket = hash_key(host, port);
+    dns_entry_t *e;
+
+    for (e = resolver->buckets[bucket]; e != NULL; e = e->next) {
+        if (strcasecmp(e->host, host) == 0 && strcmp(e->port, port) == 0)
+            return e;
+    }
+
+    e = (dns_entry_t *)calloc(1, sizeof(dns_entry_t));
+    if (!e)
+        return NULL;
+
+    e->host = strdup(host);
+    e->port = strdup(port);
+    if (!e->host || !e->port) {
+        free(e->host);
+        free(e->port);
+        free(e);
+        return NULL;
+    }
+
+    e->next = resolver->buckets[bucket];
+    resolver->buckets[bucket] = e;
+
+    return e;
+}
+
+static bool entry_fresh(dns_entry_t *e, time_t now)
+{
+    return !e->resolving && (e->addrs || e->error) && now < e->expires;
+}
+
+static void notify_channel(dns_channel_t *channel)
+{
+    uint64_t one = 1;
+
+    if (write(channel->fd, &one, sizeof one) < 0 && errno != EAGAIN)
+        perror("Failed to wake event loop");
+}
+
+/* Store result and pass it to waiters. Called under lock */
+static void complete_entry(resolver_t *resolver, dns_entry_t *e, dns_addrs_t *addrs, int error)
+{
+    dns_waiter_t *w;
+    dns_channel_t *channel;
+
+    dns_addrs_release(e->addrs);
+    e->addrs = addrs;
+    e->error = error;
+    e->expires = time(NULL) + (addrs ? resolver->ttl : resolver->negative_ttl);
+    e->resolving = false;
+
+    while ((w = e->waiters) != NULL) {
+        e->waiters = w->next;
+        w->error = error;
+
+        for (channel = resolver->channels; channel != NULL; channel = channel->next) {
+            if (channel->loop == w->loop)
+                break;
+        }
+
+        /* Loop has been detached */
+        if (!channel) {
+            free(w);
+            continue;
+        }
+
+        w->next = channel->ready;
+        channel->ready = w;
+        notify_channel(channel);
+    }
+
+    pthread_cond_broadcast(&resolver->resolved);
+}
+
+static void * resolver_worker(void *arg)
+{
+    resolver_t *resolver = (resolver_t *)arg;
+    dns_entry_t *e;
+    dns_addrs_t *addrs;
+    int error;
+
+    pthread_mutex_lock(&resolver->lock);
+
+    while (1) {
+        while (!resolver->jobs && !resolver->stopping)
+            pthread_cond_wait(&resolver->jobs_ready, &resolver->lock);
+
+        if (resolver->stopping)
+            break;
+
+        e = resolver->jobs;
+        resolver->jobs = e->next_job;
+        if (!resolver->jobs)
+            resolver->jobs_tail = NULL;
+
+        /* Entries aren't removed, host and port stay valid without lock */
+        pthread_mutex_unlock(&resolver->lock);
+        error = resolve(resolver, e->host, e->port, &addrs);
+        pthread_mutex_lock(&resolver->lock);
+
+        complete_entry(resolver, e, addrs, error);
+    }
+
+    pthread_mutex_unlock(&resolver->lock);
+
+    return NULL;
+}
+
+/* Threads are started with the first asynchronous lookup. Called under lock */
+static int start_threads(resolver_t *resolver)
+{
+    if (resolver->threads)
+        return RESOLVER_NO_ERROR;
+
+    resolver->threads = (pthread_t *)calloc(resolver->max_threads, sizeof(pthread_t));
+    if (!resolver->threads)
+        return RESOLVER_BAD_ALLOC;
+
+    for (int i = 0; i < resolver->max_threads; ++i) {
+        if (pthread_create(&resolver->threads[i], NULL, resolver_worker, resolver) != 0)
+            break;
+        resolver->threads_count++;
+    }
+
+    return resolver->threads_count ? RESOLVER_NO_ERROR : RESOLVER_THREAD_ERROR;
+}
+
+/* Results for event loop are delivered by its own thread */
+static void channel_ready(void *context)
+{
+    dns_channel_t *channel = (dns_channel_t *)context;
+    resolver_t *resolver = channel->resolver;
+    dns_waiter_t *ready, *next;
+    uint64_t value;
+
+    if (read(channel->fd, &value, sizeof value) < 0 && errno != EAGAIN)
+        perror("Failed to read eventfd");
+
+    pthread_mutex_lock(&resolver->lock);
+    ready = channel->ready;
+    channel->ready = NULL;
+    pthread_mutex_unlock(&resolver->lock);
+
+    for (; ready != NULL; ready = next) {
+        next = ready->next;
+        ready->loop->active--;
+        ready->process_resolved(ready->context, ready->error);
+        free(ready);
+    }
+}
+
+/* Called under lock */
+static dns_channel_t * get_channel(resolver_t *resolver, event_loop_t *loop)
+{
+    dns_channel_t *channel;
+
+    for (channel = resolver->channels; channel != NULL; channel = channel->next) {
+        if (channel->loop == loop)
+            return channel;
+    }
+
+    channel = (dns_channel_t *)calloc(1, sizeof(dns_channel_t));
+    if (!channel)
+        return NULL;
+
+    channel->resolver = resolver;
+    channel->loop = loop;
+    channel->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->fd < 0 || event_loop_watch(loop, channel->fd, channel_ready, channel) != 0) {
+        if (channel->fd >= 0)
+            close(channel->fd);
+        free(channel);
+        return NULL;
+    }
+
+    channel->next = resolver->channels;
+    resolver->channels = channel;
+
+    return channel;
+}
+
+/* Return cached addresses or resolve host in caller thread */
+dns_addrs_t * resolver_lookup(resolver_t *resolver, const char *host, const char *port, int *error)
+{
+    dns_entry_t *e;
+    dns_addrs_t *addrs = NULL;
+    int error_code;
+
+    pthread_mutex_lock(&resolver->lock);
+
+    e = get_entry(resolver, host, port);
+    if (!e) {
+        error_code = RESOLVER_BAD_ALLOC;
+        goto exit;
+    }
+
+    /* Somebody is resolving it already */
+    while (e->resolving)
+        pthread_cond_wait(&resolver->resolved, &resolver->lock);
+
+    if (!entry_fresh(e, time(NULL))) {
+        e->resolving = true;
+        pthread_mutex_unlock(&resolver->lock);
+        error_code = resolve(resolver, host, port, &addrs);
+        pthread_mutex_lock(&resolver->lock);
+        complete_entry(resolver, e, addrs, error_code);
+    }
+
+    error_code = e->error;
+    addrs = dns_addrs_ref(e->addrs);
+
+exit:
+    pthread_mutex_unlock(&resolver->lock);
+
+    if (error)
+        *error = error_code;
+
+    return addrs;
+}
+
+/* Return cached addresses, otherwise start lookup in resolver thread and
+ * return NULL with RESOLVER_PENDING. process_resolved is called once from
+ * loop thread when lookup is over, loop keeps running until that */
+dns_addrs_t * resolver_lookup_async(resolver_t *resolver, const char *host, const char *port,
+                                    event_loop_t *loop, resolve_cb process_resolved,
+                                    void *context, int *error)
+{
+    dns_entry_t *e;
+    dns_waiter_t *w;
+    dns_addrs_t *addrs = NULL;
+    int error_code = RESOLVER_NO_ERROR;
+
+    pthread_mutex_lock(&resolver->lock);
+
+    e = get_entry(resolver, host, port);
+    if (!e) {
+        error_code = RESOLVER_BAD_ALLOC;
+        goto exit;
+    }
+
+    if (entry_fresh(e, time(NULL))) {
+        error_code = e->error;
+        addrs = dns_addrs_ref(e->addrs);
+        goto exit;
+    }
+
+    /* Several transfers to one host wait for it with the same callback */
+    for (w = e->waiters; w != NULL; w = w->next) {
+        if (w->loop == loop && w->process_resolved == process_resolved && w->context == context) {
+            error_code = RESOLVER_PENDING;
+            goto exit;
+        }
+    }
+
+    if (!get_channel(resolver, loop) || !(w = (dns_waiter_t *)calloc(1, sizeof(dns_waiter_t)))) {
+        error_code = RESOLVER_BAD_ALLOC;
+        goto exit;
+    }
+
+    if (!e->resolving) {
+        error_code = start_threads(resolver);
+        if (error_code) {
+            free(w);
+            goto exit;
+        }
+
+        e->resolving = true;
+        e->next_job = NULL;
+        if (resolver->jobs_tail)
+            resolver->jobs_tail->next_job = e;
+        else
+            resolver->jobs = e;
+        resolver->jobs_tail = e;
+        pthread_cond_signal(&resolver->jobs_ready);
+    }
+
+    w->loop = loop;
+    w->process_resolved = process_resolved;
+    w->context = context;
+    w->next = e->waiters;
+    e->waiters = w;
+    loop->active++;
+
+    error_code = RESOLVER_PENDING;
+
+exit:
+    pthread_mutex_unlock(&resolver->lock);
+
+    if (error)
+        *error = error_code;
+
+    return addrs;
+}
+
+/* Loop is going to be freed, results for it aren't delivered anymore */
+void resolver_detach(resolver_t *resolver, event_loop_t *loop)
+{
+    dns_channel_t **p, *channel = NULL;
+    dns_waiter_t **pw, *w, *next;
+
+    pthread_mutex_lock(&resolver->lock);
+    for (p = &resolver->channels; *p != NULL; p = &(*p)->next) {
+        if ((*p)->loop == loop) {
+            channel = *p;
+            *p = channel->next;
+            break;
+        }
+    }
+
+    /* Waiters are matched to channels by loop, another loop may get the
+     * same address later */
+    for (int i = 0; i < RESOLVER_BUCKETS; ++i) {
+        for (dns_entry_t *e = resolver->buckets[i]; e != NULL; e = e->next) {
+            for (pw = &e->waiters; (w = *pw) != NULL; ) {
+                if (w->loop == loop) {
+                    *pw = w->next;
+                    free(w);
+                }
+                else {
+                    pw = &w->next;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    if (!channel)
+        return;
+
+    for (w = channel->ready; w != NULL; w = next) {
+        next = w->next;
+        free(w);
+    }
+
+    event_loop_unwatch(loop, channel->fd);
+    close(channel->fd);
+    free(channel);
+}
+
+void print_resolver_error(int error)
+{
+    if ((size_t)error >= sizeof(resolver_errors)/sizeof(resolver_errors[0])) {
+        LOG_E("Wrong error number");
+        return;
+    }
+
+    LOG_E("Resolver problem: %s", resolver_errors[error]);
+}
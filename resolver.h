@@ -0,0 +1,111 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <ctime>
+
+#include <pthread.h>
+#include <netdb.h>
+
+struct event_loop;
+
+#define RESOLVER_DEFAULT_TTL            60
+#define RESOLVER_DEFAULT_NEGATIVE_TTL   5
+#define RESOLVER_DEFAULT_THREADS        4
+#define RESOLVER_BUCKETS                64
+
+#define RESOLVER_NO_ERROR       0
+#define RESOLVER_NOT_FOUND      1
+#define RESOLVER_PENDING        2
+#define RESOLVER_BAD_ALLOC      3
+#define RESOLVER_THREAD_ERROR   4
+#define RESOLVER_HOSTS_ERROR    5
+
+/* Addresses of host:port shared by cache and connections */
+typedef struct dns_addrs {
+    struct addrinfo *list;
+    bool    stub;       /* Built from hosts table, not by getaddrinfo */
+    int     refs;
+} dns_addrs_t;
+
+/* Called in event loop thread when asynchronous lookup is over */
+typedef void (*resolve_cb)(void *context, int error);
+
+typedef struct dns_waiter {
+    struct event_loop   *loop;
+    resolve_cb          process_resolved;
+    void                *context;
+    int                 error;
+    struct dns_waiter   *next;
+} dns_waiter_t;
+
+typedef struct dns_entry {
+    char        *host;
+    char        *port;
+    dns_addrs_t *addrs;     /* NULL if host wasn't found */
+    int         error;
+    time_t      expires;
+    bool        resolving;
+    dns_waiter_t *waiters;
+    struct dns_entry *next;
+    struct dns_entry *next_job;
+} dns_entry_t;
+
+/* Completed lookups are passed to event loop thread through eventfd */
+typedef struct dns_channel {
+    struct resolver     *resolver;
+    struct event_loop   *loop;
+    int                 fd;
+    dns_waiter_t        *ready;
+    struct dns_channel  *next;
+} dns_channel_t;
+
+/* Static name of hosts file format, resolved without DNS */
+typedef struct dns_host {
+    char    *name;
+    int     family;
+    union {
+        struct in_addr  v4;
+        struct in6_addr v6;
+    } addr;
+    struct dns_host *next;
+} dns_host_t;
+
+/* Cache of resolved addresses keyed by host:port. Lookups which miss it run
+ * getaddrinfo in caller thread or, for event loops, in resolver threads */
+typedef struct resolver {
+    pthread_mutex_t lock;
+    pthread_cond_t  jobs_ready;
+    pthread_cond_t  resolved;
+
+    dns_entry_t     *buckets[RESOLVER_BUCKETS];
+    dns_entry_t     *jobs;
+    dns_entry_t     *jobs_tail;
+    dns_channel_t   *channels;
+    dns_host_t      *hosts;
+
+    pthread_t       *threads;
+    int             threads_count;
+    int             max_threads;
+    bool            stopping;
+
+    int             ttl;            /* Seconds, getaddrinfo doesn't tell record TTL */
+    int             negative_ttl;
+} resolver_t;
+
+resolver_t * resolver_create(int threads, int *error);
+void resolver_free(resolver_t *resolver);
+resolver_t * resolver_default();
+void resolver_free_default();
+void resolver_set_ttl(resolver_t *resolver, int ttl, int negative_ttl);
+int resolver_add_host(resolver_t *resolver, const char *name, const char *ip);
+int resolver_load_hosts(resolver_t *resolver, const char *path);
+dns_addrs_t * resolver_lookup(resolver_t *resolver, const char *host, const char *port, int *error);
+dns_addrs_t * resolver_lookup_async(resolver_t *resolver, const char *host, const char *port,
+                                    struct event_loop *loop, resolve_cb process_resolved,
+                                    void *context, int *error);
+void resolver_detach(resolver_t *resolver, struct event_loop *loop);
+dns_addrs_t * dns_addrs_ref(dns_addrs_t *addrs);
+void dns_addrs_release(dns_addrs_t *addrs);
+void print_resolver_error(int error);
+
+#endif // RESOLVER_H
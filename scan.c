@@ -0,0 +1,183 @@
+#include "scan.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char * (*scan_char_fn)(const char *, const char *, char);
+typedef const char * (*scan_chars2_fn)(const char *, const char *, char, char);
+
+static const char *impl_names[] = { "scalar", "sse2", "avx2" };
+
+static const char * scan_char_scalar(const char *p, const char *end, char c)
+{
+    while (p < end && *p != c)
+        p++;
+
+    return p;
+}
+
+static const char * scan_chars2_scalar(const char *p, const char *end, char a, char b)
+{
+    while (p < end && *p != a && *p != b)
+        p++;
+
+    return p;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const char * scan_char_sse2(const char *p, const char *end, char c)
+{
+    __m128i v = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, v));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return scan_char_scalar(p, end, c);
+}
+
+__attribute__((target("sse2")))
+static const char * scan_chars2_sse2(const char *p, const char *end, char a, char b)
+{
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)p);
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(data, va), _mm_cmpeq_epi8(data, vb));
+        unsigned mask = _mm_movemask_epi8(eq);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return scan_chars2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_char_avx2(const char *p, const char *end, char c)
+{
+    __m256i v = _mm256_set1_epi8(c);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(data, v));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return scan_char_sse2(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char * scan_chars2_avx2(const char *p, const char *end, char a, char b)
+{
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+
+    for (; end - p >= 32; p += 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)p);
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(data, va), _mm256_cmpeq_epi8(data, vb));
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return scan_chars2_sse2(p, end, a, b);
+}
+#endif
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static enum scan_impl current_impl;
+static scan_char_fn char_fn;
+static scan_chars2_fn chars2_fn;
+
+static bool impl_supported(enum scan_impl impl)
+{
+    switch (impl) {
+    case SCAN_SCALAR:
+        return true;
+#ifdef SCAN_X86
+    case SCAN_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SCAN_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+static void use_impl(enum scan_impl impl)
+{
+    switch (impl) {
+#ifdef SCAN_X86
+    case SCAN_AVX2:
+        char_fn = scan_char_avx2;
+        chars2_fn = scan_chars2_avx2;
+        break;
+    case SCAN_SSE2:
+        char_fn = scan_char_sse2;
+        chars2_fn = scan_chars2_sse2;
+        break;
+#endif
+    default:
+        char_fn = scan_char_scalar;
+        chars2_fn = scan_chars2_scalar;
+        break;
+    }
+
+    current_impl = impl;
+}
+
+/* Pick the widest vectors CPU supports, once for all threads */
+static void init_scan(void)
+{
+    if (impl_supported(SCAN_AVX2))
+        use_impl(SCAN_AVX2);
+    else if (impl_supported(SCAN_SSE2))
+        use_impl(SCAN_SSE2);
+    else
+        use_impl(SCAN_SCALAR);
+}
+
+/* Not synchronised with running scans, call before any is started */
+bool scan_set_impl(enum scan_impl impl)
+{
+    pthread_once(&init_once, init_scan);
+
+    if (!impl_supported(impl))
+        return false;
+
+    use_impl(impl);
+
+    return true;
+}
+
+const char * scan_char(const char *begin, const char *end, char c)
+{
+    pthread_once(&init_once, init_scan);
+
+    return char_fn(begin, end, c);
+}
+
+const char * scan_chars2(const char *begin, const char *end, char a, char b)
+{
+    pthread_once(&init_once, init_scan);
+
+    return chars2_fn(begin, end, a, b);
+}
+
+const char * scan_impl_name(void)
+{
+    pthread_once(&init_once, init_scan);
+
+    return impl_names[current_impl];
+}
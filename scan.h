@@ -0,0 +1,22 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/* Search of delimiters in HTTP data 16 or 32 bytes at a time. The fastest
+ * implementation supported by CPU is chosen on first call */
+
+enum scan_impl {
+    SCAN_SCALAR = 0,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+/* Both return end if nothing has been found */
+const char * scan_char(const char *begin, const char *end, char c);
+const char * scan_chars2(const char *begin, const char *end, char a, char b);
+
+/* Switch implementation, for benchmarks. Call before any scan runs,
+ * returns false if CPU lacks it */
+bool scan_set_impl(enum scan_impl impl);
+const char * scan_impl_name(void);
+
+#endif // SCAN_H
@@ -0,0 +1,417 @@
+#include "segment.h"
+
+#include "http.h"
+#include "log.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Don't split ranges smaller than that, new connection costs more */
+#define MIN_STEAL_SIZE      (256*1024)
+/* Attempts to continue a segment which makes no progress */
+#define MAX_RETRIES         3
+
+typedef struct segment {
+    size_t  begin;      /* Next byte to be written */
+    size_t  end;        /* One past the last byte, shrinks when tail is stolen */
+    size_t  first;      /* Start of range, segment continues from here after steal */
+    size_t  written;    /* Bytes [first, written) are in file */
+    digest_t digest;    /* Of [first, written) if digests can be combined */
+} segment_t;
+
+/* Digest of range which has been written completely */
+typedef struct range_digest {
+    size_t      first;
+    digest_t    digest;
+} range_digest_t;
+
+typedef struct download {
+    connection_t    *conn;
+    url_t           *url;
+    int             fd;
+    size_t          content_length;
+    size_t          written_bytes;
+    bool            failed;
+
+    pthread_mutex_t lock;
+    segment_t       *segments;
+    int             segments_count;
+
+    /* Digest of file. CRC is computed per range and ranges are combined
+     * at the end. Others are computed in order up to frontier, bytes which
+     * are written ahead of it are read back from page cache later */
+    digest_t        digest;
+    bool            combine;
+    range_digest_t  *ranges;
+    int             ranges_count;
+    size_t          frontier;
+    bool            hashing;
+} download_t;
+
+typedef struct worker {
+    download_t      *download;
+    int             index;
+    pthread_t       thread;
+} worker_t;
+
+static void print_segments_progress(download_t *d)
+{
+    int progress = (float)d->written_bytes/d->content_length * 100;
+    fprintf(stdout, "\rProgress: %d %%", progress);
+    fflush(stdout);
+}
+
+/* Keep digest of finished range of segment. Called under lock */
+static int finish_range(download_t *d, segment_t *s)
+{
+    range_digest_t *ranges;
+
+    if (!d->combine || s->written == s->first)
+        return 0;
+
+    ranges = (range_digest_t *)realloc(d->ranges, (d->ranges_count + 1) * sizeof(range_digest_t));
+    if (ranges == NULL)
+        return -1;
+
+    d->ranges = ranges;
+    d->ranges[d->ranges_count].first = s->first;
+    d->ranges[d->ranges_count].digest = s->digest;
+    d->ranges_count++;
+
+    return 0;
+}
+
+/* Take the second half of the largest unfinished segment. Called under lock */
+static bool steal_segment(download_t *d, int index)
+{
+    segment_t *victim = NULL;
+    size_t remaining = 0, middle;
+
+    for (int i = 0; i < d->segments_count; ++i) {
+        segment_t *s = &d->segments[i];
+        if (s->end > s->begin && s->end - s->begin > remaining) {
+            remaining = s->end - s->begin;
+            victim = s;
+        }
+    }
+
+    if (victim == NULL || remaining < 2*MIN_STEAL_SIZE)
+        return false;
+
+    middle = victim->begin + remaining/2;
+
+    if (finish_range(d, &d->segments[index]) != 0)
+        return false;
+
+    d->segments[index].begin = middle;
+    d->segments[index].end = victim->end;
+    d->segments[index].first = middle;
+    d->segments[index].written = middle;
+    digest_init(&d->segments[index].digest, d->digest.algorithm);
+    victim->end = middle;
+
+    LOG_D("Segment %d took [%zu, %zu)", index, middle, d->segments[index].end);
+
+    return true;
+}
+
+/* End of bytes written in a row from offset. Called under lock */
+static size_t written_end(download_t *d, size_t offset)
+{
+    size_t end = d->content_length;
+
+    for (int i = 0; i < d->segments_count; ++i) {
+        segment_t *s = &d->segments[i];
+        if (s->first <= offset && offset < s->end)
+            return s->written;
+        if (s->first > offset && s->first < end)
+            end = s->first;
+    }
+
+    /* Range of no segment has been finished before steal */
+    return end;
+}
+
+/* Hash file in order as far as it's written. One worker at a time does it,
+ * data it has just written is taken from memory, the rest is read back.
+ * Called under lock */
+static void advance_frontier(download_t *d, const char *data, size_t offset, size_t len)
+{
+    size_t from, end;
+    int status = 0;
+
+    if (d->combine || d->digest.algorithm == DIGEST_NONE || d->hashing)
+        return;
+    d->hashing = true;
+
+    while (status == 0 && (end = written_end(d, d->frontier)) > d->frontier) {
+        from = d->frontier;
+        pthread_mutex_unlock(&d->lock);
+
+        if (data && from >= offset && from < offset + len) {
+            end = end < offset + len ? end : offset + len;
+            digest_update(&d->digest, data + (from - offset), end - from);
+        }
+        else {
+            if (data && from < offset && end > offset)
+                end = offset;
+            status = digest_read(&d->digest, d->fd, from, end - from);
+        }
+
+        pthread_mutex_lock(&d->lock);
+        d->frontier = end;
+    }
+
+    if (status != 0) {
+        LOG_E("Failed to read back file for digest");
+        d->failed = true;
+    }
+    d->hashing = false;
+}
+
+static int write_segment(void *context, const char *data, size_t bytes)
+{
+    worker_t *worker = (worker_t *)context;
+    download_t *d = worker->download;
+    segment_t *s = &d->segments[worker->index];
+    size_t offset;
+    ssize_t n;
+    bool done;
+
+    /* Claim bytes before writing, so thief sees actual position */
+    pthread_mutex_lock(&d->lock);
+    offset = s->begin;
+    if (offset + bytes > s->end)
+        bytes = s->end > offset ? s->end - offset : 0;
+    s->begin += bytes;
+    done = s->begin >= s->end;
+    pthread_mutex_unlock(&d->lock);
+
+    while (bytes > 0) {
+        n = pwrite(d->fd, data, bytes, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write file");
+            pthread_mutex_lock(&d->lock);
+            d->failed = true;
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+
+        if (d->combine)
+            digest_update(&s->digest, data, n);
+
+        pthread_mutex_lock(&d->lock);
+        d->written_bytes += n;
+        s->written = offset + n;
+        print_segments_progress(d);
+        advance_frontier(d, data, offset, n);
+        pthread_mutex_unlock(&d->lock);
+
+        data += n;
+        offset += n;
+        bytes -= n;
+    }
+
+    return done;
+}
+
+static void * segment_worker(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    download_t *d = worker->download;
+    segment_t *s = &d->segments[worker->index];
+    connection_t *conn = NULL;
+    size_t first, last, before;
+    int error = 0, retries = 0;
+
+    conn = dup_connection(d->conn, &error);
+    if (conn == NULL) {
+        print_connection_error(error);
+        goto err;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&d->lock);
+        if (d->failed || (s->begin >= s->end && !steal_segment(d, worker->index))) {
+            pthread_mutex_unlock(&d->lock);
+            break;
+        }
+        first = before = s->begin;
+        last = s->end - 1;
+        pthread_mutex_unlock(&d->lock);
+
+        http_get_range(conn, d->url, first, last, write_segment, worker);
+
+        /* Request failed or connection was dropped, retry the rest */
+        pthread_mutex_lock(&d->lock);
+        if (s->begin < s->end) {
+            retries = (s->begin == before) ? retries + 1 : 0;
+            if (retries >= MAX_RETRIES) {
+                LOG_E("Failed to download bytes %zu-%zu", s->begin, s->end - 1);
+                d->failed = true;
+            }
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    free_connection(conn);
+
+    return NULL;
+
+err:
+    pthread_mutex_lock(&d->lock);
+    d->failed = true;
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    size_t first_a = ((const range_digest_t *)a)->first;
+    size_t first_b = ((const range_digest_t *)b)->first;
+
+    return first_a < first_b ? -1 : first_a > first_b;
+}
+
+/* Complete digest of file once workers are over. Returns -1 if some
+ * bytes haven't been hashed */
+static int finish_digest(download_t *d)
+{
+    if (d->digest.algorithm == DIGEST_NONE)
+        return 0;
+
+    if (!d->combine) {
+        pthread_mutex_lock(&d->lock);
+        advance_frontier(d, NULL, 0, 0);
+        pthread_mutex_unlock(&d->lock);
+        return d->frontier == d->content_length ? 0 : -1;
+    }
+
+    for (int i = 0; i < d->segments_count; ++i) {
+        if (finish_range(d, &d->segments[i]) != 0)
+            return -1;
+    }
+
+    /* Ranges must cover file without gaps */
+    qsort(d->ranges, d->ranges_count, sizeof(range_digest_t), compare_ranges);
+    for (int i = 0; i < d->ranges_count; ++i) {
+        if (d->ranges[i].first != d->digest.length ||
+            digest_combine(&d->digest, &d->ranges[i].digest) != 0)
+            return -1;
+    }
+
+    return d->digest.length == d->content_length ? 0 : -1;
+}
+
+int segmented_download(connection_t *conn, url_t *url, int segments)
+{
+    download_t d;
+    worker_t *workers = NULL;
+    digest_value_t announced;
+    size_t content_length = 0;
+    bool accept_ranges = false;
+    int started = 0;
+
+    if (conn == NULL || url == NULL)
+        return -1;
+
+    memset(&d, 0, sizeof d);
+    d.fd = -1;
+
+    if (http_probe(conn, url, &content_length, &accept_ranges, &announced) != 0 ||
+            !accept_ranges || content_length < (size_t)segments*MIN_STEAL_SIZE) {
+        LOG_I("Segmented download isn't possible, using single connection");
+        return http_make_request(conn, url);
+    }
+
+    d.conn = conn;
+    d.url = url;
+    d.content_length = content_length;
+    d.segments_count = segments;
+    d.combine = digest_combinable(digest_check()->algorithm);
+    digest_init(&d.digest, digest_check()->algorithm);
+    pthread_mutex_init(&d.lock, NULL);
+
+    d.segments = (segment_t *)calloc(segments, sizeof(segment_t));
+    workers = (worker_t *)calloc(segments, sizeof(worker_t));
+    if (d.segments == NULL || workers == NULL)
+        goto err;
+
+    /* Digest may need to read back what has been written */
+    d.fd = open(url->file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (d.fd < 0) {
+        perror("Failed to open file");
+        goto err;
+    }
+
+    if (ftruncate(d.fd, content_length) != 0) {
+        perror("Failed to resize file");
+        goto err;
+    }
+
+    for (int i = 0; i < segments; ++i) {
+        d.segments[i].begin = content_length / segments * i;
+        d.segments[i].end = (i == segments - 1) ?
+            content_length : content_length / segments * (i + 1);
+        d.segments[i].first = d.segments[i].written = d.segments[i].begin;
+        digest_init(&d.segments[i].digest, d.digest.algorithm);
+    }
+
+    for (started = 0; started < segments; ++started) {
+        workers[started].download = &d;
+        workers[started].index = started;
+        if (pthread_create(&workers[started].thread, NULL, segment_worker, &workers[started]) != 0) {
+            LOG_E("Failed to start thread");
+            pthread_mutex_lock(&d.lock);
+            d.failed = true;
+            pthread_mutex_unlock(&d.lock);
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    if (d.failed || d.written_bytes != content_length)
+        goto err;
+
+    if (finish_digest(&d) != 0) {
+        LOG_E("Digest doesn't cover whole file");
+        goto err;
+    }
+    if (d.digest.algorithm) {
+        fputc('\n', stdout);
+        if (digest_verify(&d.digest, url->file, &announced) != 0)
+            goto err;
+    }
+
+    close(d.fd);
+    free(d.ranges);
+    free(d.segments);
+    free(workers);
+    pthread_mutex_destroy(&d.lock);
+
+    LOG_I("\nRequest has been completed");
+
+    return 0;
+
+err:
+    LOG_E("Error in segmented download");
+
+    if (d.fd >= 0)
+        close(d.fd);
+    free(d.ranges);
+    free(d.segments);
+    free(workers);
+    pthread_mutex_destroy(&d.lock);
+
+    return -1;
+}
@@ -0,0 +1,11 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include "url.h"
+#include "connect.h"
+
+/* Download url over several connections, each one fetches its own byte range.
+ * Falls back to a single request if server doesn't support ranges */
+int segmented_download(connection_t *conn, url_t *url, int segments);
+
+#endif // SEGMENT_H
@@ -0,0 +1,430 @@
+#include "sink.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static const char *sink_errors[] = {
+  "No error",
+  "Failed to open file",
+  "Bad alloc",
+  "Failed to read beginning of block",
+  "Failed to start flush thread"
+};
+
+static sink_options_t defaults = { SINK_DEFAULT_BUFFER, false, SINK_SYNC_NONE };
+
+/* Options of sinks opened from now on */
+void sink_set_defaults(const sink_options_t *options)
+{
+    defaults = *options;
+    if (defaults.buffer_size < SINK_ALIGN)
+        defaults.buffer_size = SINK_DEFAULT_BUFFER;
+}
+
+bool sink_parse_sync(const char *name, enum sink_sync *sync)
+{
+    if (strcmp(name, "none") == 0)
+        *sync = SINK_SYNC_NONE;
+    else if (strcmp(name, "data") == 0)
+        *sync = SINK_SYNC_DATA;
+    else if (strcmp(name, "full") == 0)
+        *sync = SINK_SYNC_FULL;
+    else
+        return false;
+
+    return true;
+}
+
+static size_t align_up(size_t size)
+{
+    return (size + SINK_ALIGN - 1) & ~(size_t)(SINK_ALIGN - 1);
+}
+
+static int write_at(int fd, const char *data, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/* Unaligned tail can't be written with O_DIRECT */
+static int set_direct(file_sink_t *sink, bool direct)
+{
+    int flags = fcntl(sink->fd, F_GETFL);
+
+    if (flags < 0)
+        return -1;
+
+    return fcntl(sink->fd, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
+
+static void * flush_thread(void *arg)
+{
+    file_sink_t *sink = (file_sink_t *)arg;
+    const char *data;
+    size_t len;
+    off_t offset;
+    int result;
+
+    pthread_mutex_lock(&sink->lock);
+    while (1) {
+        while (!sink->flushing && !sink->stop)
+            pthread_cond_wait(&sink->cond, &sink->lock);
+        if (!sink->flushing)
+            break;
+
+        data = sink->flush_data;
+        len = sink->flush_len;
+        offset = sink->flush_offset;
+        pthread_mutex_unlock(&sink->lock);
+
+        result = write_at(sink->fd, data, len, offset);
+
+        pthread_mutex_lock(&sink->lock);
+        if (result != 0 && sink->error == 0)
+            sink->error = errno;
+        sink->flushing = false;
+        pthread_cond_broadcast(&sink->cond);
+    }
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+/* Wait until buffer given to flush thread is written */
+static int wait_flushed(file_sink_t *sink)
+{
+    if (!sink->thread_started)
+        return sink->error ? -1 : 0;
+
+    pthread_mutex_lock(&sink->lock);
+    while (sink->flushing)
+        pthread_cond_wait(&sink->cond, &sink->lock);
+    pthread_mutex_unlock(&sink->lock);
+
+    return sink->error ? -1 : 0;
+}
+
+/* Buffer is large enough for the whole body of a small file */
+static size_t buffer_size(const file_sink_t *sink, size_t head)
+{
+    size_t size = align_up(defaults.buffer_size);
+
+    if (sink->expected && align_up(sink->expected + head) < size)
+        size = align_up(sink->expected + head);
+
+    return size;
+}
+
+static int alloc_buffers(file_sink_t *sink, size_t head)
+{
+    sink->buffer_size = buffer_size(sink, head);
+
+    for (int i = 0; i < (sink->direct ? 2 : 1); ++i) {
+        if (posix_memalign((void **)&sink->buffers[i], SINK_ALIGN, sink->buffer_size) != 0) {
+            sink->buffers[i] = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Direct writes start at block boundary, head of the first block is read
+ * from file so the block is written whole */
+static int read_head(file_sink_t *sink, off_t offset)
+{
+    size_t head = offset % SINK_ALIGN;
+    ssize_t n;
+
+    sink->buffer_offset = offset - head;
+    if (head == 0)
+        return 0;
+
+    do {
+        n = pread(sink->fd, sink->buffers[0], SINK_ALIGN, sink->buffer_offset);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < (ssize_t)head)
+        return -1;
+    sink->used = head;
+
+    return 0;
+}
+
+/* Open file to write body from offset, file is truncated if offset is 0.
+ * Expected size of the rest is preallocated if it's known and large */
+file_sink_t * sink_open(const char *path, off_t offset, size_t expected, int *error)
+{
+    int error_code = 0;
+    int flags = O_CREAT | O_CLOEXEC | (offset ? 0 : O_TRUNC);
+    file_sink_t *sink = (file_sink_t *)calloc(1, sizeof(file_sink_t));
+    if (!sink) {
+        error_code = SINK_BAD_ALLOC;
+        goto err;
+    }
+
+    sink->fd = -1;
+    sink->sync = defaults.sync;
+    sink->expected = expected;
+    sink->buffer_offset = offset;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+
+    /* File system may refuse O_DIRECT, buffered writes still work there */
+    if (defaults.direct) {
+        sink->fd = open(path, flags | O_RDWR | O_DIRECT, 0644);
+        sink->direct = sink->fd >= 0;
+        if (sink->fd < 0 && errno == EINVAL)
+            LOG_D("O_DIRECT isn't supported for %s", path);
+    }
+    if (sink->fd < 0)
+        sink->fd = open(path, flags | O_WRONLY, 0644);
+    if (sink->fd < 0) {
+        perror("Failed to open file");
+        error_code = SINK_OPEN_ERROR;
+        goto err;
+    }
+
+    /* Body which fits in buffer is written at once anyway */
+    if (expected > defaults.buffer_size && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, offset, expected) != 0)
+        LOG_D("Failed to preallocate %zu bytes: %s", expected, strerror(errno));
+
+    if (sink->direct) {
+        if (alloc_buffers(sink, offset % SINK_ALIGN) != 0) {
+            error_code = SINK_BAD_ALLOC;
+            goto err;
+        }
+        if (read_head(sink, offset) != 0) {
+            error_code = SINK_READ_ERROR;
+            goto err;
+        }
+    }
+
+    return sink;
+
+err:
+    if (error)
+        *error = error_code;
+
+    if (sink)
+        sink_close(sink);
+
+    return NULL;
+}
+
+/* Current buffer is full, in direct mode it's written by thread */
+static int write_buffer(file_sink_t *sink)
+{
+    char *data = sink->buffers[sink->current];
+
+    if (!sink->direct) {
+        if (write_at(sink->fd, data, sink->used, sink->buffer_offset) != 0) {
+            sink->error = errno;
+            return -1;
+        }
+        sink->buffer_offset += sink->used;
+        sink->used = 0;
+        return 0;
+    }
+
+    if (!sink->thread_started) {
+        if (pthread_create(&sink->thread, NULL, flush_thread, sink) != 0) {
+            print_sink_error(SINK_THREAD_ERROR);
+            sink->error = EAGAIN;
+            return -1;
+        }
+        sink->thread_started = true;
+    }
+
+    if (wait_flushed(sink) != 0)
+        return -1;
+
+    pthread_mutex_lock(&sink->lock);
+    sink->flush_data = data;
+    sink->flush_len = sink->used;
+    sink->flush_offset = sink->buffer_offset;
+    sink->flushing = true;
+    pthread_cond_signal(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+
+    sink->current ^= 1;
+    sink->buffer_offset += sink->used;
+    sink->used = 0;
+
+    return 0;
+}
+
+int sink_write(file_sink_t *sink, const char *data, size_t len)
+{
+    size_t n;
+
+    if (sink->error)
+        return -1;
+
+    if (sink->buffers[0] == NULL && alloc_buffers(sink, 0) != 0) {
+        sink->error = ENOMEM;
+        return -1;
+    }
+
+    /* Large piece of buffered sink doesn't need to be copied */
+    if (!sink->direct && sink->used == 0 && len >= sink->buffer_size) {
+        if (write_at(sink->fd, data, len, sink->buffer_offset) != 0) {
+            sink->error = errno;
+            return -1;
+        }
+        sink->buffer_offset += len;
+        return 0;
+    }
+
+    while (len > 0) {
+        n = sink->buffer_size - sink->used;
+        if (n > len)
+            n = len;
+
+        memcpy(sink->buffers[sink->current] + sink->used, data, n);
+        sink->used += n;
+        data += n;
+        len -= n;
+
+        if (sink->used == sink->buffer_size && write_buffer(sink) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Everything written so far reaches file. In direct mode unaligned tail is
+ * written through page cache and kept, the next aligned write covers it */
+int sink_flush(file_sink_t *sink)
+{
+    char *data = sink->buffers[sink->current];
+    size_t aligned;
+
+    if (wait_flushed(sink) != 0)
+        return -1;
+
+    if (sink->used == 0)
+        return 0;
+
+    if (!sink->direct) {
+        if (write_at(sink->fd, data, sink->used, sink->buffer_offset) != 0)
+            goto err;
+        sink->buffer_offset += sink->used;
+        sink->used = 0;
+        return 0;
+    }
+
+    aligned = sink->used & ~(size_t)(SINK_ALIGN - 1);
+    if (aligned && write_at(sink->fd, data, aligned, sink->buffer_offset) != 0)
+        goto err;
+
+    if (set_direct(sink, false) != 0 ||
+        write_at(sink->fd, data + aligned, sink->used - aligned, sink->buffer_offset + aligned) != 0 ||
+        set_direct(sink, true) != 0)
+        goto err;
+
+    memmove(data, data + aligned, sink->used - aligned);
+    sink->used -= aligned;
+    sink->buffer_offset += aligned;
+
+    return 0;
+
+err:
+    sink->error = errno;
+    return -1;
+}
+
+/* File offset where the next written byte goes */
+off_t sink_position(const file_sink_t *sink)
+{
+    return sink->buffer_offset + sink->used;
+}
+
+/* Bytes at current position have been written to descriptor directly, e.g.
+ * by splice. Buffered sink is flushed first, direct one can't be skipped */
+int sink_skip(file_sink_t *sink, size_t len)
+{
+    if (sink->direct || sink_flush(sink) != 0)
+        return -1;
+
+    sink->buffer_offset += len;
+
+    return 0;
+}
+
+/* Flush, sync by policy and close. Returns -1 if any data didn't reach file */
+int sink_close(file_sink_t *sink)
+{
+    int status = 0;
+
+    if (sink == NULL)
+        return 0;
+
+    if (sink->fd >= 0) {
+        if (sink_flush(sink) != 0)
+            status = -1;
+
+        if (sink->sync == SINK_SYNC_DATA && fdatasync(sink->fd) != 0)
+            status = -1;
+        else if (sink->sync == SINK_SYNC_FULL && fsync(sink->fd) != 0)
+            status = -1;
+    }
+
+    if (sink->thread_started) {
+        pthread_mutex_lock(&sink->lock);
+        sink->stop = true;
+        pthread_cond_signal(&sink->cond);
+        pthread_mutex_unlock(&sink->lock);
+        pthread_join(sink->thread, NULL);
+    }
+
+    if (sink->error) {
+        errno = sink->error;
+        perror("Failed to write file");
+        status = -1;
+    }
+
+    if (sink->fd >= 0 && close(sink->fd) != 0)
+        status = -1;
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->cond);
+    free(sink->buffers[0]);
+    free(sink->buffers[1]);
+    free(sink);
+
+    return status;
+}
+
+void print_sink_error(int error)
+{
+    if ((size_t)error >= sizeof(sink_errors)/sizeof(sink_errors[0])) {
+        LOG_E("Wrong error number");
+        return;
+    }
+
+    LOG_E("File sink problem: %s", sink_errors[error]);
+}
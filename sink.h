@@ -0,0 +1,70 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <cstddef>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Alignment of O_DIRECT buffers, offsets and lengths */
+#define SINK_ALIGN              4096
+#define SINK_DEFAULT_BUFFER     (1024*1024)
+
+#define SINK_NO_ERROR       0
+#define SINK_OPEN_ERROR     1
+#define SINK_BAD_ALLOC      2
+#define SINK_READ_ERROR     3
+#define SINK_THREAD_ERROR   4
+
+/* What reaches disk before file is reported as downloaded */
+enum sink_sync {
+    SINK_SYNC_NONE = 0,
+    SINK_SYNC_DATA,         /* fdatasync */
+    SINK_SYNC_FULL          /* fsync, metadata too */
+};
+
+typedef struct sink_options {
+    size_t          buffer_size;    /* Writes are coalesced up to this size */
+    bool            direct;         /* Bypass page cache if file system allows */
+    enum sink_sync  sync;
+} sink_options_t;
+
+/* Body written to file at explicit offsets through a large buffer. Known
+ * size is preallocated. With O_DIRECT two aligned buffers are used, a full
+ * one is written by flush thread while the other is filled */
+typedef struct file_sink {
+    int     fd;
+    bool    direct;
+    enum sink_sync sync;
+    size_t  expected;       /* Bytes to preallocate, 0 if unknown */
+
+    char    *buffers[2];
+    int     current;
+    size_t  buffer_size;
+    size_t  used;           /* Bytes in current buffer */
+    off_t   buffer_offset;  /* File offset of current buffer */
+    int     error;          /* errno of the first failed write */
+
+    /* Flush thread of direct mode, started with the first full buffer */
+    pthread_t       thread;
+    bool            thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    const char      *flush_data;
+    size_t          flush_len;
+    off_t           flush_offset;
+    bool            flushing;
+    bool            stop;
+} file_sink_t;
+
+void sink_set_defaults(const sink_options_t *options);
+bool sink_parse_sync(const char *name, enum sink_sync *sync);
+file_sink_t * sink_open(const char *path, off_t offset, size_t expected, int *error);
+int sink_write(file_sink_t *sink, const char *data, size_t len);
+int sink_flush(file_sink_t *sink);
+off_t sink_position(const file_sink_t *sink);
+int sink_skip(file_sink_t *sink, size_t len);
+int sink_close(file_sink_t *sink);
+void print_sink_error(int error);
+
+#endif // SINK_H
@@ -0,0 +1,220 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <pthread.h>
+
+#include "log.h"
+
+/* Durations which are aggregated, in microseconds */
+enum trace_span {
+    SPAN_DNS = 0,
+    SPAN_CONNECT,
+    SPAN_WRITE,
+    SPAN_TTFB,
+    SPAN_TRANSFER,
+    SPAN_TOTAL,
+    SPANS
+};
+
+static const char *span_names[] = {
+    "dns", "connect", "write", "ttfb", "transfer", "total"
+};
+
+/* Pairs of phases which limit each span, total starts at the first phase */
+static const enum trace_phase span_limits[][2] = {
+    { TRACE_DNS_START,      TRACE_DNS_DONE },
+    { TRACE_CONNECT_START,  TRACE_CONNECTED },
+    { TRACE_SEND_START,     TRACE_SENT },
+    { TRACE_SENT,           TRACE_FIRST_BYTE },
+    { TRACE_FIRST_BYTE,     TRACE_DONE },
+    { TRACE_DNS_START,      TRACE_DONE }
+};
+
+bool trace_enabled = false;
+
+static FILE *trace_file = NULL;
+static histogram_t *histograms = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Start writing JSON line per request to path, - is stderr */
+int trace_open(const char *path)
+{
+    histograms = (histogram_t *)calloc(SPANS, sizeof(histogram_t));
+    if (!histograms)
+        return -1;
+
+    if (strcmp(path, "-") == 0) {
+        trace_file = stderr;
+    }
+    else {
+        trace_file = fopen(path, "w");
+        if (!trace_file) {
+            perror("Failed to open trace file");
+            free(histograms);
+            histograms = NULL;
+            return -1;
+        }
+    }
+
+    trace_enabled = true;
+
+    return 0;
+}
+
+void trace_close()
+{
+    trace_enabled = false;
+
+    if (trace_file && trace_file != stderr)
+        fclose(trace_file);
+    trace_file = NULL;
+
+    free(histograms);
+    histograms = NULL;
+}
+
+void trace_mark(trace_t *trace, enum trace_phase phase)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace->at[phase] = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value)
+{
+    int shift;
+
+    if (value < 2 * HISTOGRAM_SUB_COUNT)
+        return value;
+
+    shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+
+    return shift * HISTOGRAM_SUB_COUNT + (value >> shift);
+}
+
+/* The highest value which falls into bucket */
+static uint64_t bucket_value(int index)
+{
+    int shift;
+
+    if (index < 2 * HISTOGRAM_SUB_COUNT)
+        return index;
+
+    shift = index / HISTOGRAM_SUB_COUNT - 1;
+
+    return (((uint64_t)(index - shift * HISTOGRAM_SUB_COUNT) + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/* Value below which percentile (0-100) of recorded values lie */
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+    uint64_t rank, seen = 0;
+
+    if (histogram->total == 0)
+        return 0;
+
+    rank = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+            return bucket_value(i) < histogram->max ? bucket_value(i) : histogram->max;
+    }
+
+    return histogram->max;
+}
+
+/* Microseconds of span, -1 if one of its phases is missing */
+static long long span_us(const trace_t *trace, int span)
+{
+    uint64_t begin = trace->at[span_limits[span][0]], end = trace->at[span_limits[span][1]];
+
+    /* Reused connection doesn't resolve or connect */
+    if (span == SPAN_TOTAL) {
+        for (int p = TRACE_DNS_START; !begin && p < TRACE_DONE; ++p)
+            begin = trace->at[p];
+    }
+
+    if (!begin || !end || end < begin)
+        return -1;
+
+    return (end - begin) / 1000;
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+}
+
+/* Write JSON line of request and add its spans to histograms */
+void trace_request(const trace_t *trace, const char *host, const char *port, const char *path,
+                   int response_code, size_t bytes, bool reused)
+{
+    long long us;
+
+    if (!trace_enabled)
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+
+    fprintf(trace_file, "{\"url\":\"http://");
+    print_json_string(trace_file, host);
+    fprintf(trace_file, ":%s", port);
+    print_json_string(trace_file, path);
+    fprintf(trace_file, "\",\"status\":%d,\"bytes\":%zu,\"reused\":%s",
+            response_code, bytes, reused ? "true" : "false");
+
+    for (int span = 0; span < SPANS; ++span) {
+        us = span_us(trace, span);
+        if (us < 0) {
+            fprintf(trace_file, ",\"%s_us\":null", span_names[span]);
+            continue;
+        }
+        fprintf(trace_file, ",\"%s_us\":%lld", span_names[span], us);
+        histogram_record(&histograms[span], us);
+    }
+
+    fprintf(trace_file, "}\n");
+    fflush(trace_file);
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_print_summary()
+{
+    const histogram_t *h;
+
+    if (!trace_enabled)
+        return;
+
+    LOG_I("\n%-10s %8s %10s %10s %10s %10s", "Latency ms", "count", "p50", "p99", "p999", "max");
+    for (int span = 0; span < SPANS; ++span) {
+        h = &histograms[span];
+        LOG_I("%-10s %8llu %10.3f %10.3f %10.3f %10.3f", span_names[span],
+              (unsigned long long)h->total,
+              histogram_percentile(h, 50) / 1000.0, histogram_percentile(h, 99) / 1000.0,
+              histogram_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+    }
+}
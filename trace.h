@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <cstddef>
+
+enum trace_phase {
+    TRACE_DNS_START = 0,
+    TRACE_DNS_DONE,
+    TRACE_CONNECT_START,
+    TRACE_CONNECTED,
+    TRACE_SEND_START,
+    TRACE_SENT,
+    TRACE_FIRST_BYTE,
+    TRACE_DONE,
+    TRACE_PHASES
+};
+
+/* Monotonic timestamps in nanoseconds, 0 if phase hasn't been reached */
+typedef struct trace {
+    uint64_t    at[TRACE_PHASES];
+} trace_t;
+
+/* Log-linear buckets like in HdrHistogram: values below 64 are exact,
+ * above that every power of two is split into 32 buckets (~3% error) */
+#define HISTOGRAM_SUB_BITS      5
+#define HISTOGRAM_SUB_COUNT     (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct histogram {
+    uint64_t    counts[HISTOGRAM_BUCKETS];
+    uint64_t    total;
+    uint64_t    max;
+} histogram_t;
+
+/* Tracing is off unless trace_open() has been called, then marks cost
+ * only a predictable branch */
+extern bool trace_enabled;
+
+#define TRACE_MARK(trace, phase) \
+    do { if (__builtin_expect(trace_enabled, 0)) trace_mark(trace, phase); } while (0)
+
+/* Keeps the first time phase has been reached */
+#define TRACE_MARK_ONCE(trace, phase) \
+    do { if (__builtin_expect(trace_enabled, 0) && !(trace)->at[phase]) \
+        trace_mark(trace, phase); } while (0)
+
+int trace_open(const char *path);
+void trace_close();
+void trace_mark(trace_t *trace, enum trace_phase phase);
+void trace_request(const trace_t *trace, const char *host, const char *port, const char *path,
+                   int response_code, size_t bytes, bool reused);
+void trace_print_summary();
+void histogram_record(histogram_t *histogram, uint64_t value);
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+
+#endif // TRACE_H
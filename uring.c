@@ -0,0 +1,235 @@
+#include "uring.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static const char *uring_errors[] = {
+  "No error",
+  "Failed to set up io_uring",
+  "Failed to map io_uring queues",
+  "Kernel lacks io_uring operations"
+};
+
+/* There is no libc wrapper for io_uring calls */
+static int sys_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Receive and write to file at offset appeared in 5.6 */
+static bool supports_ops(int fd)
+{
+    static const int needed[] = { IORING_OP_RECV, IORING_OP_WRITE };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    bool supported = probe != NULL;
+
+    if (probe && sys_register(fd, IORING_REGISTER_PROBE, probe, 256) != 0)
+        supported = false;
+
+    for (size_t i = 0; supported && i < sizeof(needed)/sizeof(needed[0]); ++i) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = false;
+    }
+
+    free(probe);
+
+    return supported;
+}
+
+/* Returns 0 or error, ring is left unusable on error */
+int uring_init(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+    int error = URING_MAP_ERROR;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&params, 0, sizeof params);
+
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0)
+        return URING_SETUP_ERROR;
+
+    if (!supports_ops(ring->fd)) {
+        error = URING_UNSUPPORTED;
+        goto err;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Both rings are in one mapping on kernels since 5.4 */
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto err;
+    }
+
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    sq = (char *)ring->sq_ring;
+    cq = ring->cq_ring ? (char *)ring->cq_ring : sq;
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return URING_NO_ERROR;
+
+err:
+    uring_exit(ring);
+    return error;
+}
+
+void uring_exit(uring_t *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+static unsigned sq_free(uring_t *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return ring->sq_entries - (ring->sq_local_tail - head);
+}
+
+/* Make room for count entries which must reach kernel in one submit, e.g.
+ * a linked chain. Returns -1 if queue can't hold them */
+int uring_reserve(uring_t *ring, unsigned count)
+{
+    if (sq_free(ring) >= count)
+        return 0;
+
+    if (uring_submit(ring) < 0 || sq_free(ring) < count)
+        return -1;
+
+    return 0;
+}
+
+/* Cleared entry queued for the next submit, NULL if queue is full */
+struct io_uring_sqe * uring_get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    if (sq_free(ring) == 0 && (uring_submit(ring) < 0 || sq_free(ring) == 0))
+        return NULL;
+
+    index = ring->sq_local_tail & ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/* Pass queued entries to kernel without waiting for completions. Returns
+ * number of submitted entries or -1 */
+int uring_submit(uring_t *ring)
+{
+    int n;
+
+    if (ring->to_submit == 0)
+        return 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    do {
+        n = sys_enter(ring->fd, ring->to_submit, 0, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    ring->to_submit -= n;
+
+    return n;
+}
+
+/* Oldest completion not seen yet, or NULL */
+struct io_uring_cqe * uring_peek_cqe(uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Give slot of the peeked completion back to kernel */
+void uring_cqe_seen(uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void print_uring_error(int error)
+{
+    if ((size_t)error >= sizeof(uring_errors)/sizeof(uring_errors[0])) {
+        LOG_E("Wrong error number");
+        return;
+    }
+
+    LOG_E("io_uring problem: %s", uring_errors[error]);
+}
@@ -0,0 +1,49 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+
+#define URING_NO_ERROR      0
+#define URING_SETUP_ERROR   1   /* Kernel has no io_uring or it's disabled */
+#define URING_MAP_ERROR     2
+#define URING_UNSUPPORTED   3   /* Operations used by client are missing */
+
+/* Submission and completion queues of io_uring set up by raw system calls.
+ * Requests are queued locally and passed to kernel together by submit */
+typedef struct uring {
+    int         fd;
+
+    unsigned    *sq_head;
+    unsigned    *sq_tail;
+    unsigned    sq_mask;
+    unsigned    sq_entries;
+    unsigned    *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned    sq_local_tail;  /* Queued but not yet visible to kernel */
+    unsigned    to_submit;
+
+    unsigned    *cq_head;
+    unsigned    *cq_tail;
+    unsigned    cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void        *sq_ring;
+    void        *cq_ring;
+    size_t      sq_ring_size;
+    size_t      cq_ring_size;
+    size_t      sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+int uring_reserve(uring_t *ring, unsigned count);
+struct io_uring_sqe * uring_get_sqe(uring_t *ring);
+int uring_submit(uring_t *ring);
+struct io_uring_cqe * uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+void print_uring_error(int error);
+
+#endif // URING_H
@@ -1,11 +1,24 @@
 #include "url.h"
+#include "scan.h"
 #include "log.h"
 
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
-
-#define MAX_URL_LENGTH 2048
+#include <cctype>
+#include <strings.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFAULT_PATH "/index.html"
+#define DEFAULT_FILE "index.html"
+/* Smallest part of url list worth a thread */
+#define LIST_SLICE_SIZE (64*1024)
+#define LIST_MAX_THREADS 64
 #define DEFAULT_HTTP_PORT "80"
 #define DEFAULT_HTTPS_PORT "423"
 
@@ -38,14 +51,18 @@ static const char *url_errors[] = {
 #define URL_TOO_LONG                6
   "Url too long",
 #define URL_BAD_ALLOC               7
-  "Bad alloc"
+  "Bad alloc",
+#define URL_READ_ERROR              8
+  "Failed to read url list"
 };
 
-int parse_scheme(const char *url, enum url_scheme *scheme)
+static int parse_scheme(const char *url, size_t len, enum url_scheme *scheme)
 {
     for (int i = 0; supported_schemes[i].name; ++i)
     {
-        if (0 == strncmp (url, supported_schemes[i].name, strlen(supported_schemes[i].name) )) {
+        size_t name_len = strlen(supported_schemes[i].name);
+
+        if (len >= name_len && 0 == strncasecmp(url, supported_schemes[i].name, name_len)) {
             *scheme = (url_scheme) i;
             return URL_NO_ERROR;
         }
@@ -54,205 +71,472 @@ int parse_scheme(const char *url, enum url_scheme *scheme)
     return URL_UNSOPORTED_SCHEME;
 }
 
-int parse_user_info(const char *begin, const char *end, char **user, char **password)
+/* Space and control characters end up in request line, don't let them */
+static bool invalid_char(char c)
 {
-    const char *separator = strchr(begin, ':');
-    if (separator == NULL || separator > end) {
-        return URL_INVALID_USER_NAME;
-    }
+    return (unsigned char)c <= ' ' || c == 0x7f;
+}
 
-    size_t user_len = separator - begin;
-    size_t password_len =  end - separator;
+static url_span_t span(const char *url, const char *begin, const char *end)
+{
+    url_span_t s = { (uint16_t)(begin - url), (uint16_t)(end - begin) };
+    return s;
+}
 
-    *user = strndup(begin, user_len);
-    *password = strndup(separator+1, password_len);
+static int parse_user_info(const char *url, const char *begin, const char *end, url_view_t *view)
+{
+    const char *separator = (const char *)memchr(begin, ':', end - begin);
+    if (separator == NULL) {
+        return URL_INVALID_USER_NAME;
+    }
 
-    if (*user == NULL || *password == NULL)
-        return URL_BAD_ALLOC;
-    LOG_I("We don't support htpp authentification");
-    LOG_D("user=%s password=%s", *user, *password);
+    view->user = span(url, begin, separator);
+    view->password = span(url, separator + 1, end);
 
     return URL_NO_ERROR;
 }
 
-int parse_port(const char *begin, const char *end, char **port)
+static int parse_port(const char *url, const char *begin, const char *end, url_view_t *view)
 {
-    size_t port_len = end - begin;
-    if (port_len > 5) {
+    long port = 0;
+
+    /* "host:" means default port */
+    if (begin == end)
+        return URL_NO_ERROR;
+
+    if (end - begin > 5)
         return URL_INVALID_PORT_NUMBER;
-    }
 
-    *port = strndup(begin+1, port_len);
-    if (*port == NULL) {
-        return URL_BAD_ALLOC;
+    for (const char *p = begin; p < end; ++p) {
+        if (!isdigit((unsigned char)*p))
+            return URL_INVALID_PORT_NUMBER;
+        port = port * 10 + (*p - '0');
     }
 
-    LOG_D("port=%s", *port);
+    if (port == 0 || port > 65535)
+        return URL_INVALID_PORT_NUMBER;
+
+    view->port = span(url, begin, end);
 
     return URL_NO_ERROR;
 }
 
-int parse_host(const char *begin, const char *end, char **host)
+/* Host is either a name, IPv4 or bracketed IPv6 address, port may follow */
+static int parse_host(const char *url, const char *begin, const char *end, url_view_t *view)
 {
-    if(end) {
-        size_t host_len = end - begin;
-        *host = strndup(begin, host_len);
+    const char *host_end, *port_begin;
+
+    if (begin < end && *begin == '[') {
+        host_end = (const char *)memchr(begin, ']', end - begin);
+        if (host_end == NULL || (host_end + 1 < end && host_end[1] != ':'))
+            return URL_INVALID_HOST;
+        begin++;
+        port_begin = host_end + 1;
     }
     else {
-        *host = strdup(begin);
+        host_end = (const char *)memchr(begin, ':', end - begin);
+        if (host_end == NULL)
+            host_end = end;
+        port_begin = host_end;
     }
 
-    if(*host == NULL)
-        return URL_BAD_ALLOC;
+    if (host_end == begin)
+        return URL_INVALID_HOST;
+    view->host = span(url, begin, host_end);
 
-    LOG_D("host=%s", *host);
+    if (port_begin < end)
+        return parse_port(url, port_begin + 1, end, view);
 
     return URL_NO_ERROR;
 }
 
-int parse_path(const char *begin, const char *end, char **path, char **file)
+/* Path, query and fragment are found in one pass, file name is the last
+ * segment of path */
+static int parse_path(const char *url, const char *begin, const char *end, url_view_t *view)
 {
-    char *file_start = 0;
+    const char *p = begin, *segment = NULL;
+
+    if (p < end && *p == '/') {
+        for (; p < end && *p != '?' && *p != '#'; ++p) {
+            if (*p == '/')
+                segment = p + 1;
+            else if (invalid_char(*p))
+                return URL_INVALID_PATH;
+        }
+        view->path = span(url, begin, p);
+        view->file = span(url, segment, p);
+    }
 
-    /* Path is empty. In this case create index.html */
-    if(!begin) {
-        *path = strdup("/index.html");
-        *file = strdup("index.html");
-        goto exit;
+    if (p < end && *p == '?') {
+        begin = ++p;
+        for (; p < end && *p != '#'; ++p) {
+            if (invalid_char(*p))
+                return URL_INVALID_PATH;
+        }
+        view->query = span(url, begin, p);
     }
 
-    if (end) {
-        /* In case of query */
-        size_t path_len = end - begin;
-        *path = strndup(begin, path_len);
+    if (p < end && *p == '#') {
+        begin = ++p;
+        for (; p < end; ++p) {
+            if (invalid_char(*p))
+                return URL_INVALID_PATH;
+        }
+        view->fragment = span(url, begin, p);
     }
-    else {
-        *path = strdup(begin);
+
+    return p == end ? URL_NO_ERROR : URL_INVALID_PATH;
+}
+
+/* Parse without copying anything, url doesn't have to be terminated */
+int url_parse_view(const char *url, size_t len, url_view_t *view)
+{
+    const char *p, *end = url + len, *authority, *at = NULL;
+    int error_code;
+
+    memset(view, 0, sizeof *view);
+
+    if (len > URL_MAX_LENGTH)
+        return URL_TOO_LONG;
+
+    error_code = parse_scheme(url, len, &view->scheme);
+    if (error_code)
+        return error_code;
+
+    /* Authority ends where path, query or fragment begins */
+    authority = url + strlen(supported_schemes[view->scheme].name);
+    for (p = authority; p < end && *p != '/' && *p != '?' && *p != '#'; ++p) {
+        if (*p == '@')
+            at = p;
+        else if (invalid_char(*p))
+            return URL_INVALID_HOST;
+    }
+
+    if (at) {
+        error_code = parse_user_info(url, authority, at, view);
+        if (error_code)
+            return error_code;
+        authority = at + 1;
     }
 
-    /* Find file name  in path */
-    file_start = strrchr(*path, '/') + 1;
-    if (file_start)
-        *file = strdup(file_start);
+    error_code = parse_host(url, authority, p, view);
+    if (error_code)
+        return error_code;
 
-exit:
-    if (*file == NULL || *path == NULL)
-        return URL_BAD_ALLOC;
+    return parse_path(url, p, end, view);
+}
+
+static char * put_string(char **out, const char *s, size_t len)
+{
+    char *copy = *out;
 
-    LOG_D("path=%s file=%s", *path, *file);
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    *out += len + 1;
 
-    return URL_NO_ERROR;
+    return copy;
 }
 
+static char * put_span(char **out, const char *url, url_span_t span)
+{
+    if (!URL_SPAN_PRESENT(span))
+        return NULL;
 
-url_t* parse_url(const char *url, int *error_)
+    return put_string(out, url + span.offset, span.length);
+}
+
+/* Copy parts of parsed url into one allocation with url_t */
+url_t* url_from_view(const char *url, const url_view_t *view, int *error)
 {
-    url_t *u = 0;
-    enum url_scheme scheme;
-    int error_code;
+    const char *port = supported_schemes[view->scheme].default_port;
+    const char *path = DEFAULT_PATH, *file = DEFAULT_FILE;
+    size_t port_len = strlen(port), path_len = strlen(path), file_len = strlen(file);
+    size_t size, target_len;
+    char *out;
+    url_t *u;
+
+    if (URL_SPAN_PRESENT(view->port)) {
+        port = url + view->port.offset;
+        port_len = view->port.length;
+    }
+    if (URL_SPAN_PRESENT(view->path)) {
+        path = url + view->path.offset;
+        path_len = view->path.length;
+    }
+    /* Directory is saved like a path without file */
+    if (URL_SPAN_PRESENT(view->path) && view->file.length > 0) {
+        file = url + view->file.offset;
+        file_len = view->file.length;
+    }
 
-    const char *user_begin, *user_end;
-    const char *host_begin, *host_end;
-    const char *port_begin, *port_end;
-    const char *path_begin, *path_end;
+    target_len = path_len;
+    if (URL_SPAN_PRESENT(view->query))
+        target_len += 1 + view->query.length;
 
-    u = (url_t *)calloc(1, sizeof(url_t));
+    /* Every part is terminated, the absent ones take a byte too */
+    size = sizeof(url_t) + view->user.length + view->password.length + view->host.length +
+           port_len + path_len + view->query.length + view->fragment.length +
+           file_len + target_len + 9;
+
+    u = (url_t *)malloc(size);
     if (!u) {
-        error_code = URL_BAD_ALLOC;
-        goto err;
+        if (error)
+            *error = URL_BAD_ALLOC;
+        return NULL;
     }
 
-    if (strlen(url) > MAX_URL_LENGTH) {
-        error_code = URL_TOO_LONG;
-        goto err;
+    out = (char *)(u + 1);
+    u->scheme = view->scheme;
+    u->user = put_span(&out, url, view->user);
+    u->password = put_span(&out, url, view->password);
+    u->host = put_span(&out, url, view->host);
+    u->port = put_string(&out, port, port_len);
+    u->path = put_string(&out, path, path_len);
+    u->query = put_span(&out, url, view->query);
+    u->fragment = put_span(&out, url, view->fragment);
+    u->file = put_string(&out, file, file_len);
+
+    u->target = out;
+    memcpy(out, path, path_len);
+    if (u->query) {
+        out[path_len] = '?';
+        memcpy(out + path_len + 1, u->query, view->query.length);
     }
+    out[target_len] = '\0';
 
+    if (u->user) {
+        LOG_I("We don't support htpp authentification");
+        LOG_D("user=%s password=%s", u->user, u->password);
+    }
+    LOG_D("host=%s port=%s", u->host, u->port);
+    LOG_D("path=%s file=%s", u->path, u->file);
 
-    error_code = parse_scheme(url, &scheme);
-    if(error_code) { goto err; }
-    u->scheme = scheme;
+    return u;
+}
 
-    /* find username and password */
-    user_begin = url + strlen(supported_schemes[scheme].name);
-    user_end = strchr (user_begin, '@');
-    if (!user_end || *user_end != '@') {
-        /*user information is empty*/
-        user_end = user_begin;
-        host_begin = user_begin;
-    }
-    else {
-        error_code = parse_user_info(user_begin, user_end-1, &u->user, &u->password);
-        if(error_code) { goto err; }
+url_t* parse_url(const char *url, int *error_)
+{
+    url_view_t view;
+    int error_code;
 
-        host_begin = user_end + 1;
+    error_code = url_parse_view(url, strnlen(url, URL_MAX_LENGTH + 1), &view);
+    if (error_code) {
+        if (error_)
+            *error_ = error_code;
+        return NULL;
     }
 
-    /* Find path */
-    path_begin = strchr(host_begin, '/');
-    path_end = strchr(host_begin, '?');
-    error_code = parse_path(path_begin, path_end, &u->path, &u->file);
-    if(error_code) { goto err; }
+    return url_from_view(url, &view, error_);
+}
 
+void free_url(url_t *url)
+{
+    free(url);
+}
 
-    /* Find port */
-    port_begin = strchr(host_begin, ':');
-    port_end = path_begin;
-    /* there is non default port */
-    if (port_begin) {
-        error_code = parse_port(port_begin, port_end-1, &u->port);
-        if(error_code) { goto err; }
+/* Next url of list data with surrounding spaces trimmed. Empty lines and
+ * comments are skipped */
+static const char * next_line(const char **pos, const char *end, size_t *len)
+{
+    const char *line, *line_end;
 
-        host_end = port_begin;
-    }
-    else {
-        u->port = strdup(supported_schemes[scheme].default_port);
-        host_end = path_begin;
+    while (*pos < end) {
+        line = *pos;
+        line_end = scan_char(line, end, '\n');
+        *pos = line_end < end ? line_end + 1 : end;
+
+        while (line < line_end && isspace((unsigned char)*line))
+            line++;
+        while (line_end > line && isspace((unsigned char)line_end[-1]))
+            line_end--;
+
+        if (line == line_end || *line == '#')
+            continue;
+
+        *len = line_end - line;
+        return line;
     }
 
-    error_code = parse_host(host_begin, host_end, &u->host);
-    if(error_code) { goto err; }
+    return NULL;
+}
 
-    return u;
+/* Part of list data handled by one thread, it starts at a line */
+typedef struct list_slice {
+    url_list_t  *list;
+    const char  *begin;
+    const char  *end;
+    size_t      first;      /* Index of its first entry */
+    size_t      count;
+} list_slice_t;
 
-err:
-    if(error_)
-        *error_ = error_code;
+static void * count_lines(void *arg)
+{
+    list_slice_t *slice = (list_slice_t *)arg;
+    const char *pos = slice->begin;
+    size_t len;
 
-    free_url(u);
+    while (next_line(&pos, slice->end, &len))
+        slice->count++;
 
     return NULL;
 }
 
-void free_url(url_t *url)
+static void * parse_lines(void *arg)
 {
-    if (!url)
-        return;
+    list_slice_t *slice = (list_slice_t *)arg;
+    url_entry_t *entry = slice->list->entries + slice->first;
+    const char *pos = slice->begin, *line;
+    size_t len;
+
+    while ((line = next_line(&pos, slice->end, &len)) != NULL) {
+        entry->line = line - slice->list->data;
+        entry->length = len > URL_MAX_LENGTH ? URL_MAX_LENGTH : len;
+        entry->error = url_parse_view(line, len, &entry->view);
+        entry++;
+    }
 
-    if (url->user)
-        free(url->user);
+    return NULL;
+}
 
-    if (url->password)
-        free(url->password);
+/* Run function for every slice, the first one in caller thread */
+static void run_slices(list_slice_t *slices, int count, void *(*fn)(void *))
+{
+    pthread_t threads[LIST_MAX_THREADS];
+    bool started[LIST_MAX_THREADS];
 
-    if (url->host)
-        free(url->host);
+    for (int i = 1; i < count; ++i)
+        started[i] = pthread_create(&threads[i], NULL, fn, &slices[i]) == 0;
 
-    if (url->port)
-        free(url->port);
+    fn(&slices[0]);
 
-    if (url->path)
-        free(url->path);
+    for (int i = 1; i < count; ++i) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn(&slices[i]);
+    }
+}
 
-    if (url->query)
-        free(url->query);
+/* Map url list file and parse its lines by several threads. Lines are
+ * counted first so that entries are allocated once and keep file order */
+url_list_t * url_list_load(const char *path, int threads, int *error)
+{
+    url_list_t *list = NULL;
+    list_slice_t *slices = NULL;
+    struct stat st;
+    const char *boundary;
+    int fd, error_code = URL_READ_ERROR;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open url list");
+        goto err;
+    }
 
-    if (url->fragment)
-        free(url->fragment);
+    list = (url_list_t *)calloc(1, sizeof(url_list_t));
+    if (!list) {
+        error_code = URL_BAD_ALLOC;
+        goto err;
+    }
 
-    if (url->file)
-        free(url->file);
+    list->size = st.st_size;
+    if (list->size > 0) {
+        list->data = (char *)mmap(NULL, list->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (list->data == MAP_FAILED) {
+            list->data = NULL;
+            perror("Failed to map url list");
+            goto err;
+        }
+        madvise(list->data, list->size, MADV_SEQUENTIAL);
+    }
 
-    free(url);
+    if (threads < 1)
+        threads = 1;
+    if (threads > LIST_MAX_THREADS)
+        threads = LIST_MAX_THREADS;
+    if ((size_t)threads > list->size / LIST_SLICE_SIZE + 1)
+        threads = list->size / LIST_SLICE_SIZE + 1;
+
+    slices = (list_slice_t *)calloc(threads, sizeof(list_slice_t));
+    if (!slices) {
+        error_code = URL_BAD_ALLOC;
+        goto err;
+    }
+
+    /* Slice boundaries are moved to the beginning of the next line */
+    boundary = list->data;
+    for (int i = 0; i < threads; ++i) {
+        const char *end = list->data + list->size * (i + 1) / threads;
+
+        if (end < boundary)
+            end = boundary;
+        if (i < threads - 1) {
+            end = scan_char(end, list->data + list->size, '\n');
+            if (end < list->data + list->size)
+                end++;
+        }
+
+        slices[i].list = list;
+        slices[i].begin = boundary;
+        slices[i].end = end;
+        boundary = end;
+    }
+
+    run_slices(slices, threads, count_lines);
+
+    for (int i = 0; i < threads; ++i) {
+        slices[i].first = list->count;
+        list->count += slices[i].count;
+    }
+
+    list->entries = (url_entry_t *)malloc(list->count * sizeof(url_entry_t) + 1);
+    if (!list->entries) {
+        error_code = URL_BAD_ALLOC;
+        goto err;
+    }
+
+    run_slices(slices, threads, parse_lines);
+
+    free(slices);
+    close(fd);
+
+    return list;
+
+err:
+    if (error)
+        *error = error_code;
+
+    free(slices);
+    url_list_free(list);
+    if (fd >= 0)
+        close(fd);
+
+    return NULL;
+}
+
+/* Copy of url at index, NULL with error if its line is invalid */
+url_t * url_list_get(const url_list_t *list, size_t index, int *error)
+{
+    const url_entry_t *entry = &list->entries[index];
+
+    if (entry->error) {
+        if (error)
+            *error = entry->error;
+        return NULL;
+    }
+
+    return url_from_view(list->data + entry->line, &entry->view, error);
+}
+
+void url_list_free(url_list_t *list)
+{
+    if (!list)
+        return;
+
+    if (list->data)
+        munmap(list->data, list->size);
+    free(list->entries);
+    free(list);
 }
 
 void print_url(url_t *url)
@@ -266,12 +550,14 @@ void print_url(url_t *url)
     LOG_I("host: %s", url->host);
     LOG_I("port: %s", url->port);
     LOG_I("path: %s", url->path);
+    LOG_I("query: %s", url->query);
+    LOG_I("fragment: %s", url->fragment);
     LOG_I("file: %s", url->file);
 }
 
 void print_url_error(int error)
 {
-    if((size_t)error > sizeof(url_errors)) {
+    if((size_t)error >= sizeof(url_errors) / sizeof(url_errors[0])) {
         LOG_E("Wrong error number");
         return;
     }
@@ -1,13 +1,41 @@
 #ifndef URL_H
 #define URL_H
 
+#include <cstddef>
+#include <cstdint>
+
+#define URL_MAX_LENGTH 2048
+
 enum url_scheme {
     SCHEME_HTTP = 0,
     SCHEME_HTTPS, /* Unsuported yet */
     SCHEME_INVALID
 };
 
-/* scheme:[//[user:password@]host[:port]][/]path[?query][#fragment] */
+/* Part of url string. Nothing starts at offset 0 where scheme is, so
+ * offset 0 means the part is absent; present part may be empty */
+typedef struct url_span {
+    uint16_t offset;
+    uint16_t length;
+} url_span_t;
+
+#define URL_SPAN_PRESENT(span) ((span).offset != 0)
+
+/* Url parsed in place in one pass, parts are spans of the string */
+typedef struct url_view {
+    enum url_scheme scheme;
+    url_span_t user;
+    url_span_t password;
+    url_span_t host;        /* Without brackets of IPv6 literal */
+    url_span_t port;        /* Absent if default */
+    url_span_t path;        /* Absent if url has no path */
+    url_span_t query;
+    url_span_t fragment;
+    url_span_t file;        /* Last segment of path */
+} url_view_t;
+
+/* scheme:[//[user:password@]host[:port]][/]path[?query][#fragment]
+ * Strings are stored in the same allocation as the structure */
 typedef struct url {
     enum url_scheme scheme;
     char *user;
@@ -18,11 +46,34 @@ typedef struct url {
     char *query;
     char *fragment;
     char *file;
+    char *target;   /* Path with query, as sent in request line */
 } url_t;
 
+/* Urls of a list file parsed by several threads. Entries keep only
+ * offsets of their lines in mapped file */
+typedef struct url_entry {
+    size_t      line;
+    uint16_t    length;
+    uint8_t     error;
+    url_view_t  view;
+} url_entry_t;
+
+typedef struct url_list {
+    char        *data;      /* Mapped file */
+    size_t      size;
+    url_entry_t *entries;
+    size_t      count;
+} url_list_t;
+
+int url_parse_view(const char *url, size_t len, url_view_t *view);
+url_t* url_from_view(const char *url, const url_view_t *view, int *error);
 url_t* parse_url(const char *url, int *error);
 void print_url(url_t *url);
 void print_url_error(int error);
 void free_url(url_t *url);
 
+url_list_t * url_list_load(const char *path, int threads, int *error);
+url_t * url_list_get(const url_list_t *list, size_t index, int *error);
+void url_list_free(url_list_t *list);
+
 #endif // URL_H